@@ -0,0 +1,165 @@
+#ifndef __FV_BATCH_HPP__
+#define __FV_BATCH_HPP__
+
+
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "common_funcs.hpp"
+#include "req_res.hpp"
+#include "session.hpp"
+
+
+
+namespace fv {
+struct BatchResult {
+	size_t Index = 0;
+	Response Res {};
+	// empty on success, otherwise the exception message
+	std::string Error = "";
+
+	bool IsOk () const { return Error == ""; }
+};
+
+
+
+// Runs many requests over the session pool, at most MaxConcurrency at a time and at most
+// MaxPerHost at a time against one schema://host:port. Requests start as soon as the
+// batch is created; results are taken with Next (completion order) or All (request order).
+// Requests still running when the Batch is destroyed finish in the background.
+class Batch {
+public:
+	Batch (std::vector<Request> _reqs, size_t _max_concurrency = 64, size_t _max_per_host = 8): m_state (std::make_shared<State> ()) {
+		m_state->MaxConcurrency = std::max<size_t> (_max_concurrency, 1);
+		m_state->MaxPerHost = std::max<size_t> (_max_per_host, 1);
+		m_state->Total = _reqs.size ();
+		for (size_t i = 0; i < _reqs.size (); ++i) {
+			auto [_schema, _host, _port, _path] = _parse_url (_reqs [i].Url);
+			std::string _key = fmt::format ("{}://{}:{}", _schema, _host, _port);
+			auto &_queue = m_state->Hosts [_key];
+			_queue.Pending.push_back (std::move (_reqs [i]));
+			_queue.Indexes.push_back (i);
+			if (!_queue.InReady) {
+				_queue.InReady = true;
+				m_state->Ready.push_back (_key);
+			}
+		}
+		_Pump (m_state);
+	}
+
+	size_t Size () const { return m_state->Total; }
+
+	// Next finished request, nullopt once every result has been taken
+	Task<std::optional<BatchResult>> Next () {
+		while (true) {
+			std::unique_lock _ul { m_state->Mtx };
+			if (!m_state->Finished.empty ()) {
+				BatchResult _ret = std::move (m_state->Finished.front ());
+				m_state->Finished.pop_front ();
+				m_state->Taken++;
+				co_return _ret;
+			}
+			if (m_state->Taken >= m_state->Total)
+				co_return std::nullopt;
+			m_state->Changed.Reset ();
+			_ul.unlock ();
+			co_await m_state->Changed.Wait ();
+		}
+	}
+
+	// Every remaining result, in request order
+	Task<std::vector<BatchResult>> All () {
+		std::vector<BatchResult> _ret;
+		while (true) {
+			auto _item = co_await Next ();
+			if (!_item.has_value ())
+				break;
+			_ret.push_back (std::move (_item.value ()));
+		}
+		std::sort (_ret.begin (), _ret.end (), [] (const BatchResult &_a, const BatchResult &_b) { return _a.Index < _b.Index; });
+		co_return _ret;
+	}
+
+private:
+	struct HostQueue {
+		std::deque<Request> Pending;
+		std::deque<size_t> Indexes;
+		size_t Running = 0;
+		bool InReady = false;
+	};
+
+	struct State {
+		std::mutex Mtx;
+		size_t MaxConcurrency = 64, MaxPerHost = 8, Total = 0, Taken = 0, Running = 0;
+		std::unordered_map<std::string, HostQueue> Hosts;
+		// hosts that have pending requests and room below MaxPerHost
+		std::deque<std::string> Ready;
+		std::deque<BatchResult> Finished;
+		AsyncEvent Changed {};
+	};
+
+	static void _Pump (std::shared_ptr<State> _state) {
+		std::unique_lock _ul { _state->Mtx };
+		while (_state->Running < _state->MaxConcurrency && !_state->Ready.empty ()) {
+			std::string _key = std::move (_state->Ready.front ());
+			_state->Ready.pop_front ();
+			auto &_queue = _state->Hosts [_key];
+			Request _r = std::move (_queue.Pending.front ());
+			size_t _index = _queue.Indexes.front ();
+			_queue.Pending.pop_front ();
+			_queue.Indexes.pop_front ();
+			_queue.Running++;
+			_state->Running++;
+			_queue.InReady = _queue.Running < _state->MaxPerHost && !_queue.Pending.empty ();
+			if (_queue.InReady)
+				_state->Ready.push_back (_key);
+			asio::co_spawn (Tasks::GetContext (), _Run (_state, _key, _index, std::move (_r)), asio::detached);
+		}
+	}
+
+	static Task<void> _Run (std::shared_ptr<State> _state, std::string _key, size_t _index, Request _r) {
+		BatchResult _result {};
+		_result.Index = _index;
+		try {
+			_result.Res = co_await _DoPooled (std::move (_r));
+		} catch (std::exception &_e) {
+			_result.Error = _e.what ();
+			if (_result.Error == "")
+				_result.Error = "Unknown error";
+		} catch (...) {
+			_result.Error = "Unknown error";
+		}
+		{
+			std::unique_lock _ul { _state->Mtx };
+			_state->Finished.push_back (std::move (_result));
+			_state->Running--;
+			auto &_queue = _state->Hosts [_key];
+			_queue.Running--;
+			if (!_queue.InReady && !_queue.Pending.empty ()) {
+				_queue.InReady = true;
+				_state->Ready.push_back (_key);
+			}
+		}
+		_state->Changed.Set ();
+		_Pump (_state);
+	}
+
+	std::shared_ptr<State> m_state;
+};
+
+inline Task<std::vector<BatchResult>> WhenAll (std::vector<Request> _reqs, size_t _max_concurrency = 64, size_t _max_per_host = 8) {
+	Batch _batch { std::move (_reqs), _max_concurrency, _max_per_host };
+	co_return co_await _batch.All ();
+}
+}
+
+
+
+#endif //__FV_BATCH_HPP__
@@ -3,15 +3,21 @@
 
 
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "declare.hpp"
 #include "ioctx_pool.hpp"
+#include "tracing.hpp"
 
 
 
@@ -46,6 +52,12 @@ private:
 	std::string m_err = "";
 };
 
+// Failure that the server answers with HttpCode before closing the connection
+struct HttpException: public Exception {
+	HttpException (int _code, std::string _err): Exception (_err), HttpCode (_code) {}
+	int HttpCode;
+};
+
 
 
 struct AsyncMutex {
@@ -189,11 +201,74 @@ private:
 	std::recursive_mutex m_mtx {};
 };
 
+struct AsyncEvent {
+	AsyncEvent (bool _init_set = false): m_set (_init_set) {}
+
+	bool IsSet () {
+		std::unique_lock _ul { m_mtx };
+		return m_set;
+	}
+
+	// Wakes every waiter; waiters are resumed on their own executors
+	void Set () {
+		std::unique_lock _ul { m_mtx };
+		m_set = true;
+		std::vector<std::shared_ptr<asio::steady_timer>> _waiters = std::move (m_waiters);
+		m_waiters.clear ();
+		_ul.unlock ();
+		for (auto &_timer : _waiters)
+			asio::post (_timer->get_executor (), [_timer] () { _timer->expires_at (asio::steady_timer::time_point::min ()); });
+	}
+
+	void Reset () {
+		std::unique_lock _ul { m_mtx };
+		m_set = false;
+	}
+
+	Task<void> Wait () {
+		co_await _wait (std::nullopt);
+	}
+
+	Task<bool> Wait (TimeSpan _timeout) {
+		co_return co_await _wait (_timeout);
+	}
+
+private:
+	Task<bool> _wait (std::optional<TimeSpan> _timeout) {
+		TraceRestore _trace {};
+		auto _timer = std::make_shared<asio::steady_timer> (co_await asio::this_coro::executor);
+		if (_timeout.has_value ()) {
+			_timer->expires_after (_timeout.value ());
+		} else {
+			_timer->expires_at (asio::steady_timer::time_point::max ());
+		}
+		std::unique_lock _ul { m_mtx };
+		if (m_set)
+			co_return true;
+		m_waiters.push_back (_timer);
+		_ul.unlock ();
+		try {
+			co_await _timer->async_wait (UseAwaitable);
+		} catch (...) {
+		}
+		_ul.lock ();
+		auto _it = std::find (m_waiters.begin (), m_waiters.end (), _timer);
+		if (_it == m_waiters.end ())
+			co_return true;
+		m_waiters.erase (_it);
+		co_return m_set;
+	}
+
+	bool m_set = false;
+	std::vector<std::shared_ptr<asio::steady_timer>> m_waiters;
+	std::mutex m_mtx {};
+};
+
 struct CancelToken {
 	CancelToken (std::chrono::system_clock::time_point _cancel_time) { m_cancel_time = _cancel_time; }
 	CancelToken (TimeSpan _expire) { m_cancel_time = std::chrono::system_clock::now () + _expire; }
 	void Cancel () { m_cancel_time = std::chrono::system_clock::now (); }
-	bool IsCancel () { return std::chrono::system_clock::now () <= m_cancel_time; }
+	bool IsCancel () { return std::chrono::system_clock::now () >= m_cancel_time; }
 	TimeSpan GetRemaining () { return m_cancel_time - std::chrono::system_clock::now (); }
 
 private:
@@ -203,15 +278,27 @@ private:
 struct Tasks {
 	template<typename F>
 	static void RunAsync (F &&f) {
+		RunAsyncOn (NextContextIndex (), std::forward<F> (f));
+	}
+	// Same as RunAsync on the context `_index`, such as the one a socket was accepted on
+	template<typename F>
+	static void RunAsyncOn (size_t _index, F &&f) {
 		std::unique_lock _ul { m_mtx };
 		if (!m_pool)
 			throw Exception ("You should invoke Init method first");
 		//
 		using TRet = decltype (f ());
+		ContextLoad *_load = &m_pool->GetLoad (_index);
+		_load->ActiveTasks.fetch_add (1, std::memory_order_relaxed);
 		if constexpr (std::is_void<TRet>::value) {
-			GetContext ().post (std::forward<F> (f));
+			m_pool->GetContext (_index).post ([_f = std::forward<F> (f), _load] () mutable {
+				_f ();
+				_load->ActiveTasks.fetch_sub (1, std::memory_order_relaxed);
+			});
 		} else if constexpr (std::is_same<TRet, Task<void>>::value) {
-			asio::co_spawn (GetContext (), std::forward<F> (f), asio::detached);
+			asio::co_spawn (m_pool->GetContext (_index), std::forward<F> (f), [_load] (std::exception_ptr) {
+				_load->ActiveTasks.fetch_sub (1, std::memory_order_relaxed);
+			});
 		} else {
 			static_assert (std::is_void<TRet>::value || std::is_same<TRet, Task<void>>::value, "Unsupported returns type");
 		}
@@ -238,6 +325,7 @@ struct Tasks {
 	static void RunMainAsync (F &&f, Args... args) { return RunMainAsync (std::bind (f, args...)); }
 
 	static Task<void> Delay (TimeSpan _dt) {
+		TraceRestore _trace {};
 		asio::steady_timer timer (co_await asio::this_coro::executor);
 		timer.expires_after (_dt);
 		co_await timer.async_wait (UseAwaitable);
@@ -259,6 +347,43 @@ struct Tasks {
 		m_pool->Stop ();
 	}
 
+	// Runs every drain hook at once, servers register one while they run, and calls Stop
+	// when all of them returned. Hooks are expected to give up by `_deadline`.
+	static void StopGracefully (TimeSpan _deadline = std::chrono::seconds (30)) {
+		std::vector<std::function<Task<void> (TimeSpan)>> _hooks;
+		{
+			std::unique_lock _ul { m_mtx };
+			if (!m_pool)
+				throw Exception ("You should invoke Init method first");
+			for (auto &[_id, _hook] : m_drain_hooks)
+				_hooks.push_back (_hook);
+		}
+		if (_hooks.empty ()) {
+			Stop ();
+			return;
+		}
+		auto _pending = std::make_shared<std::atomic_size_t> (_hooks.size ());
+		for (auto &_hook : _hooks) {
+			asio::co_spawn (GetMainContext (), [_hook, _deadline, _pending] () -> Task<void> {
+				try {
+					co_await _hook (_deadline);
+				} catch (...) {
+				}
+				if (_pending->fetch_sub (1) == 1)
+					Stop ();
+			}, asio::detached);
+		}
+	}
+	static size_t AddDrainHook (std::function<Task<void> (TimeSpan)> _hook) {
+		std::unique_lock _ul { m_mtx };
+		m_drain_hooks [++m_drain_hook_id] = std::move (_hook);
+		return m_drain_hook_id;
+	}
+	static void RemoveDrainHook (size_t _id) {
+		std::unique_lock _ul { m_mtx };
+		m_drain_hooks.erase (_id);
+	}
+
 	static void Run () {
 		std::unique_lock _ul { m_mtx };
 		if (!m_pool)
@@ -274,6 +399,31 @@ struct Tasks {
 			Init ();
 		return m_pool->GetContext ();
 	}
+	// Round robin over the worker contexts, as RunAsync and GetContext () pick them
+	static size_t NextContextIndex () {
+		std::unique_lock _ul { m_mtx };
+		if (!m_pool)
+			throw Exception ("You should invoke Init method first");
+		return m_pool->NextIndex ();
+	}
+	static size_t GetContextCount () {
+		std::unique_lock _ul { m_mtx };
+		if (!m_pool)
+			Init ();
+		return m_pool->GetContextCount ();
+	}
+	static IoContext &GetContext (size_t _index) {
+		std::unique_lock _ul { m_mtx };
+		if (!m_pool)
+			Init ();
+		return m_pool->GetContext (_index);
+	}
+	static ContextLoad &GetContextLoad (size_t _index) {
+		std::unique_lock _ul { m_mtx };
+		if (!m_pool)
+			Init ();
+		return m_pool->GetLoad (_index);
+	}
 	static IoContext &GetMainContext () {
 		std::unique_lock _ul { m_mtx };
 		if (!m_pool)
@@ -285,6 +435,8 @@ private:
 	inline static std::recursive_mutex m_mtx {};
 	inline static bool m_run = false;
 	inline static std::shared_ptr<IoCtxPool> m_pool = nullptr;
+	inline static std::unordered_map<size_t, std::function<Task<void> (TimeSpan)>> m_drain_hooks;
+	inline static size_t m_drain_hook_id = 0;
 };
 
 struct AsyncTimer {
@@ -322,6 +474,61 @@ struct AsyncTimer {
 private:
 	AsyncMutex m_mtx {};
 };
+
+// Calls `_on_expire` once on an IO thread when `_timeout` elapses, unless cancelled
+// first. Once Cancel returns the callback is guaranteed not to run. A timeout <= 0
+// leaves the deadline disarmed.
+struct Deadline {
+	Deadline (TimeSpan _timeout, std::function<void ()> _on_expire): m_on_expire (std::move (_on_expire)) { Reset (_timeout); }
+	Deadline (const Deadline &) = delete;
+	Deadline &operator= (const Deadline &) = delete;
+	~Deadline () { Cancel (); }
+
+	bool IsExpired () const { return m_state && m_state->Expired.load (); }
+
+	void Reset (TimeSpan _timeout) {
+		Cancel ();
+		m_state = nullptr;
+		if (_timeout.count () <= 0)
+			return;
+		m_state = std::make_shared<State> ();
+		m_state->OnExpire = m_on_expire;
+		m_timer = std::make_shared<asio::steady_timer> (Tasks::GetContext ());
+		m_timer->expires_after (_timeout);
+		m_timer->async_wait ([_state = m_state, _timer = m_timer] (const ErrorCode &_ec) {
+			if (_ec)
+				return;
+			std::unique_lock _ul { _state->Mtx };
+			if (_state->OnExpire) {
+				_state->Expired.store (true);
+				_state->OnExpire ();
+				_state->OnExpire = nullptr;
+			}
+		});
+	}
+
+	void Cancel () {
+		if (!m_timer)
+			return;
+		{
+			std::unique_lock _ul { m_state->Mtx };
+			m_state->OnExpire = nullptr;
+		}
+		asio::post (m_timer->get_executor (), [_timer = m_timer] () { _timer->cancel (); });
+		m_timer = nullptr;
+	}
+
+private:
+	struct State {
+		std::mutex Mtx;
+		std::function<void ()> OnExpire;
+		std::atomic_bool Expired { false };
+	};
+
+	std::function<void ()> m_on_expire;
+	std::shared_ptr<State> m_state;
+	std::shared_ptr<asio::steady_timer> m_timer;
+};
 }
 
 
@@ -4,12 +4,20 @@
 
 
 #include <algorithm>
+#include <optional>
 #include <string>
+#include <string_view>
 
 
 
 namespace fv {
 inline std::string _to_lower (std::string _s) { std::transform (_s.begin (), _s.end (), _s.begin (), ::tolower); return _s; }
+inline bool _istarts_with (std::string_view _s, std::string_view _prefix) {
+	return _s.size () >= _prefix.size () && std::equal (_prefix.begin (), _prefix.end (), _s.begin (), [] (char a, char b) {
+		return ::tolower (a) == ::tolower (b);
+	});
+}
+inline bool _iequals (std::string_view _a, std::string_view _b) { return _a.size () == _b.size () && _istarts_with (_a, _b); }
 
 
 
@@ -30,6 +38,14 @@ inline std::string _trim (std::string _s) {
 	return _s.substr (_start, _stop - _start);
 };
 
+inline std::string_view _trim_view (std::string_view _s) {
+	while (_s.size () > 0 && (_s [0] == ' ' || _s [0] == '\r'))
+		_s.remove_prefix (1);
+	while (_s.size () > 0 && (_s [_s.size () - 1] == ' ' || _s [_s.size () - 1] == '\r'))
+		_s.remove_suffix (1);
+	return _s;
+}
+
 
 
 inline std::string random_str (size_t _len) {
@@ -65,6 +81,78 @@ inline std::string percent_encode (std::string_view data) {
 
 
 
+inline std::string percent_decode (std::string_view data) {
+	auto _hex = [] (char ch) -> int {
+		if (ch >= '0' && ch <= '9') return ch - '0';
+		if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+		if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+		return -1;
+	};
+	std::string ret = "";
+	ret.reserve (data.size ());
+	for (size_t i = 0; i < data.size (); ++i) {
+		char ch = data [i];
+		if (ch == '+') {
+			ret += ' ';
+		} else if (ch == '%' && i + 2 < data.size () && _hex (data [i + 1]) >= 0 && _hex (data [i + 2]) >= 0) {
+			ret += (char) ((_hex (data [i + 1]) << 4) | _hex (data [i + 2]));
+			i += 2;
+		} else {
+			ret += ch;
+		}
+	}
+	return ret;
+}
+
+
+
+// Zero-copy view over `k1=v1<sep>k2=v2` text (query strings, form bodies, Cookie header).
+// Nothing is parsed until asked, keys and values are returned undecoded.
+struct KvView {
+	KvView (std::string_view _src, char _sep): m_src (_src), m_sep (_sep) {}
+
+	template<typename F>
+	void ForEach (F &&_f) const {
+		std::string_view _rest = m_src;
+		while (_rest.size () > 0) {
+			size_t _p = _rest.find (m_sep);
+			std::string_view _item = _rest.substr (0, _p);
+			_rest = _p == std::string_view::npos ? std::string_view {} : _rest.substr (_p + 1);
+			while (_item.size () > 0 && _item [0] == ' ')
+				_item.remove_prefix (1);
+			while (_item.size () > 0 && _item [_item.size () - 1] == ' ')
+				_item.remove_suffix (1);
+			if (_item.size () == 0)
+				continue;
+			size_t _eq = _item.find ('=');
+			if (_eq == std::string_view::npos) {
+				if (!_f (_item, std::string_view {}))
+					return;
+			} else {
+				if (!_f (_item.substr (0, _eq), _item.substr (_eq + 1)))
+					return;
+			}
+		}
+	}
+
+	std::optional<std::string_view> Get (std::string_view _key) const {
+		std::optional<std::string_view> _ret = std::nullopt;
+		ForEach ([&] (std::string_view _k, std::string_view _v) {
+			if (_k != _key)
+				return true;
+			_ret = _v;
+			return false;
+		});
+		return _ret;
+	}
+
+private:
+	std::string_view m_src;
+	char m_sep;
+};
+
+
+
 inline std::string base64_encode (std::string_view data) {
 	static const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 	std::string ret;
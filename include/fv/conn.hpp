@@ -3,40 +3,106 @@
 
 
 
+#include <algorithm>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "common.hpp"
 #include "structs.hpp"
 #include "req_res.hpp"
+#include "timer_wheel.hpp"
+#include "wsdeflate.hpp"
 
 
 
 namespace fv {
-struct IConn2 {
+struct IConn2: public std::enable_shared_from_this<IConn2> {
 	std::string m_host = "", m_port = "";
+	size_t HighWatermark = Config::WriteQueueHighWatermark, LowWatermark = Config::WriteQueueLowWatermark;
 
 	IConn2 () = default;
 	virtual ~IConn2 () = default;
 	virtual bool IsConnect () = 0;
 	virtual Task<void> Send (char *_data, size_t _size) = 0;
 	virtual void Cancel () = 0;
+	virtual asio::any_io_executor GetExecutor () = 0;
+	// Peer address, unspecified once the socket is closed
+	virtual asio::ip::address GetRemoteAddress () = 0;
 
 	Task<char> ReadChar ();
 	Task<std::string> ReadLine ();
+	// The returned view points into the receive buffer and is valid until the next Read* call.
+	// Throws HttpException 431 once `_max` bytes are buffered without a line end, 0 disables.
+	Task<std::string_view> ReadLineView (size_t _max = 0);
 	Task<std::string> ReadCount (size_t _count);
 	Task<std::vector<uint8_t>> ReadCountVec (size_t _count);
 	Task<std::string> ReadSome ();
 
+	// Synchronous access to already received bytes. Every awaitable call allocates a
+	// coroutine frame, so hot paths try these first and only await Fill/ReadLineView
+	// when the buffer runs dry.
+	size_t GetBuffered () const { return TmpData.size () - TmpPos; }
+	bool TryReadLine (std::string_view &_line);
+	std::string_view Peek (size_t _count) const { return std::string_view { TmpData }.substr (TmpPos, _count); }
+	std::string_view Consume (size_t _count);
+	Task<void> Fill (size_t _count);
+
+	// Queued writes. The queue is drained by a single writer coroutine on the connection
+	// executor, and whatever piled up while a write was in flight goes out in the next
+	// gather write. Once the queue holds HighWatermark bytes, Wait blocks until it drains
+	// to LowWatermark and Drop returns false. Returns false once the connection failed.
+	Task<bool> Write (std::string _data, WritePolicy _policy = WritePolicy::Wait) { return Write (std::make_shared<const std::string> (std::move (_data)), _policy); }
+	Task<bool> Write (std::shared_ptr<const std::string> _data, WritePolicy _policy = WritePolicy::Wait);
+	// Non-suspending Drop write, for fan-out paths that must not allocate a frame per peer
+	bool TryWrite (std::shared_ptr<const std::string> _data);
+	// Write split in two for writers that must enqueue right after preparing the data:
+	// WaitWritable blocks like WritePolicy::Wait, ForceWrite then queues without suspending
+	// and ignores HighWatermark. Both return false once the connection failed.
+	Task<bool> WaitWritable ();
+	bool ForceWrite (std::shared_ptr<const std::string> _data);
+	WriteQueueStats GetWriteStats ();
+
 protected:
 	virtual Task<size_t> RecvImpl (char *_data, size_t _size) = 0;
+	virtual Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) = 0;
+	void _Enqueue (std::shared_ptr<const std::string> _data);
+	Task<void> _FlushQueue ();
+	char *_PrepareRecv (size_t _size);
+	// Size of the next read towards `_count` buffered bytes. Bounded by RecvChunk, so the
+	// buffer grows with bytes actually received, never with a length the peer declared.
+	size_t _NextRecv (size_t _count) const { return std::clamp<size_t> (_count - GetBuffered (), 4096, RecvChunk); }
+	void _CommitRecv (size_t _prepared, size_t _readed);
+	void _ClearRecv () { TmpData.clear (); TmpPos = 0; }
+
+	// Received but unconsumed bytes are TmpData [TmpPos, size); the buffer keeps its
+	// capacity for the lifetime of the connection
 	std::string TmpData = "";
+	size_t TmpPos = 0;
+	static constexpr size_t RecvChunk = 64 * 1024;
+
+	std::mutex m_wq_mtx;
+	std::deque<std::shared_ptr<const std::string>> m_wq;
+	WriteQueueStats m_wq_stats;
+	bool m_wq_writing = false, m_wq_broken = false;
+	AsyncEvent m_wq_writable { true };
 };
 
 
 
 struct IConn: public IConn2 {
+	// Bounds connect, and the TLS handshake for SSL. A timeout closes the socket and
+	// Connect/Reconnect throw. <= 0 disables the limit.
+	TimeSpan ConnectTimeout = Config::ConnectTimeout;
+	// When the last Connect/Reconnect started, resolved the host, connected and finished
+	// the TLS handshake; Secured equals Connected for plain TCP. Read by tracing.
+	struct ConnectTiming {
+		std::chrono::steady_clock::time_point Start, Resolved, Connected, Secured;
+	} LastConnect {};
+
 	virtual Task<void> Connect (std::string _host, std::string _port) = 0;
 	virtual Task<void> Reconnect () = 0;
 };
@@ -49,12 +115,15 @@ struct TcpConn: public IConn {
 	virtual ~TcpConn () { Cancel (); }
 	Task<void> Connect (std::string _host, std::string _port) override;
 	Task<void> Reconnect () override;
-	bool IsConnect () override { return Socket->is_open (); }
+	bool IsConnect () override { return Socket && Socket->is_open (); }
 	Task<void> Send (char *_data, size_t _size) override;
 	void Cancel () override;
+	asio::any_io_executor GetExecutor () override { return Socket ? Socket->get_executor () : Tasks::GetContext ().get_executor (); }
+	asio::ip::address GetRemoteAddress () override { ErrorCode _ec; return Socket ? Socket->remote_endpoint (_ec).address () : asio::ip::address {}; }
 
 protected:
 	Task<size_t> RecvImpl (char *_data, size_t _size) override;
+	Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) override;
 };
 
 
@@ -69,9 +138,16 @@ struct TcpConn2: public IConn2 {
 	bool IsConnect () override { return Socket.is_open (); }
 	Task<void> Send (char *_data, size_t _size) override;
 	void Cancel () override;
+	asio::any_io_executor GetExecutor () override { return Socket.get_executor (); }
+	asio::ip::address GetRemoteAddress () override { return m_remote; }
 
 protected:
 	Task<size_t> RecvImpl (char *_data, size_t _size) override;
+	Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) override;
+
+private:
+	// read once at accept, rate limiting asks for it on every request
+	asio::ip::address m_remote {};
 };
 
 
@@ -86,9 +162,12 @@ struct SslConn: public IConn {
 	bool IsConnect () override { return SslSocket && SslSocket->next_layer ().is_open (); }
 	Task<void> Send (char *_data, size_t _size) override;
 	void Cancel () override;
+	asio::any_io_executor GetExecutor () override { return SslSocket ? SslSocket->get_executor () : Tasks::GetContext ().get_executor (); }
+	asio::ip::address GetRemoteAddress () override { ErrorCode _ec; return SslSocket ? SslSocket->next_layer ().remote_endpoint (_ec).address () : asio::ip::address {}; }
 
 protected:
 	Task<size_t> RecvImpl (char *_data, size_t _size) override;
+	Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) override;
 };
 
 
@@ -103,9 +182,15 @@ struct SslConn2: public IConn2 {
 	bool IsConnect () override { return SslSocket.next_layer ().is_open (); }
 	Task<void> Send (char *_data, size_t _size) override;
 	void Cancel () override;
+	asio::any_io_executor GetExecutor () override { return SslSocket.get_executor (); }
+	asio::ip::address GetRemoteAddress () override { return m_remote; }
 
 protected:
 	Task<size_t> RecvImpl (char *_data, size_t _size) override;
+	Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) override;
+
+private:
+	asio::ip::address m_remote {};
 };
 
 
@@ -116,6 +201,12 @@ struct WsConn: public std::enable_shared_from_this<WsConn> {
 	std::atomic_bool Run { true };
 
 	WsConn (std::shared_ptr<IConn2> _parent, bool _is_client);
+	~WsConn ();
+	// Starts keepalive on the timer wheel of the connection's context: a ping after
+	// Config::WebsocketAutoPing without receiving anything, a close when the pong does not
+	// arrive within Config::WebsocketPongTimeout or no message came for WebsocketIdleTimeout.
+	// Received frames are only seen while the application keeps calling Recv, so both
+	// timeouts are off by default and need a Recv loop.
 	void Init ();
 	bool IsConnect () { return Parent && Parent->IsConnect (); }
 	Task<void> SendText (char *_data, size_t _size) { co_await _Send (_data, _size, WsType::Text); }
@@ -123,8 +214,30 @@ struct WsConn: public std::enable_shared_from_this<WsConn> {
 	Task<void> Close () { Run.store (false); co_await _Send (nullptr, 0, WsType::Close); Parent = nullptr; }
 	Task<std::tuple<std::string, WsType>> Recv ();
 
+	// Turns on permessage-deflate with the parameters agreed on in the handshake; done by
+	// ConnectWS and Request::UpgradeWebsocket when Config::WebsocketDeflate is enabled
+	void EnableDeflate (const WsDeflateParams &_params, const WsDeflateOptions &_opts = Config::WebsocketDeflate);
+	bool IsDeflate () const { return !!m_deflate; }
+
+	// Encodes one complete frame. Server frames carry no mask, so the result can be
+	// shared by every connection it is broadcast to. `_compressed` sets RSV1 for a
+	// payload that is already deflated.
+	static std::string EncodeFrame (const char *_data, size_t _size, WsType _type, bool _is_client, bool _compressed = false);
+
 private:
 	Task<void> _Send (char *_data, size_t _size, WsType _type);
+	// Sends a close frame with the status `_code`, drops the connection and throws
+	Task<void> _Fail (uint16_t _code, std::string _reason);
+	void _Keepalive ();
+
+	std::unique_ptr<WsDeflate> m_deflate;
+	// steady_clock nanoseconds of the last frame and the last text/binary message, set by Recv
+	std::atomic_int64_t m_last_recv { 0 }, m_last_msg { 0 };
+	// owned by the keepalive timer callback on the connection's context
+	std::shared_ptr<TimerWheel::Timer> m_keepalive;
+	// Parent as of Init; the timer reads this instead, Recv and Close reset Parent meanwhile
+	std::weak_ptr<IConn2> m_parent;
+	int64_t m_last_ping = 0, m_ping_at = 0;
 };
 
 Task<std::shared_ptr<IConn>> Connect (std::string _url);
@@ -3,71 +3,228 @@
 
 
 
-#include <regex>
+#include <limits>
+#include <optional>
 #include <unordered_set>
 
 #include "common.hpp"
 #include "structs.hpp"
 #include "conn.hpp"
+#include "dns.hpp"
 
 
 
 namespace fv {
+// Closing rather than cancelling fails every pending operation and keeps the socket
+// from being reused. Deadlines and Cancel may run on any thread, so the close is posted
+// to the socket's executor; `_owner` keeps the socket alive until it ran.
+template<typename T>
+inline void _close_socket (std::shared_ptr<T> _owner, Tcp::socket &_sock) {
+	asio::post (_sock.get_executor (), [_owner = std::move (_owner), &_sock] () {
+		ErrorCode _ec;
+		_sock.close (_ec);
+	});
+}
+
+// Races connects to `_addrs` in order, starting the next attempt as soon as the previous
+// one fails or after Config::HappyEyeballsDelay (RFC 8305). The first socket to connect
+// wins and the others are closed. `_timeout` bounds the whole race, <= 0 disables it.
+// Every socket lives on the caller's executor, where all closes are posted as well.
+inline Task<Tcp::socket> _happy_eyeballs_connect (std::vector<asio::ip::address> _addrs, uint16_t _port, TimeSpan _timeout, std::string _host) {
+	struct State {
+		std::mutex Mtx;
+		std::vector<std::shared_ptr<Tcp::socket>> Sockets;
+		std::shared_ptr<Tcp::socket> Winner;
+		size_t Failed = 0;
+		std::string Error = "";
+		AsyncEvent Changed {};
+	};
+	auto _state = std::make_shared<State> ();
+	auto _executor = co_await asio::this_coro::executor;
+	Deadline _deadline { _timeout, [_state] () {
+		std::unique_lock _ul { _state->Mtx };
+		if (_state->Winner)
+			return;
+		for (auto &_sock : _state->Sockets)
+			_close_socket (_sock, *_sock);
+	} };
+	std::optional<Tcp::endpoint> _bind;
+	if (Config::BindClientIP)
+		_bind = Tcp::endpoint { asio::ip::make_address (co_await Config::BindClientIP ()), 0 };
+
+	for (size_t i = 0; i < _addrs.size (); ++i) {
+		Tcp::endpoint _ep { _addrs [i], _port };
+		auto _sock = std::make_shared<Tcp::socket> (_executor);
+		try {
+			_sock->open (_ep.protocol ());
+			if (_bind.has_value ())
+				_sock->bind (_bind.value ());
+		} catch (std::exception &_e) {
+			std::unique_lock _ul { _state->Mtx };
+			_state->Error = _e.what ();
+			continue;
+		}
+		{
+			std::unique_lock _ul { _state->Mtx };
+			if (_state->Winner || _deadline.IsExpired ())
+				break;
+			_state->Sockets.push_back (_sock);
+			_state->Changed.Reset ();
+		}
+		asio::co_spawn (_executor, [_state, _sock, _ep] () -> Task<void> {
+			std::string _error = "";
+			try {
+				co_await _sock->async_connect (_ep, UseAwaitable);
+			} catch (std::exception &_e) {
+				_error = _e.what ();
+			}
+			std::unique_lock _ul { _state->Mtx };
+			if (_error == "" && !_state->Winner && _sock->is_open ()) {
+				_state->Winner = _sock;
+			} else {
+				_state->Failed++;
+				if (_error != "")
+					_state->Error = _error;
+			}
+			_ul.unlock ();
+			_state->Changed.Set ();
+		}, asio::detached);
+		if (i + 1 < _addrs.size ())
+			co_await _state->Changed.Wait (Config::HappyEyeballsDelay);
+	}
+
+	while (true) {
+		std::unique_lock _ul { _state->Mtx };
+		if (_state->Winner || _state->Failed >= _state->Sockets.size ())
+			break;
+		_state->Changed.Reset ();
+		_ul.unlock ();
+		co_await _state->Changed.Wait ();
+	}
+	_deadline.Cancel ();
+	std::unique_lock _ul { _state->Mtx };
+	for (auto &_sock : _state->Sockets) {
+		if (_sock != _state->Winner)
+			_close_socket (_sock, *_sock);
+	}
+	if (_state->Winner && _state->Winner->is_open ())
+		co_return std::move (*_state->Winner);
+	if (_deadline.IsExpired ())
+		throw Exception (fmt::format ("Connect to server {} timeout", _host));
+	throw Exception (fmt::format ("Cannot connect to server {}: {}", _host, _state->Error));
+}
+
+inline std::string _join_buffers (const std::vector<asio::const_buffer> &_bufs) {
+	std::string _ret;
+	_ret.reserve (asio::buffer_size (_bufs));
+	for (auto &_buf : _bufs)
+		_ret.append ((const char *) _buf.data (), _buf.size ());
+	return _ret;
+}
+
+
+
+inline char *IConn2::_PrepareRecv (size_t _size) {
+	if (TmpPos > 0 && TmpPos == TmpData.size ()) {
+		TmpData.clear ();
+		TmpPos = 0;
+	} else if (TmpPos > 0 && TmpPos >= TmpData.size () / 2) {
+		TmpData.erase (0, TmpPos);
+		TmpPos = 0;
+	}
+	size_t _old = TmpData.size ();
+	TmpData.resize (_old + _size);
+	return &TmpData [_old];
+}
+
+inline void IConn2::_CommitRecv (size_t _prepared, size_t _readed) {
+	TmpData.resize (TmpData.size () - _prepared + _readed);
+	if (_readed == 0)
+		throw Exception ("Connection closed.");
+	Metrics::BytesIn.Add (_readed);
+}
+
 inline Task<char> IConn2::ReadChar () {
-	if (TmpData.size () == 0) {
-		char _buf [1024];
-		size_t _n = co_await RecvImpl (_buf, sizeof (_buf));
-		TmpData.resize (_n);
-		::memcpy (&TmpData [0], _buf, _n);
+	if (TmpPos >= TmpData.size ()) {
+		char *_buf = _PrepareRecv (4096);
+		_CommitRecv (4096, co_await RecvImpl (_buf, 4096));
+	}
+	co_return TmpData [TmpPos++];
+}
+
+inline bool IConn2::TryReadLine (std::string_view &_line) {
+	size_t _p = TmpData.find ('\n', TmpPos);
+	if (_p == std::string::npos)
+		return false;
+	_line = std::string_view { &TmpData [TmpPos], _p - TmpPos };
+	TmpPos = _p + 1;
+	if (_line.size () > 0 && _line [_line.size () - 1] == '\r')
+		_line.remove_suffix (1);
+	return true;
+}
+
+inline std::string_view IConn2::Consume (size_t _count) {
+	std::string_view _ret = Peek (_count);
+	TmpPos += _ret.size ();
+	return _ret;
+}
+
+inline Task<void> IConn2::Fill (size_t _count) {
+	while (GetBuffered () < _count) {
+		size_t _size = _NextRecv (_count);
+		char *_buf = _PrepareRecv (_size);
+		_CommitRecv (_size, co_await RecvImpl (_buf, _size));
 	}
-	char _ret = TmpData [0];
-	TmpData.erase (0);
-	co_return _ret;
 }
 
 inline Task<std::string> IConn2::ReadLine () {
-	std::string _tmp = "";
-	size_t _p;
-	while ((_p = TmpData.find ('\n')) == std::string::npos) {
-		char _buf [1024];
-		size_t _readed = co_await RecvImpl (_buf, sizeof (_buf));
-		TmpData += std::string_view { _buf, _readed };
+	std::string_view _line;
+	while (!TryReadLine (_line)) {
+		char *_buf = _PrepareRecv (4096);
+		_CommitRecv (4096, co_await RecvImpl (_buf, 4096));
+	}
+	co_return std::string (_line);
+}
+
+inline Task<std::string_view> IConn2::ReadLineView (size_t _max) {
+	std::string_view _line;
+	while (!TryReadLine (_line)) {
+		if (_max > 0 && GetBuffered () >= _max)
+			throw HttpException (431, "Request header too large");
+		char *_buf = _PrepareRecv (4096);
+		_CommitRecv (4096, co_await RecvImpl (_buf, 4096));
 	}
-	_tmp = TmpData.substr (0, _p);
-	if (_tmp [_p - 1] == '\r')
-		_tmp.erase (_p - 1);
-	TmpData.erase (0, _p + 1);
-	co_return _tmp;
+	co_return _line;
 }
 
 inline Task<std::string> IConn2::ReadCount (size_t _count) {
 	if (_count == 0)
 		co_return "";
-	std::string _tmp = "";
-	while (TmpData.size () < _count) {
-		char _buf [1024];
-		size_t _readed = co_await RecvImpl (_buf, sizeof (_buf));
-		TmpData += std::string_view { _buf, _readed };
+	while (GetBuffered () < _count) {
+		size_t _size = _NextRecv (_count);
+		char *_buf = _PrepareRecv (_size);
+		_CommitRecv (_size, co_await RecvImpl (_buf, _size));
 	}
-	_tmp = TmpData.substr (0, _count);
-	TmpData.erase (0, _count);
-	co_return _tmp;
+	co_return std::string (Consume (_count));
 }
 
 inline Task<std::vector<uint8_t>> IConn2::ReadCountVec (size_t _count) {
-	std::string _tmp = co_await ReadCount (_count);
-	std::vector<uint8_t> _vec;
-	_vec.assign ((uint8_t *) &_tmp [0], (uint8_t *) &_tmp [_count]);
-	co_return _vec;
+	while (GetBuffered () < _count) {
+		size_t _size = _NextRecv (_count);
+		char *_buf = _PrepareRecv (_size);
+		_CommitRecv (_size, co_await RecvImpl (_buf, _size));
+	}
+	std::string_view _tmp = Consume (_count);
+	co_return std::vector<uint8_t> { (const uint8_t *) _tmp.data (), (const uint8_t *) _tmp.data () + _tmp.size () };
 }
 
 inline Task<std::string> IConn2::ReadSome () {
-	if (TmpData.size () > 0) {
-		std::string _ret = std::move (TmpData);
-		TmpData = "";
+	if (TmpPos < TmpData.size ()) {
+		std::string _ret = TmpData.substr (TmpPos);
+		_ClearRecv ();
 		co_return _ret;
 	} else {
-		char _buf [1024];
+		char _buf [4096];
 		size_t _len = co_await RecvImpl (_buf, sizeof (_buf));
 		co_return std::string (_buf, _len);
 	}
@@ -75,6 +232,122 @@ inline Task<std::string> IConn2::ReadSome () {
 
 
 
+inline Task<bool> IConn2::Write (std::shared_ptr<const std::string> _data, WritePolicy _policy) {
+	std::unique_lock _ul { m_wq_mtx };
+	while (!m_wq_broken && m_wq_stats.QueuedBytes >= HighWatermark) {
+		if (_policy == WritePolicy::Drop) {
+			m_wq_stats.DroppedCount++;
+			co_return false;
+		}
+		_ul.unlock ();
+		co_await m_wq_writable.Wait ();
+		_ul.lock ();
+	}
+	if (m_wq_broken)
+		co_return false;
+	_Enqueue (std::move (_data));
+	co_return true;
+}
+
+inline bool IConn2::TryWrite (std::shared_ptr<const std::string> _data) {
+	std::unique_lock _ul { m_wq_mtx };
+	if (m_wq_broken)
+		return false;
+	if (m_wq_stats.QueuedBytes >= HighWatermark) {
+		m_wq_stats.DroppedCount++;
+		return false;
+	}
+	_Enqueue (std::move (_data));
+	return true;
+}
+
+inline Task<bool> IConn2::WaitWritable () {
+	std::unique_lock _ul { m_wq_mtx };
+	while (!m_wq_broken && m_wq_stats.QueuedBytes >= HighWatermark) {
+		_ul.unlock ();
+		co_await m_wq_writable.Wait ();
+		_ul.lock ();
+	}
+	co_return !m_wq_broken;
+}
+
+inline bool IConn2::ForceWrite (std::shared_ptr<const std::string> _data) {
+	std::unique_lock _ul { m_wq_mtx };
+	if (m_wq_broken)
+		return false;
+	_Enqueue (std::move (_data));
+	return true;
+}
+
+// Called with m_wq_mtx held
+inline void IConn2::_Enqueue (std::shared_ptr<const std::string> _data) {
+	m_wq.emplace_back (std::move (_data));
+	m_wq_stats.QueuedBytes += m_wq.back ()->size ();
+	m_wq_stats.QueuedCount++;
+	if (m_wq_stats.QueuedBytes >= HighWatermark)
+		m_wq_writable.Reset ();
+	if (!m_wq_writing) {
+		m_wq_writing = true;
+		asio::co_spawn (GetExecutor (), [_self = shared_from_this ()] () -> Task<void> {
+			co_await _self->_FlushQueue ();
+		}, asio::detached);
+	}
+}
+
+inline Task<void> IConn2::_FlushQueue () {
+	std::vector<std::shared_ptr<const std::string>> _batch;
+	std::vector<asio::const_buffer> _bufs;
+	while (true) {
+		std::unique_lock _ul { m_wq_mtx };
+		size_t _bytes = 0;
+		_batch.clear ();
+		while (!m_wq.empty () && _batch.size () < 64) {
+			_bytes += m_wq.front ()->size ();
+			_batch.emplace_back (std::move (m_wq.front ()));
+			m_wq.pop_front ();
+		}
+		if (_batch.empty ()) {
+			m_wq_writing = false;
+			co_return;
+		}
+		_ul.unlock ();
+		_bufs.clear ();
+		for (auto &_item : _batch)
+			_bufs.emplace_back (asio::buffer (*_item));
+		bool _suc = true;
+		try {
+			co_await SendBuffers (_bufs);
+		} catch (...) {
+			_suc = false;
+		}
+		_ul.lock ();
+		m_wq_stats.QueuedBytes -= _bytes;
+		m_wq_stats.QueuedCount -= _batch.size ();
+		if (_suc) {
+			m_wq_stats.WrittenBytes += _bytes;
+			m_wq_stats.WriteCount++;
+		} else {
+			// the connection is broken, everything still queued is lost
+			m_wq_stats.DroppedCount += _batch.size () + m_wq.size ();
+			m_wq_stats.QueuedBytes = m_wq_stats.QueuedCount = 0;
+			m_wq.clear ();
+			m_wq_writing = false;
+			m_wq_broken = true;
+		}
+		if (m_wq_broken || m_wq_stats.QueuedBytes <= LowWatermark)
+			m_wq_writable.Set ();
+		if (!_suc)
+			co_return;
+	}
+}
+
+inline WriteQueueStats IConn2::GetWriteStats () {
+	std::unique_lock _ul { m_wq_mtx };
+	return m_wq_stats;
+}
+
+
+
 inline Task<void> TcpConn::Connect (std::string _host, std::string _port) {
 	m_host = _host;
 	m_port = _port;
@@ -83,30 +356,19 @@ inline Task<void> TcpConn::Connect (std::string _host, std::string _port) {
 
 inline Task<void> TcpConn::Reconnect () {
 	Socket = nullptr;
-	TmpData = "";
-	std::regex _rgx { "(\\d+\\.){3}\\d+" };
-	std::string _ip = m_host;
-	if (!std::regex_match (m_host, _rgx)) {
-		_ip = co_await Config::DnsResolve (m_host);
-		if (_ip == "")
-			_ip = m_host;
-	}
+	_ClearRecv ();
+	LastConnect.Start = std::chrono::steady_clock::now ();
+	auto _addrs = co_await DnsCache::Resolve (m_host);
+	LastConnect.Resolved = std::chrono::steady_clock::now ();
 	uint16_t _sport = (uint16_t) std::stoi (m_port);
-	if (Config::BindClientIP) {
-		Tcp::endpoint _ep (asio::ip::address::from_string (co_await Config::BindClientIP ()), 0);
-		Socket = std::make_shared<Tcp::socket> (Tasks::GetContext (), _ep);
-	} else {
-		Socket = std::make_shared<Tcp::socket> (Tasks::GetContext ());
-	}
-	co_await Socket->async_connect (Tcp::endpoint { asio::ip::address::from_string (_ip), _sport }, UseAwaitable);
-	if (!Socket->is_open ())
-		throw Exception (fmt::format ("Cannot connect to server {}", m_host));
+	Socket = std::make_shared<Tcp::socket> (co_await _happy_eyeballs_connect (_addrs, _sport, ConnectTimeout, m_host));
+	LastConnect.Connected = LastConnect.Secured = std::chrono::steady_clock::now ();
 	if (Config::NoDelay)
 		Socket->set_option (Tcp::no_delay { true });
 }
 
 inline Task<void> TcpConn::Send (char *_data, size_t _size) {
-	if (!Socket->is_open ())
+	if (!IsConnect ())
 		throw Exception ("Cannot send data to a closed connection.");
 	size_t _sended = 0;
 	while (_sended < _size) {
@@ -115,27 +377,33 @@ inline Task<void> TcpConn::Send (char *_data, size_t _size) {
 			throw Exception ("Connection temp closed.");
 		_sended += _tmp_send;
 	}
+	Metrics::BytesOut.Add (_size);
+}
+
+inline Task<void> TcpConn::SendBuffers (const std::vector<asio::const_buffer> &_bufs) {
+	if (!Socket || !Socket->is_open ())
+		throw Exception ("Cannot send data to a closed connection.");
+	co_await asio::async_write (*Socket, _bufs, UseAwaitable);
+	Metrics::BytesOut.Add (asio::buffer_size (_bufs));
 }
 
 inline Task<size_t> TcpConn::RecvImpl (char *_data, size_t _size) {
-	if (!Socket->is_open ())
+	if (!IsConnect ())
 		co_return 0;
 	size_t _count = co_await Socket->async_read_some (asio::buffer (_data, _size), UseAwaitable);
 	co_return _count;
 }
 
 inline void TcpConn::Cancel () {
-	try {
-		if (Socket)
-			Socket->cancel ();
-	} catch (...) {
-	}
-	Socket = nullptr;
+	if (Socket)
+		_close_socket (Socket, *Socket);
 }
 
 
 
 inline TcpConn2::TcpConn2 (Tcp::socket _sock): Socket (std::move (_sock)) {
+	ErrorCode _ec;
+	m_remote = Socket.remote_endpoint (_ec).address ();
 	if (Config::NoDelay)
 		Socket.set_option (Tcp::no_delay { true });
 }
@@ -150,6 +418,14 @@ inline Task<void> TcpConn2::Send (char *_data, size_t _size) {
 			throw Exception ("Connection temp closed.");
 		_sended += _tmp_send;
 	}
+	Metrics::BytesOut.Add (_size);
+}
+
+inline Task<void> TcpConn2::SendBuffers (const std::vector<asio::const_buffer> &_bufs) {
+	if (!Socket.is_open ())
+		throw Exception ("Cannot send data to a closed connection.");
+	co_await asio::async_write (Socket, _bufs, UseAwaitable);
+	Metrics::BytesOut.Add (asio::buffer_size (_bufs));
 }
 
 inline void TcpConn2::Cancel () {
@@ -177,35 +453,41 @@ inline Task<void> SslConn::Connect (std::string _host, std::string _port) {
 
 inline Task<void> SslConn::Reconnect () {
 	SslSocket = nullptr;
-	TmpData = "";
-	std::regex _rgx { "(\\d+\\.){3}\\d+" };
-	std::string _ip = m_host;
-	if (!std::regex_match (m_host, _rgx)) {
-		_ip = co_await Config::DnsResolve (m_host);
-		if (_ip == "")
-			_ip = m_host;
-	}
+	_ClearRecv ();
+	auto _start = std::chrono::steady_clock::now ();
+	LastConnect.Start = _start;
+	auto _addrs = co_await DnsCache::Resolve (m_host);
+	LastConnect.Resolved = std::chrono::steady_clock::now ();
 	uint16_t _sport = (uint16_t) std::stoi (m_port);
-	if (Config::BindClientIP) {
-		Tcp::endpoint _ep (asio::ip::address::from_string (co_await Config::BindClientIP ()), 0);
-		SslSocket = std::make_shared<Ssl::stream<Tcp::socket>> (Tcp::socket (Tasks::GetContext (), _ep), SslCtx);
-	} else {
-		SslSocket = std::make_shared<Ssl::stream<Tcp::socket>> (Tasks::GetContext (), SslCtx);
-	}
+	SslSocket = std::make_shared<Ssl::stream<Tcp::socket>> (co_await _happy_eyeballs_connect (_addrs, _sport, ConnectTimeout, m_host), SslCtx);
+	LastConnect.Connected = std::chrono::steady_clock::now ();
 	if (!::SSL_set_tlsext_host_name (SslSocket->native_handle (), m_host.data ()))
 		throw Exception (fmt::format ("Cannot set connect sni: {}", m_host));
 	SslSocket->set_verify_mode (Ssl::verify_peer);
 	SslSocket->set_verify_callback (Config::SslVerifyFunc);
-	co_await SslSocket->next_layer ().async_connect (Tcp::endpoint { asio::ip::address::from_string (_ip), _sport }, UseAwaitable);
-	if (!SslSocket->next_layer ().is_open ())
-		throw Exception (fmt::format ("Cannot connect to server {}", m_host));
 	if (Config::NoDelay)
 		SslSocket->next_layer ().set_option (Tcp::no_delay { true });
-	co_await SslSocket->async_handshake (Ssl::stream_base::client, UseAwaitable);
+
+	// the handshake gets whatever is left of the connect timeout
+	TimeSpan _remaining = TimeSpan::zero ();
+	if (ConnectTimeout.count () > 0) {
+		_remaining = ConnectTimeout - std::chrono::duration_cast<TimeSpan> (std::chrono::steady_clock::now () - _start);
+		if (_remaining.count () <= 0)
+			throw Exception (fmt::format ("Connect to server {} timeout", m_host));
+	}
+	Deadline _deadline { _remaining, [_sock = SslSocket] () { _close_socket (_sock, _sock->next_layer ()); } };
+	try {
+		co_await SslSocket->async_handshake (Ssl::stream_base::client, UseAwaitable);
+	} catch (...) {
+		if (_deadline.IsExpired ())
+			throw Exception (fmt::format ("Connect to server {} timeout", m_host));
+		throw;
+	}
+	LastConnect.Secured = std::chrono::steady_clock::now ();
 }
 
 inline Task<void> SslConn::Send (char *_data, size_t _size) {
-	if (!SslSocket->next_layer ().is_open ())
+	if (!IsConnect ())
 		throw Exception ("Cannot send data to a closed connection.");
 	size_t _sended = 0;
 	while (_sended < _size) {
@@ -214,24 +496,38 @@ inline Task<void> SslConn::Send (char *_data, size_t _size) {
 			throw Exception ("Connection temp closed.");
 		_sended += _tmp_send;
 	}
+	Metrics::BytesOut.Add (_size);
+}
+
+inline Task<void> SslConn::SendBuffers (const std::vector<asio::const_buffer> &_bufs) {
+	if (!SslSocket || !SslSocket->next_layer ().is_open ())
+		throw Exception ("Cannot send data to a closed connection.");
+	if (_bufs.size () == 1) {
+		co_await asio::async_write (*SslSocket, _bufs, UseAwaitable);
+	} else {
+		// one TLS record for the whole batch instead of one per buffer
+		std::string _data = _join_buffers (_bufs);
+		co_await asio::async_write (*SslSocket, asio::buffer (_data), UseAwaitable);
+	}
+	Metrics::BytesOut.Add (asio::buffer_size (_bufs));
 }
 
 inline Task<size_t> SslConn::RecvImpl (char *_data, size_t _size) {
+	if (!IsConnect ())
+		co_return 0;
 	co_return co_await SslSocket->async_read_some (asio::buffer (_data, _size), UseAwaitable);
 }
 
 inline void SslConn::Cancel () {
-	try {
-		if (SslSocket)
-			SslSocket->next_layer ().cancel ();
-	} catch (...) {
-	}
-	SslSocket = nullptr;
+	if (SslSocket)
+		_close_socket (SslSocket, SslSocket->next_layer ());
 }
 
 
 
 inline SslConn2::SslConn2 (Ssl::stream<Tcp::socket> _sock): SslSocket (std::move (_sock)) {
+	ErrorCode _ec;
+	m_remote = SslSocket.next_layer ().remote_endpoint (_ec).address ();
 	if (Config::NoDelay)
 		SslSocket.next_layer ().set_option (Tcp::no_delay { true });
 }
@@ -246,6 +542,19 @@ inline Task<void> SslConn2::Send (char *_data, size_t _size) {
 			throw Exception ("Connection temp closed.");
 		_sended += _tmp_send;
 	}
+	Metrics::BytesOut.Add (_size);
+}
+
+inline Task<void> SslConn2::SendBuffers (const std::vector<asio::const_buffer> &_bufs) {
+	if (!SslSocket.next_layer ().is_open ())
+		throw Exception ("Cannot send data to a closed connection.");
+	if (_bufs.size () == 1) {
+		co_await asio::async_write (SslSocket, _bufs, UseAwaitable);
+	} else {
+		std::string _data = _join_buffers (_bufs);
+		co_await asio::async_write (SslSocket, asio::buffer (_data), UseAwaitable);
+	}
+	Metrics::BytesOut.Add (asio::buffer_size (_bufs));
 }
 
 inline void SslConn2::Cancel () {
@@ -265,72 +574,216 @@ inline Task<size_t> SslConn2::RecvImpl (char *_data, size_t _size) {
 
 
 
-inline WsConn::WsConn (std::shared_ptr<IConn2> _parent, bool _is_client): Parent (_parent), IsClient (_is_client) {}
+inline WsConn::WsConn (std::shared_ptr<IConn2> _parent, bool _is_client): Parent (_parent), IsClient (_is_client) {
+	Metrics::ActiveWebsockets.Add (1);
+	int64_t _now = std::chrono::steady_clock::now ().time_since_epoch ().count ();
+	m_last_recv.store (_now);
+	m_last_msg.store (_now);
+}
+
+inline WsConn::~WsConn () {
+	Metrics::ActiveWebsockets.Add (-1);
+}
 
 
 
 inline void WsConn::Init () {
-	fv::Tasks::RunAsync ([_wptr = std::weak_ptr (shared_from_this ())] ()->Task<void> {
-		while (true) {
-			co_await Tasks::Delay (Config::WebsocketAutoPing);
-			auto _ptr = _wptr.lock ();
-			if (!_ptr || !_ptr->IsConnect())
-				co_return;
-			_ptr->_Send (nullptr, 0, WsType::Ping);
-		}
+	if (!Parent || (Config::WebsocketAutoPing.count () <= 0 && Config::WebsocketIdleTimeout.count () <= 0))
+		return;
+	m_parent = Parent;
+	auto _executor = Parent->GetExecutor ();
+	asio::post (_executor, [_wptr = std::weak_ptr (shared_from_this ()), _executor] () {
+		auto _self = _wptr.lock ();
+		if (!_self)
+			return;
+		// the timer holds no reference, a destroyed connection's timer is dropped when it fires
+		_self->m_keepalive = TimerWheel::Get (_executor).Schedule (TimeSpan::zero (), [_wptr] () {
+			if (auto _self = _wptr.lock ())
+				_self->_Keepalive ();
+		});
 	});
 }
 
+// Runs on the connection's context, reschedules itself for the nearest of the next ping,
+// the pong deadline and the idle deadline
+inline void WsConn::_Keepalive () {
+	auto _parent = m_parent.lock ();
+	if (!_parent || !_parent->IsConnect () || !Run.load ())
+		return;
+	int64_t _now = std::chrono::steady_clock::now ().time_since_epoch ().count ();
+	int64_t _ping = std::chrono::duration_cast<std::chrono::steady_clock::duration> (Config::WebsocketAutoPing).count ();
+	int64_t _pong = std::chrono::duration_cast<std::chrono::steady_clock::duration> (Config::WebsocketPongTimeout).count ();
+	int64_t _idle = std::chrono::duration_cast<std::chrono::steady_clock::duration> (Config::WebsocketIdleTimeout).count ();
+	int64_t _last_recv = m_last_recv.load (std::memory_order_relaxed), _last_msg = m_last_msg.load (std::memory_order_relaxed);
+	if (_idle > 0 && _now - _last_msg >= _idle) {
+		Metrics::WsIdleTimeouts.Add ();
+		_parent->Cancel ();
+		return;
+	}
+	if (m_ping_at > 0 && _last_recv >= m_ping_at)
+		m_ping_at = 0;
+	if (m_ping_at > 0 && _now - m_ping_at >= _pong) {
+		Metrics::WsPongTimeouts.Add ();
+		_parent->Cancel ();
+		return;
+	}
+	int64_t _next = std::numeric_limits<int64_t>::max ();
+	if (_ping > 0) {
+		// any frame from the peer proves it alive, a ping is only sent after a quiet interval
+		if (m_ping_at == 0 && _now - std::max (_last_recv, m_last_ping) >= _ping) {
+			if (_parent->TryWrite (std::make_shared<const std::string> (EncodeFrame (nullptr, 0, WsType::Ping, IsClient))))
+				Metrics::WsMessagesOut.Add ();
+			m_last_ping = _now;
+			if (_pong > 0)
+				m_ping_at = _now;
+		}
+		_next = m_ping_at > 0 ? m_ping_at + _pong : std::max (_last_recv, m_last_ping) + _ping;
+	}
+	if (_idle > 0)
+		_next = std::min (_next, _last_msg + _idle);
+	TimerWheel::Get (_parent->GetExecutor ()).Reschedule (m_keepalive, std::chrono::steady_clock::duration (std::max<int64_t> (_next - _now, 0)));
+}
+
 
 
 inline Task<std::tuple<std::string, WsType>> WsConn::Recv () {
-	std::function<Task<std::tuple<bool, WsType, std::string>> ()> _read_pack = [this] () -> Task<std::tuple<bool, WsType, std::string>> {
-		std::vector<uint8_t> _tmp = co_await Parent->ReadCountVec (2);
-		bool _is_eof = (_tmp [0] & 0x80) != 0;
-		WsType _type = (WsType) (_tmp [0] & 0xf);
-		bool _mask = _tmp [1] & 0x80;
-		int64_t _payload_length = (int64_t) (_tmp [1] & 0x7f);
-		if (_payload_length <= 0)
-			co_return std::make_tuple (_is_eof, _type, std::string (""));
+	// Frames are decoded straight out of the connection buffer; Fill is only awaited when a
+	// frame is not fully received yet. Control frames may arrive between the fragments of
+	// a message, they are handled on their own without touching the message.
+	std::string _data = "";
+	WsType _type = WsType::Continue;
+	bool _compressed = false;
+	while (true) {
+		if (Parent->GetBuffered () < 2)
+			co_await Parent->Fill (2);
+		std::string_view _hdr = Parent->Peek (2);
+		bool _is_fin = (_hdr [0] & 0x80) != 0;
+		WsType _frame_type = (WsType) (_hdr [0] & 0xf);
+		bool _is_control = ((int) _frame_type & 0x8) != 0;
+		m_last_recv.store (std::chrono::steady_clock::now ().time_since_epoch ().count (), std::memory_order_relaxed);
+		// RSV1 marks a deflated message on its first frame only
+		if ((_hdr [0] & 0x40) != 0) {
+			if (!m_deflate || _frame_type == WsType::Continue || _is_control) {
+				Parent = nullptr;
+				throw Exception ("Unexpected RSV1 in websocket frame.");
+			}
+			_compressed = true;
+		}
+		bool _mask = (_hdr [1] & 0x80) != 0;
+		uint64_t _payload_length = (uint64_t) (_hdr [1] & 0x7f);
+		size_t _hdr_size = 2 + (_payload_length == 126 ? 2 : (_payload_length == 127 ? 8 : 0)) + (_mask ? 4 : 0);
+		if (Parent->GetBuffered () < _hdr_size)
+			co_await Parent->Fill (_hdr_size);
+		_hdr = Parent->Consume (_hdr_size);
+		size_t _pos = 2;
 		if (_payload_length == 126) {
-			_tmp = co_await Parent->ReadCountVec (2);
-			_payload_length = (((int64_t) _tmp [0]) << 8) + _tmp [1];
+			_payload_length = (((uint64_t) (uint8_t) _hdr [2]) << 8) + (uint8_t) _hdr [3];
+			_pos = 4;
 		} else if (_payload_length == 127) {
-			_tmp = co_await Parent->ReadCountVec (8);
 			_payload_length = 0;
-			for (int i = 0; i < 8; ++i)
-				_payload_length = (_payload_length << 8) + _tmp [i];
+			for (size_t i = 2; i < 10; ++i)
+				_payload_length = (_payload_length << 8) + (uint8_t) _hdr [i];
+			_pos = 10;
 		}
+		char _mask_key [4] = { 0, 0, 0, 0 };
 		if (_mask)
-			_tmp = co_await Parent->ReadCountVec (4);
-		std::string _s = co_await Parent->ReadCount ((size_t) _payload_length);
+			::memcpy (_mask_key, &_hdr [_pos], 4);
+		if (_is_control) {
+			if (!_is_fin || _payload_length > 125)
+				co_await _Fail (1002, "Invalid websocket control frame.");
+		} else {
+			if ((_frame_type == WsType::Continue) != (_type != WsType::Continue))
+				co_await _Fail (1002, "Unexpected websocket continuation frame.");
+			size_t _max = Config::WebsocketMaxMessageSize;
+			if (_max > 0 && _payload_length > _max - _data.size ())
+				co_await _Fail (1009, "Websocket message too large.");
+			if (_frame_type != WsType::Continue)
+				_type = _frame_type;
+		}
+		// Fill grows the buffer as bytes arrive, a declared length alone reserves nothing
+		if (Parent->GetBuffered () < _payload_length)
+			co_await Parent->Fill ((size_t) _payload_length);
+		std::string_view _payload = Parent->Consume ((size_t) _payload_length);
+		std::string _control = "";
+		std::string &_dest = _is_control ? _control : _data;
+		size_t _offset = _dest.size ();
+		_dest.append (_payload);
 		if (_mask) {
-			for (size_t i = 0; i < _s.size (); ++i)
-				_s [i] ^= _tmp [i % 4];
+			for (size_t i = 0; i < _payload.size (); ++i)
+				_dest [_offset + i] ^= _mask_key [i % 4];
+		}
+		//
+		if (_frame_type == WsType::Close) {
+			throw Exception ("Remote send close msg.");
+		} else if (_frame_type == WsType::Ping) {
+			co_await _Send (_control.data (), _control.size (), WsType::Pong);
+		} else if (_frame_type == WsType::Pong) {
+		} else if (_is_control) {
+			Parent = nullptr;
+			throw Exception ("Unparsed websocket frame.");
+		} else if (!_is_fin) {
+		} else if (_type == WsType::Text || _type == WsType::Binary) {
+			Metrics::WsMessagesIn.Add ();
+			m_last_msg.store (m_last_recv.load (std::memory_order_relaxed), std::memory_order_relaxed);
+			if (_compressed) {
+				bool _too_large = false;
+				try {
+					_data = m_deflate->Decompress (_data, Config::WebsocketMaxMessageSize);
+				} catch (std::length_error &) {
+					_too_large = true;
+				}
+				if (_too_large)
+					co_await _Fail (1009, "Websocket message too large.");
+			}
+			co_return std::make_tuple (std::move (_data), _type);
+		} else {
+			Parent = nullptr;
+			throw Exception ("Unparsed websocket frame.");
 		}
-		co_return std::make_tuple (_is_eof, _type, std::move (_s));
-	};
-	std::string _data2;
-	auto [_is_eof, _type, _data] = co_await _read_pack ();
-	while ((!_is_eof) || _type == WsType::Continue) {
-		std::tie (_is_eof, _type, _data2) = co_await _read_pack ();
-		_data += _data2;
 	}
-	//
-	if (_type == WsType::Close) {
-		throw Exception ("Remote send close msg.");
-	} else if (_type == WsType::Ping) {
-		co_await _Send (nullptr, 0, WsType::Pong);
-		co_return co_await Recv ();
-	} else if (_type == WsType::Pong) {
-		//co_return std::make_tuple (std::string (""), WsType::Pong);
-		co_return co_await Recv ();
-	} else if (_type == WsType::Text || _type == WsType::Binary) {
-		co_return std::make_tuple (_data, _type);
+}
+
+inline Task<void> WsConn::_Fail (uint16_t _code, std::string _reason) {
+	char _payload [2] = { (char) (_code >> 8), (char) (_code & 0xff) };
+	try {
+		co_await _Send (_payload, sizeof (_payload), WsType::Close);
+	} catch (...) {
+	}
+	Parent = nullptr;
+	throw Exception (_reason);
+}
+
+inline void WsConn::EnableDeflate (const WsDeflateParams &_params, const WsDeflateOptions &_opts) {
+	m_deflate = std::make_unique<WsDeflate> (_params, IsClient, _opts);
+}
+
+inline std::string WsConn::EncodeFrame (const char *_data, size_t _size, WsType _type, bool _is_client, bool _compressed) {
+	static const char _mask [4] = { (char) 0xfa, (char) 0xfb, (char) 0xfc, (char) 0xfd };
+	std::string _to_send;
+	_to_send.reserve (_size + 14);
+	_to_send += (char) (0x80 | (_compressed ? 0x40 : 0) | (char) _type);
+	if (_size < 0x7e) {
+		_to_send += (char) (_is_client ? (0x80 | _size) : _size);
+	} else if (_size < 0xffff) {
+		_to_send += (char) (_is_client ? 0xfe : 0x7e);
+		_to_send += (char) ((_size >> 8) & 0xff);
+		_to_send += (char) (_size & 0xff);
 	} else {
-		Parent = nullptr;
-		throw Exception ("Unparsed websocket frame.");
+		_to_send += (char) (_is_client ? 0xff : 0x7f);
+		int64_t _size64 = (int64_t) _size;
+		for (int i = 7; i >= 0; --i)
+			_to_send += (char) ((_size64 >> (i * 8)) & 0xff);
+	}
+	if (_is_client)
+		_to_send.append (_mask, 4);
+	size_t _offset = _to_send.size ();
+	if (_size > 0)
+		_to_send.append (_data, _size);
+	if (_is_client) {
+		for (size_t i = 0; i < _size; ++i)
+			_to_send [_offset + i] ^= _mask [i % 4];
 	}
+	return _to_send;
 }
 
 inline Task<void> WsConn::_Send (char *_data, size_t _size, WsType _type) {
@@ -339,37 +792,27 @@ inline Task<void> WsConn::_Send (char *_data, size_t _size, WsType _type) {
 			co_return;
 		throw Exception ("Cannot send data to a closed connection.");
 	}
-	std::stringstream _ss;
-	_ss << (char) (0x80 | (char) _type);
-	static std::vector<char> _mask = { (char) 0xfa, (char) 0xfb, (char) 0xfc, (char) 0xfd };
-	if (_size > 0) {
-		if (_size < 0x7e) {
-			_ss << (char) (IsClient ? (0x80 | _size) : _size);
-		} else if (_size < 0xffff) {
-			_ss << (char) (IsClient ? 0xfe : 0x7e) << (char) ((_size >> 8) & 0xff) << (char) (_size & 0xff);
-		} else {
-			_ss << (char) (IsClient ? 0xff : 0x7f);
-			int64_t _size64 = (int64_t) _size;
-			for (int i = 7; i >= 0; --i)
-				_ss << (char) ((_size64 >> (i * 8)) & 0xff);
-		}
-		if (IsClient) {
-			for (size_t i = 0; i < 4; ++i)
-				_ss << _mask [i];
-		}
-		_ss << std::string_view { _data, _size };
-	}
-	std::string _to_send = _ss.str ();
-	if (IsClient) {
-		for (size_t i = 0, _offset = _to_send.size () - _size; i < _size; ++i)
-			_to_send [_offset + i] ^= _mask [i % 4];
+	auto _parent = Parent;
+	if (m_deflate && (_type == WsType::Text || _type == WsType::Binary) && m_deflate->ShouldCompress (_size)) {
+		// with context takeover the peer inflates messages in the order they were deflated,
+		// so compressing and queueing must not be separated by a suspension
+		if (!co_await _parent->WaitWritable ())
+			throw Exception ("Cannot send data to a closed connection.");
+		std::unique_lock _ul { m_deflate->Mutex };
+		std::string _payload = m_deflate->Compress (std::string_view { _data, _size });
+		if (!_parent->ForceWrite (std::make_shared<const std::string> (EncodeFrame (_payload.data (), _payload.size (), _type, IsClient, true))))
+			throw Exception ("Cannot send data to a closed connection.");
+		Metrics::WsMessagesOut.Add ();
+		co_return;
 	}
-	try {
-		co_await Parent->Send (_to_send.data (), _to_send.size ());
-	} catch (...) {
+	std::string _to_send = EncodeFrame (_data, _size, _type, IsClient);
+	// goes through the write queue so pings and application frames never interleave
+	if (!co_await _parent->Write (std::move (_to_send))) {
 		if (_type != WsType::Close)
-			throw;
+			throw Exception ("Cannot send data to a closed connection.");
+		co_return;
 	}
+	Metrics::WsMessagesOut.Add ();
 }
 
 
@@ -398,7 +841,8 @@ inline Task<std::shared_ptr<WsConn>> ConnectWS (std::string _url, _Ops ..._ops)
 		_r.Headers ["Upgrade"] = "websocket";
 		_r.Headers ["Sec-WebSocket-Version"] = "13";
 		_r.Headers ["Sec-WebSocket-Key"] = base64_encode (random_str (16));
-		//_r.Headers ["Sec-WebSocket-Extensions"] = "chat";
+		if (Config::WebsocketDeflate.Enable)
+			_r.Headers ["Sec-WebSocket-Extensions"] = WsDeflateParams::Offer (Config::WebsocketDeflate);
 		if constexpr (sizeof...(_ops) > 0)
 			_OptionApplys (_r, _ops...);
 
@@ -411,8 +855,14 @@ inline Task<std::shared_ptr<WsConn>> ConnectWS (std::string _url, _Ops ..._ops)
 		co_await _conn->Send (_data.data (), _data.size ());
 
 		// recv
-		co_await Response::GetFromConn (_conn);
+		Response _res = co_await Response::GetFromConn (_conn);
 		auto _wsconn = std::make_shared<WsConn> (_conn, true);
+		if (auto _ext = _res.Headers.find ("Sec-WebSocket-Extensions"); _ext != _res.Headers.end ()) {
+			auto _params = WsDeflateParams::FromResponse (_ext->second);
+			if (!Config::WebsocketDeflate.Enable || !_params.has_value ())
+				throw Exception (fmt::format ("Unexpected websocket extension: {}", _ext->second));
+			_wsconn->EnableDeflate (_params.value ());
+		}
 		_wsconn->Init ();
 		co_return _wsconn;
 	} else {
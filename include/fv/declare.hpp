@@ -23,8 +23,10 @@ namespace fv {
 #ifdef FV_USE_BOOST_ASIO
 namespace asio = boost::asio;
 #define Task boost::asio::awaitable
+using ErrorCode = boost::system::error_code;
 #else
 #define Task asio::awaitable
+using ErrorCode = asio::error_code;
 #endif
 
 using Tcp = asio::ip::tcp;
@@ -0,0 +1,163 @@
+#ifndef __FV_DNS_HPP__
+#define __FV_DNS_HPP__
+
+
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "structs.hpp"
+
+
+
+namespace fv {
+// Process wide resolver cache. getaddrinfo does not report record TTLs, so answers are
+// kept for Config::DnsCacheTtl and failures for Config::DnsNegativeTtl. Concurrent
+// lookups of the same host share one resolver call.
+struct DnsCache {
+	// Returns every address of `_host`, IPv6 and IPv4 interleaved as RFC 8305 suggests.
+	// IP literals are returned as is, Config::DnsResolve overrides the cache when set.
+	static Task<std::vector<asio::ip::address>> Resolve (std::string _host) {
+		ErrorCode _ec;
+		auto _literal = asio::ip::make_address (_host, _ec);
+		if (!_ec)
+			co_return std::vector<asio::ip::address> { _literal };
+		if (Config::DnsResolve) {
+			std::string _ip = co_await Config::DnsResolve (_host);
+			co_return std::vector<asio::ip::address> { asio::ip::make_address (_ip == "" ? _host : _ip) };
+		}
+
+		while (true) {
+			std::unique_lock _ul { m_mtx };
+			auto _now = std::chrono::steady_clock::now ();
+			auto _it = m_items.find (_host);
+			if (_it != m_items.end ()) {
+				auto _item = _it->second;
+				if (_item->Pending) {
+					_ul.unlock ();
+					co_await _item->Done.Wait ();
+					continue;
+				}
+				if (_item->Expire > _now) {
+					if (_item->Error != "")
+						throw Exception (_item->Error);
+					co_return _item->Addrs;
+				}
+			}
+
+			auto _item = std::make_shared<Item> ();
+			_item->Pending = true;
+			if (m_items.size () >= MaxSize)
+				_prune (_now);
+			m_items [_host] = _item;
+			_ul.unlock ();
+			_Lead _lead { _item };
+
+			std::vector<asio::ip::address> _addrs;
+			std::string _error = "";
+			try {
+				_addrs = co_await _lookup (_host);
+				if (_addrs.empty ())
+					_error = fmt::format ("Cannot resolve host {}", _host);
+			} catch (std::exception &_e) {
+				_error = fmt::format ("Cannot resolve host {}: {}", _host, _e.what ());
+			}
+
+			_ul.lock ();
+			_item->Addrs = _addrs;
+			_item->Error = _error;
+			_item->Expire = std::chrono::steady_clock::now () + (_error == "" ? Config::DnsCacheTtl : Config::DnsNegativeTtl);
+			_ul.unlock ();
+			if (_error != "")
+				throw Exception (_error);
+			co_return _addrs;
+		}
+	}
+
+	static void Remove (std::string _host) {
+		std::unique_lock _ul { m_mtx };
+		auto _it = m_items.find (_host);
+		if (_it != m_items.end () && !_it->second->Pending)
+			m_items.erase (_it);
+	}
+
+	static void Clear () {
+		std::unique_lock _ul { m_mtx };
+		std::erase_if (m_items, [] (auto &_kv) { return !_kv.second->Pending; });
+	}
+
+private:
+	static constexpr size_t MaxSize = 4096;
+
+	struct Item {
+		std::vector<asio::ip::address> Addrs;
+		std::string Error = "";
+		std::chrono::steady_clock::time_point Expire;
+		bool Pending = false;
+		AsyncEvent Done {};
+	};
+
+	// Finishes the lookup of `Target` however the leading coroutine leaves it, destruction
+	// while suspended included. Without a result the entry stays expired and the next
+	// caller looks the host up again.
+	struct _Lead {
+		std::shared_ptr<Item> Target;
+		~_Lead () {
+			{
+				std::unique_lock _ul { m_mtx };
+				Target->Pending = false;
+			}
+			Target->Done.Set ();
+		}
+	};
+
+	static Task<std::vector<asio::ip::address>> _lookup (std::string _host) {
+		Tcp::resolver _resolver { Tasks::GetContext () };
+		auto _results = co_await _resolver.async_resolve (_host, "", UseAwaitable);
+		std::vector<asio::ip::address> _v6, _v4, _ret;
+		for (auto &_entry : _results) {
+			auto _addr = _entry.endpoint ().address ();
+			auto &_dest = _addr.is_v6 () ? _v6 : _v4;
+			if (std::find (_dest.begin (), _dest.end (), _addr) == _dest.end ())
+				_dest.push_back (_addr);
+		}
+		for (size_t i = 0; i < _v6.size () || i < _v4.size (); ++i) {
+			if (i < _v6.size ())
+				_ret.push_back (_v6 [i]);
+			if (i < _v4.size ())
+				_ret.push_back (_v4 [i]);
+		}
+		co_return _ret;
+	}
+
+	// Drops expired answers, then the ones closest to expiring until an eighth of the
+	// cache is free again
+	static void _prune (std::chrono::steady_clock::time_point _now) {
+		std::erase_if (m_items, [_now] (auto &_kv) { return !_kv.second->Pending && _kv.second->Expire <= _now; });
+		if (m_items.size () < MaxSize)
+			return;
+		std::vector<std::pair<std::chrono::steady_clock::time_point, std::string>> _oldest;
+		for (auto &[_host, _item] : m_items) {
+			if (!_item->Pending)
+				_oldest.emplace_back (_item->Expire, _host);
+		}
+		size_t _drop = std::min (_oldest.size (), m_items.size () - MaxSize * 7 / 8);
+		std::nth_element (_oldest.begin (), _oldest.begin () + _drop, _oldest.end ());
+		for (size_t i = 0; i < _drop; ++i)
+			m_items.erase (_oldest [i].second);
+	}
+
+	inline static std::mutex m_mtx;
+	inline static std::unordered_map<std::string, std::shared_ptr<Item>> m_items;
+};
+}
+
+
+
+#endif //__FV_DNS_HPP__
@@ -22,15 +22,24 @@ inline const char *version = "libfv-0.1.0-release";
 
 #include "declare.hpp"
 #include "structs.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 #include "common.hpp"
 #include "common_funcs.hpp"
+#include "dns.hpp"
 #include "conn.hpp"
 #include "conn_impl.hpp"
 #include "ioctx_pool.hpp"
+#include "router.hpp"
 #include "req_res.hpp"
 #include "req_res_impl.hpp"
 #include "server.hpp"
+#include "wshub.hpp"
 #include "session.hpp"
+#include "udp.hpp"
+#include "upstream.hpp"
+#include "batch.hpp"
+#include "metrics_impl.hpp"
 
 
 
@@ -0,0 +1,507 @@
+#ifndef __FV_HTTP_CACHE_HPP__
+#define __FV_HTTP_CACHE_HPP__
+
+
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <list>
+#include <locale>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "common_funcs.hpp"
+#include "req_res.hpp"
+
+
+
+namespace fv {
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+inline std::optional<std::chrono::system_clock::time_point> _parse_http_date (std::string_view _s) {
+	std::tm _tm {};
+	std::istringstream _ss { std::string (_s) };
+	_ss.imbue (std::locale::classic ());
+	_ss >> std::get_time (&_tm, "%a, %d %b %Y %H:%M:%S");
+	if (_ss.fail ())
+		return std::nullopt;
+#ifdef _WIN32
+	return std::chrono::system_clock::from_time_t (::_mkgmtime (&_tm));
+#else
+	return std::chrono::system_clock::from_time_t (::timegm (&_tm));
+#endif
+}
+
+
+
+// Private, in-process HTTP cache (RFC 9111) for GET requests of Session and the pooled
+// fv::Get. Off until Enable is called. Fresh responses are served without a round trip,
+// stale ones are revalidated with If-None-Match / If-Modified-Since, and concurrent misses
+// of one url wait for a single request. Responses to requests carrying Authorization are
+// keyed by it and never written to disk.
+struct HttpCache {
+	// `_max_bytes` bounds the memory LRU; with `_dir` set, cached responses are also kept
+	// on disk and survive restarts. Drops the default `Pragma` / `Cache-Control: no-cache`
+	// request headers, call it before sending requests.
+	static void Enable (size_t _max_bytes, std::string _dir = "") {
+		std::unique_lock _ul { m_mtx };
+		m_max_bytes = _max_bytes;
+		m_dir = _dir;
+		if (m_dir != "")
+			std::filesystem::create_directories (m_dir);
+		m_enabled = _max_bytes > 0;
+		_trim ();
+		for (std::string _key : { "Pragma", "Cache-Control" }) {
+			if (auto _value = Request::RemoveDefaultHeader (_key))
+				m_removed_headers.emplace_back (_key, std::move (_value.value ()));
+		}
+	}
+
+	// Puts back only the default headers Enable removed
+	static void Disable () {
+		std::unique_lock _ul { m_mtx };
+		m_enabled = false;
+		for (auto &[_key, _value] : m_removed_headers)
+			Request::SetDefaultHeader (_key, _value);
+		m_removed_headers.clear ();
+	}
+
+	static bool IsEnabled () { return m_enabled; }
+
+	static void Remove (std::string _url) {
+		std::unique_lock _ul { m_mtx };
+		_erase (_url);
+		std::string _dir = m_dir;
+		_ul.unlock ();
+		if (_dir != "") {
+			std::unique_lock _dl { m_disk_mtx };
+			std::error_code _ec;
+			std::filesystem::remove (_disk_path (_dir, _url), _ec);
+		}
+	}
+
+	static void Clear () {
+		std::unique_lock _ul { m_mtx };
+		m_items.clear ();
+		m_lru.clear ();
+		m_bytes = 0;
+		std::string _dir = m_dir;
+		_ul.unlock ();
+		if (_dir != "") {
+			std::unique_lock _dl { m_disk_mtx };
+			std::error_code _ec;
+			for (auto &_file : std::filesystem::directory_iterator (_dir, _ec)) {
+				if (_file.path ().extension () == ".fvcache")
+					std::filesystem::remove (_file.path (), _ec);
+			}
+		}
+	}
+
+	// Answers `_r` from the cache or through `_fetch`, storing what may be stored
+	static Task<Response> Do (Request _r, std::function<Task<Response> (Request)> _fetch) {
+		auto _req_cc = _directives (_r.Headers);
+		bool _conditional = _r.Headers.contains ("If-None-Match") || _r.Headers.contains ("If-Modified-Since") || _r.Headers.contains ("Range");
+		if (_r.Method != MethodType::Get || _conditional || _req_cc.NoStore)
+			co_return co_await _fetch (std::move (_r));
+
+		std::string _key = _make_key (_r);
+		bool _waited = false;
+		while (true) {
+			std::unique_lock _ul { m_mtx };
+			auto _entry = _find (_key);
+			// a memory miss is looked up on disk by whoever claims the flight below
+			std::string _dir = !_entry && _key.find ('\n') == std::string::npos ? m_dir : "";
+			size_t _max_bytes = m_max_bytes;
+			if (_entry && !_entry->Matches (_r.Headers))
+				_entry = nullptr;
+			if (_entry && !_req_cc.NoCache && _entry->IsFresh (_req_cc.MaxAge))
+				co_return _entry->Res;
+
+			auto _flight_it = m_flights.find (_key);
+			if (!_waited && _flight_it != m_flights.end ()) {
+				auto _done = _flight_it->second;
+				_ul.unlock ();
+				co_await _done->Wait ();
+				_waited = true;
+				continue;
+			}
+			bool _lead = _flight_it == m_flights.end ();
+			std::shared_ptr<AsyncEvent> _done;
+			if (_lead) {
+				_done = std::make_shared<AsyncEvent> ();
+				m_flights [_key] = _done;
+			}
+			_ul.unlock ();
+
+			std::exception_ptr _ex = nullptr;
+			Response _res {};
+			try {
+				if (_dir != "") {
+					_entry = _Load (_dir, _key, _max_bytes);
+					if (_entry && !_entry->Matches (_r.Headers))
+						_entry = nullptr;
+				}
+				if (_entry && !_req_cc.NoCache && _entry->IsFresh (_req_cc.MaxAge)) {
+					_res = _entry->Res;
+				} else {
+					_res = co_await _Revalidate (_r, _key, _entry, _fetch);
+				}
+			} catch (...) {
+				_ex = std::current_exception ();
+			}
+			if (_lead) {
+				_ul.lock ();
+				m_flights.erase (_key);
+				_ul.unlock ();
+				_done->Set ();
+			}
+			if (_ex)
+				std::rethrow_exception (_ex);
+			co_return _res;
+		}
+	}
+
+	// Unsafe methods invalidate what is stored for their url (RFC 9111 4.4)
+	static void OnUnsafe (const Request &_r, const Response &_res) {
+		if (m_enabled && _r.Method != MethodType::Get && _r.Method != MethodType::Head && _res.HttpCode >= 200 && _res.HttpCode < 400)
+			Remove (_make_key (_r));
+	}
+
+private:
+	using Clock = std::chrono::system_clock;
+
+	struct Directives {
+		bool NoStore = false, NoCache = false;
+		std::optional<int64_t> MaxAge;
+	};
+
+	struct Entry {
+		Response Res;
+		std::vector<std::pair<std::string, std::string>> Vary;
+		Clock::time_point ResponseTime;
+		TimeSpan InitialAge {}, Lifetime {};
+		bool NoCache = false, Private = false;
+		size_t Bytes = 0;
+
+		bool Matches (CaseInsensitiveMap &_headers) const {
+			for (auto &[_name, _value] : Vary) {
+				auto _it = _headers.find (_name);
+				if ((_it == _headers.end () ? std::string {} : _it->second) != _value)
+					return false;
+			}
+			return true;
+		}
+
+		bool IsFresh (std::optional<int64_t> _req_max_age) const {
+			if (NoCache)
+				return false;
+			TimeSpan _age = InitialAge + (Clock::now () - ResponseTime);
+			if (_req_max_age.has_value () && _age > std::chrono::seconds (_req_max_age.value ()))
+				return false;
+			return _age < Lifetime;
+		}
+	};
+
+	struct Node {
+		std::shared_ptr<Entry> Item;
+		std::list<std::string>::iterator LruIt;
+	};
+
+	static Task<Response> _Revalidate (Request _r, std::string _key, std::shared_ptr<Entry> _entry, std::function<Task<Response> (Request)> &_fetch) {
+		if (_entry) {
+			auto _etag = _entry->Res.Headers.find ("ETag");
+			auto _modified = _entry->Res.Headers.find ("Last-Modified");
+			if (_etag != _entry->Res.Headers.end ())
+				_r.Headers ["If-None-Match"] = _etag->second;
+			if (_modified != _entry->Res.Headers.end ())
+				_r.Headers ["If-Modified-Since"] = _modified->second;
+		}
+		CaseInsensitiveMap _req_headers = _r.Headers;
+		Response _res = co_await _fetch (std::move (_r));
+		auto _now = Clock::now ();
+
+		if (_res.HttpCode == 304 && _entry) {
+			auto _updated = std::make_shared<Entry> (*_entry);
+			for (auto &[_k, _v] : _res.Headers) {
+				if (!_iequals (_k, "Content-Length") && !_iequals (_k, "Content-Encoding") && !_iequals (_k, "Transfer-Encoding"))
+					_updated->Res.Headers [_k] = _v;
+			}
+			if (_Fill (*_updated, _req_headers, _now)) {
+				_Store (_key, _updated);
+			} else {
+				std::unique_lock _ul { m_mtx };
+				_erase (_key);
+			}
+			co_return _updated->Res;
+		}
+
+		auto _fresh = std::make_shared<Entry> ();
+		_fresh->Res = _res;
+		if (_Fill (*_fresh, _req_headers, _now)) {
+			_Store (_key, _fresh);
+		} else if (_entry) {
+			std::unique_lock _ul { m_mtx };
+			_erase (_key);
+		}
+		co_return _res;
+	}
+
+	// Computes freshness of a received response, false if it must not be stored
+	static bool _Fill (Entry &_entry, CaseInsensitiveMap &_req_headers, Clock::time_point _now) {
+		static const std::vector<int> s_heuristic { 200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501 };
+		auto &_headers = _entry.Res.Headers;
+		auto _cc = _directives (_headers);
+		if (_cc.NoStore || _entry.Res.HttpCode < 200 || _entry.Res.HttpCode == 206 || _entry.Res.HttpCode == 304)
+			return false;
+
+		_entry.Vary.clear ();
+		if (auto _vary = _headers.find ("Vary"); _vary != _headers.end ()) {
+			bool _ok = true;
+			KvView { _vary->second, ',' }.ForEach ([&] (std::string_view _name, std::string_view) {
+				if (_name == "*")
+					return _ok = false;
+				auto _it = _req_headers.find (std::string (_name));
+				_entry.Vary.emplace_back (std::string (_name), _it == _req_headers.end () ? std::string {} : _it->second);
+				return true;
+			});
+			if (!_ok)
+				return false;
+		}
+
+		auto _date = _headers.contains ("Date") ? _parse_http_date (_headers ["Date"]) : std::nullopt;
+		Clock::time_point _date_value = _date.value_or (_now);
+		TimeSpan _age_value {};
+		if (auto _age = _headers.find ("Age"); _age != _headers.end ())
+			_age_value = std::chrono::seconds (std::atoll (_age->second.c_str ()));
+		_entry.ResponseTime = _now;
+		_entry.InitialAge = std::max (std::max (TimeSpan {}, _now - _date_value), _age_value);
+		_entry.NoCache = _cc.NoCache;
+
+		bool _explicit = true;
+		if (_cc.MaxAge.has_value ()) {
+			_entry.Lifetime = std::chrono::seconds (_cc.MaxAge.value ());
+		} else if (auto _expires = _headers.find ("Expires"); _expires != _headers.end ()) {
+			// invalid dates, "0" included, mean already expired
+			auto _exp = _parse_http_date (_expires->second);
+			_entry.Lifetime = _exp.has_value () ? std::max (TimeSpan {}, _exp.value () - _date_value) : TimeSpan {};
+		} else {
+			_explicit = false;
+			_entry.Lifetime = {};
+			auto _modified = _headers.contains ("Last-Modified") ? _parse_http_date (_headers ["Last-Modified"]) : std::nullopt;
+			// heuristic freshness, 10% of the time since the last modification
+			if (_modified.has_value () && _modified.value () < _date_value)
+				_entry.Lifetime = std::min<TimeSpan> ((_date_value - _modified.value ()) / 10, std::chrono::hours (24));
+		}
+		bool _validators = _headers.contains ("ETag") || _headers.contains ("Last-Modified");
+		if (!_explicit && std::find (s_heuristic.begin (), s_heuristic.end (), _entry.Res.HttpCode) == s_heuristic.end ())
+			return false;
+		if (_entry.Lifetime.count () <= 0 && !_validators)
+			return false;
+
+		_entry.Private = _req_headers.contains ("Authorization");
+		_entry.Bytes = _entry.Res.Content.size () + 256;
+		for (auto &[_k, _v] : _headers)
+			_entry.Bytes += _k.size () + _v.size ();
+		return true;
+	}
+
+	static Directives _directives (CaseInsensitiveMap &_headers) {
+		Directives _ret {};
+		auto _it = _headers.find ("Cache-Control");
+		if (_it == _headers.end ()) {
+			auto _pragma = _headers.find ("Pragma");
+			_ret.NoCache = _pragma != _headers.end () && _to_lower (_pragma->second).find ("no-cache") != std::string::npos;
+			return _ret;
+		}
+		std::string _value = _to_lower (_it->second);
+		KvView { _value, ',' }.ForEach ([&] (std::string_view _k, std::string_view _v) {
+			if (_k == "no-store") {
+				_ret.NoStore = true;
+			} else if (_k == "no-cache") {
+				_ret.NoCache = true;
+			} else if (_k == "max-age") {
+				if (_v.size () > 1 && _v.front () == '"' && _v.back () == '"')
+					_v = _v.substr (1, _v.size () - 2);
+				_ret.MaxAge = std::atoll (std::string (_v).c_str ());
+			}
+			return true;
+		});
+		return _ret;
+	}
+
+	static std::string _make_key (const Request &_r) {
+		std::string _key = _r.Url;
+		for (auto &_item : _r.QueryItems) {
+			_key += _key.find ('?') == std::string::npos ? '?' : '&';
+			_key += fmt::format ("{}={}", percent_encode (_item.Name), percent_encode (_item.Value));
+		}
+		auto _auth = _r.Headers.find ("Authorization");
+		if (_auth != _r.Headers.end ())
+			_key += fmt::format ("\n{}", _auth->second);
+		return _key;
+	}
+
+	// caller holds m_mtx, memory only
+	static std::shared_ptr<Entry> _find (const std::string &_key) {
+		auto _it = m_items.find (_key);
+		if (_it == m_items.end ())
+			return nullptr;
+		m_lru.splice (m_lru.begin (), m_lru, _it->second.LruIt);
+		return _it->second.Item;
+	}
+
+	// Reads without m_mtx held, and keeps what another request stored meanwhile
+	static std::shared_ptr<Entry> _Load (const std::string &_dir, const std::string &_key, size_t _max_bytes) {
+		auto _entry = _load (_dir, _key, _max_bytes);
+		if (!_entry)
+			return nullptr;
+		std::unique_lock _ul { m_mtx };
+		if (auto _current = _find (_key))
+			return _current;
+		if (m_enabled) {
+			_insert (_key, _entry);
+			_trim ();
+		}
+		return _entry;
+	}
+
+	// The file is written without m_mtx held. Writes and removals are ordered by m_disk_mtx,
+	// and an entry replaced or removed in the meantime is not written back.
+	static void _Store (const std::string &_key, std::shared_ptr<Entry> _entry) {
+		std::unique_lock _ul { m_mtx };
+		if (!m_enabled || _entry->Bytes > m_max_bytes)
+			return;
+		_erase (_key);
+		_insert (_key, _entry);
+		_trim ();
+		if (m_dir == "" || _entry->Private)
+			return;
+		_ul.unlock ();
+		std::unique_lock _dl { m_disk_mtx };
+		_ul.lock ();
+		auto _it = m_items.find (_key);
+		bool _current = _it != m_items.end () && _it->second.Item == _entry;
+		std::string _dir = m_dir;
+		_ul.unlock ();
+		if (_current && _dir != "")
+			_save (_dir, _key, *_entry);
+	}
+
+	// caller holds m_mtx
+	static void _insert (const std::string &_key, std::shared_ptr<Entry> _entry) {
+		m_lru.push_front (_key);
+		m_bytes += _entry->Bytes;
+		m_items [_key] = Node { _entry, m_lru.begin () };
+	}
+
+	// caller holds m_mtx
+	static void _erase (const std::string &_key) {
+		auto _it = m_items.find (_key);
+		if (_it == m_items.end ())
+			return;
+		m_bytes -= _it->second.Item->Bytes;
+		m_lru.erase (_it->second.LruIt);
+		m_items.erase (_it);
+	}
+
+	// caller holds m_mtx
+	static void _trim () {
+		while (m_bytes > m_max_bytes && !m_lru.empty ())
+			_erase (m_lru.back ());
+	}
+
+	static std::string _disk_path (const std::string &_dir, const std::string &_key) {
+		return (std::filesystem::path (_dir) / fmt::format ("{:016x}.fvcache", std::hash<std::string> {} (_key))).string ();
+	}
+
+	static int64_t _to_ms (TimeSpan _t) { return std::chrono::duration_cast<std::chrono::milliseconds> (_t).count (); }
+
+	// Blocking file io, the disk store is meant for small, long lived responses. Written to a
+	// temporary file first, so concurrent loads never see a partial one; caller holds m_disk_mtx.
+	static void _save (const std::string &_dir, const std::string &_key, const Entry &_entry) {
+		std::string _path = _disk_path (_dir, _key), _tmp = _path + ".tmp";
+		std::ofstream _ofs { _tmp, std::ios::binary | std::ios::trunc };
+		if (!_ofs)
+			return;
+		_ofs << "fvcache1\n" << _key << '\n';
+		_ofs << _entry.Res.HttpCode << ' ' << _to_ms (_entry.ResponseTime.time_since_epoch ()) << ' ' << _to_ms (_entry.InitialAge) << ' ' << _to_ms (_entry.Lifetime) << ' ' << _entry.NoCache << '\n';
+		_ofs << _entry.Vary.size () << '\n';
+		for (auto &[_k, _v] : _entry.Vary)
+			_ofs << _k << ": " << _v << '\n';
+		_ofs << _entry.Res.Headers.size () << '\n';
+		for (auto &[_k, _v] : _entry.Res.Headers)
+			_ofs << _k << ": " << _v << '\n';
+		_ofs << _entry.Res.Content.size () << '\n';
+		_ofs.write (_entry.Res.Content.data (), _entry.Res.Content.size ());
+		_ofs.close ();
+		std::error_code _ec;
+		if (_ofs) {
+			std::filesystem::rename (_tmp, _path, _ec);
+		} else {
+			std::filesystem::remove (_tmp, _ec);
+		}
+	}
+
+	static std::shared_ptr<Entry> _load (const std::string &_dir, const std::string &_key, size_t _max_bytes) {
+		std::ifstream _ifs { _disk_path (_dir, _key), std::ios::binary };
+		if (!_ifs)
+			return nullptr;
+		std::string _line;
+		if (!std::getline (_ifs, _line) || _line != "fvcache1" || !std::getline (_ifs, _line) || _line != _key)
+			return nullptr;
+		auto _entry = std::make_shared<Entry> ();
+		int64_t _resp_ms = 0, _age_ms = 0, _life_ms = 0;
+		size_t _count = 0;
+		_ifs >> _entry->Res.HttpCode >> _resp_ms >> _age_ms >> _life_ms >> _entry->NoCache;
+		_entry->ResponseTime = Clock::time_point { std::chrono::duration_cast<Clock::duration> (std::chrono::milliseconds (_resp_ms)) };
+		_entry->InitialAge = std::chrono::milliseconds (_age_ms);
+		_entry->Lifetime = std::chrono::milliseconds (_life_ms);
+		auto _read_pairs = [&] (auto &&_add) {
+			_ifs >> _count;
+			std::getline (_ifs, _line);
+			for (size_t i = 0; i < _count && std::getline (_ifs, _line); ++i) {
+				size_t _p = _line.find (": ");
+				if (_p != std::string::npos)
+					_add (_line.substr (0, _p), _line.substr (_p + 2));
+			}
+		};
+		_read_pairs ([&] (std::string _k, std::string _v) { _entry->Vary.emplace_back (_k, _v); });
+		_read_pairs ([&] (std::string _k, std::string _v) { _entry->Res.Headers [_k] = _v; });
+		_ifs >> _count;
+		std::getline (_ifs, _line);
+		_entry->Res.Content.resize (_count);
+		_ifs.read (_entry->Res.Content.data (), _count);
+		if (!_ifs)
+			return nullptr;
+		_entry->Bytes = _entry->Res.Content.size () + 256;
+		for (auto &[_k, _v] : _entry->Res.Headers)
+			_entry->Bytes += _k.size () + _v.size ();
+		if (_entry->Bytes > _max_bytes)
+			return nullptr;
+		return _entry;
+	}
+
+	inline static std::mutex m_mtx, m_disk_mtx;
+	inline static std::atomic_bool m_enabled { false };
+	inline static size_t m_max_bytes = 0, m_bytes = 0;
+	inline static std::string m_dir = "";
+	inline static std::vector<std::pair<std::string, std::string>> m_removed_headers;
+	inline static std::list<std::string> m_lru;
+	inline static std::unordered_map<std::string, Node> m_items;
+	inline static std::unordered_map<std::string, std::shared_ptr<AsyncEvent>> m_flights;
+};
+}
+
+
+
+#endif //__FV_HTTP_CACHE_HPP__
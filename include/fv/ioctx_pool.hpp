@@ -5,6 +5,7 @@
 
 #include "declare.hpp"
 #include "common.hpp"
+#include "metrics.hpp"
 
 
 
@@ -26,6 +27,7 @@ public:
 		}
 		m_main_ioctx = std::make_shared<fv::IoContext> ();
 		m_main_work = std::make_shared<fv::IoContext::work> (*m_main_ioctx);
+		m_loads = std::make_unique<ContextLoad []> (_nthread);
 	}
 
 	void Run () {
@@ -33,6 +35,7 @@ public:
 		for (size_t i = 0; i < m_ioctxs.size (); ++i) {
 			_threads.emplace_back (std::make_shared<std::thread> ([] (std::shared_ptr<fv::IoContext> svr) { svr->run (); }, m_ioctxs [i]));
 		}
+		asio::co_spawn (*m_main_ioctx, _ProbeLag (), asio::detached);
 		m_main_ioctx->run ();
 		for (size_t i = 0; i < _threads.size (); ++i) {
 			_threads [i]->join ();
@@ -52,14 +55,46 @@ public:
 	}
 
 	fv::IoContext &GetContext () {
-		return *m_ioctxs [m_cur_index++ % m_ioctxs.size ()];
+		return *m_ioctxs [NextIndex ()];
+	}
+
+	size_t NextIndex () {
+		return m_cur_index++ % m_ioctxs.size ();
+	}
+
+	size_t GetContextCount () {
+		return m_ioctxs.size ();
+	}
+
+	fv::IoContext &GetContext (size_t _index) {
+		return *m_ioctxs [_index % m_ioctxs.size ()];
+	}
+
+	ContextLoad &GetLoad (size_t _index) {
+		return m_loads [_index % m_ioctxs.size ()];
 	}
 
 private:
+	// Posts a probe to every context each Metrics::ProbeInterval; the time it waits
+	// before running is the queueing delay of that context
+	Task<void> _ProbeLag () {
+		asio::steady_timer _timer { *m_main_ioctx };
+		while (true) {
+			_timer.expires_after (Metrics::ProbeInterval);
+			co_await _timer.async_wait (UseAwaitable);
+			for (size_t i = 0; i < m_ioctxs.size (); ++i) {
+				asio::post (*m_ioctxs [i], [_load = &m_loads [i], _start = std::chrono::steady_clock::now ()] () {
+					_load->LagNs.store ((std::chrono::steady_clock::now () - _start).count (), std::memory_order_relaxed);
+				});
+			}
+		}
+	}
+
 	std::vector<std::shared_ptr<fv::IoContext>> m_ioctxs;
 	std::vector<std::shared_ptr<fv::IoContext::work>> m_works;
 	std::shared_ptr<fv::IoContext> m_main_ioctx;
 	std::shared_ptr<fv::IoContext::work> m_main_work;
+	std::unique_ptr<ContextLoad []> m_loads;
 	size_t m_cur_index = 0;
 };
 }
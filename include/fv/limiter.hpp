@@ -0,0 +1,169 @@
+#ifndef __FV_LIMITER_HPP__
+#define __FV_LIMITER_HPP__
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+#include "declare.hpp"
+
+
+
+namespace fv {
+struct AdaptiveLimiterOptions {
+	size_t InitialLimit = 64, MinLimit = 8, MaxLimit = 2048;
+	// fast / slow latency ratio that still counts as healthy
+	double Tolerance = 1.5;
+	// weight of a new limit against the previous one
+	double Smoothing = 0.2;
+};
+
+// Concurrency limit that follows handler latency, after the Gradient2 limiter of Netflix
+// concurrency-limits. A fast and a slow moving average of latency are compared: while
+// the fast one stays within Tolerance of the slow one the limit grows by about
+// sqrt (limit) per sample window, once latency rises the limit shrinks in proportion.
+// Requests past the limit are refused, so queueing happens in clients, not in the server.
+class AdaptiveLimiter {
+public:
+	using Options = AdaptiveLimiterOptions;
+
+	AdaptiveLimiter (Options _opts = {}): m_opts (_opts), m_limit ((double) _opts.InitialLimit), m_limit_int (_opts.InitialLimit) {}
+
+	bool TryAcquire () {
+		size_t _inflight = m_inflight.fetch_add (1, std::memory_order_relaxed);
+		if (_inflight < m_limit_int.load (std::memory_order_relaxed))
+			return true;
+		m_inflight.fetch_sub (1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// `_ok` false for failures, they release the slot without a latency sample
+	void Release (std::chrono::nanoseconds _latency, bool _ok) {
+		size_t _inflight = m_inflight.fetch_sub (1, std::memory_order_relaxed);
+		if (!_ok || _latency.count () <= 0)
+			return;
+		// samples that arrive while another thread updates are dropped, not queued
+		std::unique_lock _ul { m_mtx, std::try_to_lock };
+		if (!_ul.owns_lock ())
+			return;
+		double _sample = (double) _latency.count ();
+		if (m_short <= 0) {
+			m_short = m_long = _sample;
+			return;
+		}
+		m_short += (_sample - m_short) * ShortWeight;
+		m_long += (_sample - m_long) * LongWeight;
+		// a sustained shift makes the slow average catch up instead of pinning the limit low
+		if (m_long / m_short > 2)
+			m_long *= 0.95;
+		// only grow when the limit is actually being used
+		if (_inflight * 2 < (size_t) m_limit && m_short <= m_long * m_opts.Tolerance)
+			return;
+		double _gradient = std::clamp (m_opts.Tolerance * m_long / m_short, 0.5, 1.0);
+		double _next = m_limit * _gradient + std::sqrt (m_limit);
+		m_limit = std::clamp (m_limit * (1 - m_opts.Smoothing) + _next * m_opts.Smoothing, (double) m_opts.MinLimit, (double) m_opts.MaxLimit);
+		m_limit_int.store ((size_t) m_limit, std::memory_order_relaxed);
+	}
+
+	size_t GetLimit () const { return m_limit_int.load (std::memory_order_relaxed); }
+	size_t GetInflight () const { return m_inflight.load (std::memory_order_relaxed); }
+
+private:
+	static constexpr double ShortWeight = 0.1, LongWeight = 0.002;
+
+	Options m_opts;
+	std::mutex m_mtx;
+	double m_limit = 0, m_short = 0, m_long = 0;
+	std::atomic_size_t m_limit_int { 0 }, m_inflight { 0 };
+};
+
+
+
+// Token buckets for many keys in one fixed table, kept as GCRA: a bucket is the time at
+// which it would be full again, so taking a token is one compare-and-swap on the key's own
+// slot and threads only contend on the same key. A key may sit in one of a few slots after
+// its hash; when all of them are taken the coldest is replaced, and a key idle long enough
+// to refill loses nothing by that. Lookups race with replacement, so counting is approximate
+// while the table is full.
+class RateLimiter {
+public:
+	// `_rate` tokens per second, up to `_burst` at once; `_max_keys` is rounded up to a power of two
+	RateLimiter (double _rate, double _burst, size_t _max_keys = 65536) {
+		m_interval = (int64_t) (1e9 / std::max (_rate, 1e-9));
+		m_tolerance = (int64_t) (m_interval * std::max (_burst - 1, 0.0));
+		size_t _size = ProbeCount;
+		while (_size < _max_keys)
+			_size *= 2;
+		m_slots = std::make_unique<Slot []> (_size);
+		m_mask = _size - 1;
+	}
+
+	// Zero when a token was taken, otherwise how long until the next one
+	std::chrono::nanoseconds TryAcquire (uint64_t _key) {
+		int64_t _now = std::chrono::steady_clock::now ().time_since_epoch ().count ();
+		Slot &_slot = _find (_key | 1, _now);
+		int64_t _tat = _slot.Tat.load (std::memory_order_relaxed);
+		while (true) {
+			int64_t _next = std::max (_tat, _now) + m_interval;
+			if (_next - m_interval - m_tolerance > _now)
+				return std::chrono::nanoseconds (_next - m_interval - m_tolerance - _now);
+			if (_slot.Tat.compare_exchange_weak (_tat, _next, std::memory_order_relaxed))
+				return std::chrono::nanoseconds::zero ();
+		}
+	}
+	std::chrono::nanoseconds TryAcquire (std::string_view _key) { return TryAcquire (Hash (_key)); }
+
+	static uint64_t Hash (std::string_view _key) {
+		// splitmix64 finalizer, std::hash may be the identity for short inputs
+		uint64_t _h = (uint64_t) std::hash<std::string_view> {} (_key);
+		_h = (_h ^ (_h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		_h = (_h ^ (_h >> 27)) * 0x94d049bb133111ebull;
+		return _h ^ (_h >> 31);
+	}
+
+private:
+	static constexpr size_t ProbeCount = 8;
+
+	struct Slot {
+		std::atomic_uint64_t Key { 0 };
+		std::atomic_int64_t Tat { 0 };
+	};
+
+	Slot &_find (uint64_t _key, int64_t _now) {
+		size_t _base = (size_t) _key & m_mask & ~(ProbeCount - 1);
+		Slot *_coldest = nullptr;
+		int64_t _coldest_tat = 0;
+		for (size_t i = 0; i < ProbeCount; ++i) {
+			Slot &_slot = m_slots [_base + i];
+			uint64_t _cur = _slot.Key.load (std::memory_order_relaxed);
+			if (_cur == _key)
+				return _slot;
+			int64_t _tat = _cur == 0 ? 0 : _slot.Tat.load (std::memory_order_relaxed);
+			if (!_coldest || _tat < _coldest_tat) {
+				_coldest = &_slot;
+				_coldest_tat = _tat;
+			}
+		}
+		// a new key starts with a full bucket; whoever claims the slot first resets it
+		uint64_t _cur = _coldest->Key.load (std::memory_order_relaxed);
+		if (_cur != _key && _coldest->Key.compare_exchange_strong (_cur, _key, std::memory_order_relaxed))
+			_coldest->Tat.store (std::min (_coldest_tat, _now), std::memory_order_relaxed);
+		return *_coldest;
+	}
+
+	int64_t m_interval = 0, m_tolerance = 0;
+	std::unique_ptr<Slot []> m_slots;
+	size_t m_mask = 0;
+};
+}
+
+
+
+#endif //__FV_LIMITER_HPP__
@@ -0,0 +1,224 @@
+#ifndef __FV_LISTENERS_HPP__
+#define __FV_LISTENERS_HPP__
+
+
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
+#include "common.hpp"
+
+
+
+namespace fv {
+// Listening sockets that outlive a process. TcpServer and SslServer open their port through
+// Open, which takes an inherited socket bound to that port before binding a new one, so a
+// server started by systemd socket activation, with FV_LISTEN_FDS, or after FetchHandoff
+// keeps the kernel accept queue of the previous process and no connection is refused.
+//
+// A zero-downtime upgrade: the running process waits in ServeHandoff, the new binary calls
+// FetchHandoff before Run, and the old one drains with Tasks::StopGracefully once its
+// sockets were handed over. Not available on Windows, where Open always binds.
+struct Listeners {
+	static std::shared_ptr<Tcp::acceptor> Open (asio::any_io_executor _executor, Tcp::endpoint _ep) {
+		std::shared_ptr<Tcp::acceptor> _acceptor;
+		int _fd = _take (_ep);
+		if (_fd >= 0) {
+			_acceptor = std::make_shared<Tcp::acceptor> (_executor);
+			_acceptor->assign (_family (_fd) == AF_INET6 ? Tcp::v6 () : Tcp::v4 (), _fd);
+		} else {
+			_acceptor = std::make_shared<Tcp::acceptor> (_executor, _ep, true);
+		}
+		std::unique_lock _ul { m_mtx };
+		std::erase_if (m_active, [] (auto &_weak) { return _weak.expired (); });
+		m_active.push_back (_acceptor);
+		return _acceptor;
+	}
+
+	// Adds sockets received some other way; Open matches them by their bound address and port
+	static void Adopt (std::vector<int> _fds) {
+		std::unique_lock _ul { m_mtx };
+		_load_env ();
+		m_inherited.insert (m_inherited.end (), _fds.begin (), _fds.end ());
+	}
+
+	// Serves one FetchHandoff on the unix socket `_path` with every listening socket of
+	// this process and returns how many were sent. They stay open here until the servers
+	// stop, both processes accept from the same queue meanwhile.
+	static Task<size_t> ServeHandoff (std::string _path) {
+#ifdef _WIN32
+		throw Exception ("Listener handoff is not supported on Windows");
+		co_return 0;
+#else
+		::unlink (_path.c_str ());
+		asio::local::stream_protocol::acceptor _unix_acceptor { co_await asio::this_coro::executor, asio::local::stream_protocol::endpoint { _path } };
+		auto _peer = co_await _unix_acceptor.async_accept (UseAwaitable);
+		_unix_acceptor.close ();
+		::unlink (_path.c_str ());
+		std::vector<int> _fds;
+		{
+			std::unique_lock _ul { m_mtx };
+			for (auto &_weak : m_active) {
+				if (auto _acceptor = _weak.lock (); _acceptor && _acceptor->is_open ())
+					_fds.push_back ((int) _acceptor->native_handle ());
+			}
+		}
+		uint32_t _count = (uint32_t) _fds.size ();
+		std::vector<char> _control (CMSG_SPACE (sizeof (int) * std::max<size_t> (_fds.size (), 1)));
+		iovec _iov { &_count, sizeof (_count) };
+		msghdr _msg {};
+		_msg.msg_iov = &_iov;
+		_msg.msg_iovlen = 1;
+		if (!_fds.empty ()) {
+			_msg.msg_control = _control.data ();
+			_msg.msg_controllen = CMSG_SPACE (sizeof (int) * _fds.size ());
+			cmsghdr *_cmsg = CMSG_FIRSTHDR (&_msg);
+			_cmsg->cmsg_level = SOL_SOCKET;
+			_cmsg->cmsg_type = SCM_RIGHTS;
+			_cmsg->cmsg_len = CMSG_LEN (sizeof (int) * _fds.size ());
+			::memcpy (CMSG_DATA (_cmsg), _fds.data (), sizeof (int) * _fds.size ());
+		}
+		co_await _peer.async_wait (asio::local::stream_protocol::socket::wait_write, UseAwaitable);
+		if (::sendmsg (_peer.native_handle (), &_msg, 0) != (ssize_t) sizeof (_count))
+			throw Exception ("Send listening sockets failed");
+		co_return _fds.size ();
+#endif
+	}
+
+	// Receives the listening sockets of the process serving `_path`, returns how many.
+	// Throws when nobody serves it or it sent more than MaxHandoff.
+	static Task<size_t> FetchHandoff (std::string _path) {
+#ifdef _WIN32
+		throw Exception ("Listener handoff is not supported on Windows");
+		co_return 0;
+#else
+		asio::local::stream_protocol::socket _sock { co_await asio::this_coro::executor };
+		co_await _sock.async_connect (asio::local::stream_protocol::endpoint { _path }, UseAwaitable);
+		co_await _sock.async_wait (asio::local::stream_protocol::socket::wait_read, UseAwaitable);
+		uint32_t _count = 0;
+		std::vector<char> _control (CMSG_SPACE (sizeof (int) * MaxHandoff));
+		iovec _iov { &_count, sizeof (_count) };
+		msghdr _msg {};
+		_msg.msg_iov = &_iov;
+		_msg.msg_iovlen = 1;
+		_msg.msg_control = _control.data ();
+		_msg.msg_controllen = _control.size ();
+		if (::recvmsg (_sock.native_handle (), &_msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof (_count))
+			throw Exception ("Receive listening sockets failed");
+		std::vector<int> _fds;
+		for (cmsghdr *_cmsg = CMSG_FIRSTHDR (&_msg); _cmsg; _cmsg = CMSG_NXTHDR (&_msg, _cmsg)) {
+			if (_cmsg->cmsg_level != SOL_SOCKET || _cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t _n = (_cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			size_t _at = _fds.size ();
+			_fds.resize (_at + _n);
+			::memcpy (&_fds [_at], CMSG_DATA (_cmsg), sizeof (int) * _n);
+		}
+		// the kernel dropped the sockets that did not fit, the rest would leave ports unserved
+		if (_msg.msg_flags & MSG_CTRUNC) {
+			for (int _fd : _fds)
+				::close (_fd);
+			throw Exception ("Too many listening sockets to receive");
+		}
+		Adopt (_fds);
+		co_return _fds.size ();
+#endif
+	}
+
+private:
+	static constexpr size_t MaxHandoff = 64;
+
+	// Inherited socket bound to `_ep`, -1 when there is none. 0.0.0.0 and :: both stand
+	// for every interface, so either matches an unspecified address.
+	static int _take (const Tcp::endpoint &_ep) {
+#ifdef _WIN32
+		return -1;
+#else
+		std::unique_lock _ul { m_mtx };
+		_load_env ();
+		for (auto _it = m_inherited.begin (); _it != m_inherited.end (); ++_it) {
+			sockaddr_storage _addr {};
+			socklen_t _len = sizeof (_addr);
+			int _listening = 0;
+			socklen_t _opt_len = sizeof (_listening);
+			if (::getsockname (*_it, (sockaddr *) &_addr, &_len) != 0 || ::getsockopt (*_it, SOL_SOCKET, SO_ACCEPTCONN, &_listening, &_opt_len) != 0 || !_listening)
+				continue;
+			if (_addr.ss_family != AF_INET && _addr.ss_family != AF_INET6)
+				continue;
+			Tcp::endpoint _bound {};
+			::memcpy (_bound.data (), &_addr, _len);
+			if (_bound.port () == _ep.port () && _same_address (_bound.address (), _ep.address ())) {
+				int _fd = *_it;
+				m_inherited.erase (_it);
+				return _fd;
+			}
+		}
+		return -1;
+#endif
+	}
+
+	static bool _same_address (asio::ip::address _a, asio::ip::address _b) {
+		if (_a.is_unspecified () && _b.is_unspecified ())
+			return true;
+		auto _unmap = [] (asio::ip::address _addr) {
+			return _addr.is_v6 () && _addr.to_v6 ().is_v4_mapped () ? asio::ip::address { asio::ip::make_address_v4 (asio::ip::v4_mapped, _addr.to_v6 ()) } : _addr;
+		};
+		return _unmap (_a) == _unmap (_b);
+	}
+
+	static int _family (int _fd) {
+#ifdef _WIN32
+		return AF_INET;
+#else
+		sockaddr_storage _addr {};
+		socklen_t _len = sizeof (_addr);
+		::getsockname (_fd, (sockaddr *) &_addr, &_len);
+		return _addr.ss_family;
+#endif
+	}
+
+	// systemd passes LISTEN_FDS sockets from fd 3 on, for the process in LISTEN_PID;
+	// FV_LISTEN_FDS is a comma separated fd list for other supervisors
+	static void _load_env () {
+#ifndef _WIN32
+		if (m_env_loaded)
+			return;
+		m_env_loaded = true;
+		const char *_pid = std::getenv ("LISTEN_PID"), *_n = std::getenv ("LISTEN_FDS");
+		if (_pid && _n && std::atoi (_pid) == (int) ::getpid ()) {
+			for (int i = 0; i < std::atoi (_n); ++i)
+				m_inherited.push_back (3 + i);
+		}
+		if (const char *_list = std::getenv ("FV_LISTEN_FDS")) {
+			for (std::string_view _rest = _list; !_rest.empty ();) {
+				size_t _p = _rest.find (',');
+				int _fd = std::atoi (std::string (_rest.substr (0, _p)).c_str ());
+				if (_fd > 0)
+					m_inherited.push_back (_fd);
+				_rest = _p == std::string_view::npos ? std::string_view {} : _rest.substr (_p + 1);
+			}
+		}
+#endif
+	}
+
+	inline static std::mutex m_mtx;
+	inline static bool m_env_loaded = false;
+	inline static std::vector<int> m_inherited;
+	inline static std::vector<std::weak_ptr<Tcp::acceptor>> m_active;
+};
+}
+
+
+
+#endif //__FV_LISTENERS_HPP__
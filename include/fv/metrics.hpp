@@ -0,0 +1,188 @@
+#ifndef __FV_METRICS_HPP__
+#define __FV_METRICS_HPP__
+
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "declare.hpp"
+
+
+
+namespace fv {
+struct Request;
+struct Response;
+
+static constexpr size_t MetricsShards = 16;
+
+// Threads are spread over the shards round robin on their first use
+inline size_t _metrics_shard () {
+	static std::atomic_size_t s_next { 0 };
+	thread_local size_t t_shard = s_next.fetch_add (1, std::memory_order_relaxed) % MetricsShards;
+	return t_shard;
+}
+
+
+
+// Counter split into per-thread shards, so hot paths never write a shared cache line.
+// Reads sum the shards and are only eventually consistent.
+template<typename T>
+class ShardedValue {
+public:
+	void Add (T _n = 1) { m_shards [_metrics_shard ()].Value.fetch_add (_n, std::memory_order_relaxed); }
+	T Get () const {
+		T _sum = 0;
+		for (auto &_shard : m_shards)
+			_sum += _shard.Value.load (std::memory_order_relaxed);
+		return _sum;
+	}
+
+private:
+	struct alignas (64) Shard { std::atomic<T> Value { 0 }; };
+	std::array<Shard, MetricsShards> m_shards;
+};
+using Counter = ShardedValue<uint64_t>;
+using Gauge = ShardedValue<int64_t>;
+
+
+
+struct HistogramSnapshot {
+	uint64_t Count = 0;
+	std::chrono::nanoseconds Sum {};
+	std::vector<uint64_t> Buckets;
+
+	std::chrono::nanoseconds Quantile (double _q) const;
+	std::chrono::nanoseconds Mean () const { return Count > 0 ? Sum / (int64_t) Count : std::chrono::nanoseconds {}; }
+};
+
+// Log-linear latency histogram in the style of HdrHistogram: every power of two of
+// nanoseconds is split into 8 buckets, so quantiles are within 1/16 of the true value.
+class Histogram {
+public:
+	static constexpr size_t SubBuckets = 8, BucketCount = (64 - 2) * SubBuckets;
+
+	Histogram (): m_shards (std::make_unique<std::array<Shard, MetricsShards>> ()) {}
+
+	void Record (std::chrono::nanoseconds _elapse) {
+		uint64_t _ns = (uint64_t) std::max<int64_t> (_elapse.count (), 0);
+		auto &_shard = (*m_shards) [_metrics_shard ()];
+		_shard.Counts [BucketOf (_ns)].fetch_add (1, std::memory_order_relaxed);
+		_shard.Sum.fetch_add (_ns, std::memory_order_relaxed);
+	}
+
+	HistogramSnapshot Snapshot () const {
+		HistogramSnapshot _ret {};
+		_ret.Buckets.resize (BucketCount);
+		uint64_t _sum = 0;
+		for (auto &_shard : *m_shards) {
+			for (size_t i = 0; i < BucketCount; ++i)
+				_ret.Buckets [i] += _shard.Counts [i].load (std::memory_order_relaxed);
+			_sum += _shard.Sum.load (std::memory_order_relaxed);
+		}
+		for (uint64_t _n : _ret.Buckets)
+			_ret.Count += _n;
+		_ret.Sum = std::chrono::nanoseconds ((int64_t) _sum);
+		return _ret;
+	}
+
+	static size_t BucketOf (uint64_t _ns) {
+		if (_ns < SubBuckets)
+			return (size_t) _ns;
+		size_t _exp = (size_t) std::bit_width (_ns) - 1;
+		return (_exp - 2) * SubBuckets + (size_t) ((_ns >> (_exp - 3)) & (SubBuckets - 1));
+	}
+	static uint64_t BucketLower (size_t _index) {
+		if (_index < SubBuckets)
+			return _index;
+		size_t _exp = _index / SubBuckets + 2;
+		return (SubBuckets + _index % SubBuckets) << (_exp - 3);
+	}
+	static uint64_t BucketWidth (size_t _index) { return _index < SubBuckets ? 1 : 1ull << (_index / SubBuckets - 1); }
+
+private:
+	struct alignas (64) Shard {
+		std::array<std::atomic_uint64_t, BucketCount> Counts {};
+		std::atomic_uint64_t Sum { 0 };
+	};
+	std::unique_ptr<std::array<Shard, MetricsShards>> m_shards;
+};
+
+inline std::chrono::nanoseconds HistogramSnapshot::Quantile (double _q) const {
+	if (Count == 0)
+		return {};
+	uint64_t _rank = std::min<uint64_t> ((uint64_t) (_q * Count), Count - 1), _seen = 0;
+	for (size_t i = 0; i < Buckets.size (); ++i) {
+		_seen += Buckets [i];
+		if (_seen > _rank)
+			return std::chrono::nanoseconds ((int64_t) (Histogram::BucketLower (i) + Histogram::BucketWidth (i) / 2));
+	}
+	return {};
+}
+
+
+
+// Load of one IoCtxPool context: coroutines started by Tasks::RunAsync that have not
+// finished yet, and how long the last probe waited in its queue
+struct alignas (64) ContextLoad {
+	std::atomic_int64_t ActiveTasks { 0 }, LagNs { 0 };
+};
+
+struct ContextStats {
+	size_t Index = 0;
+	int64_t ActiveTasks = 0;
+	std::chrono::nanoseconds LoopLag {};
+};
+
+struct MetricsSnapshot {
+	// server
+	uint64_t AcceptedConnections = 0, TlsHandshakeFailures = 0, HttpRequests = 0, HttpServerErrors = 0, ShedRequests = 0, RateLimitedRequests = 0;
+	int64_t ActiveConnections = 0;
+	HistogramSnapshot HandlerLatency;
+	uint64_t DrainClosedConnections = 0, DrainForcedConnections = 0;
+	int64_t DrainingServers = 0;
+	// client
+	uint64_t ClientRequests = 0, ClientErrors = 0, SessionPoolHits = 0, SessionPoolMisses = 0;
+	size_t IdleSessions = 0;
+	HistogramSnapshot ClientLatency;
+	// every connection
+	uint64_t BytesIn = 0, BytesOut = 0, WsMessagesIn = 0, WsMessagesOut = 0;
+	int64_t ActiveWebsockets = 0;
+	uint64_t WsPongTimeouts = 0, WsIdleTimeouts = 0;
+	std::vector<ContextStats> Contexts;
+};
+
+// Process wide registry the library feeds on its hot paths
+struct Metrics {
+	inline static Counter AcceptedConnections, TlsHandshakeFailures, HttpRequests, HttpServerErrors, ShedRequests, RateLimitedRequests;
+	inline static Gauge ActiveConnections;
+	inline static Histogram HandlerLatency;
+	// Graceful shutdown: connections closed cleanly, cancelled at the deadline, and servers draining
+	inline static Counter DrainClosedConnections, DrainForcedConnections;
+	inline static Gauge DrainingServers;
+	inline static Counter ClientRequests, ClientErrors, SessionPoolHits, SessionPoolMisses;
+	inline static Histogram ClientLatency;
+	inline static Counter BytesIn, BytesOut, WsMessagesIn, WsMessagesOut;
+	inline static Gauge ActiveWebsockets;
+	// Websockets closed by keepalive: missing pong, no message within WebsocketIdleTimeout
+	inline static Counter WsPongTimeouts, WsIdleTimeouts;
+	// How often every context is probed for queueing delay
+	inline static std::chrono::nanoseconds ProbeInterval = std::chrono::seconds (1);
+
+	static MetricsSnapshot Snapshot ();
+	// Prometheus text exposition format 0.0.4
+	static std::string ToPrometheus ();
+	// Mount with `_server.SetHttpHandler ("/metrics", fv::Metrics::PrometheusHandler)`
+	static Task<Response> PrometheusHandler (Request &_req);
+};
+}
+
+
+
+#endif //__FV_METRICS_HPP__
@@ -0,0 +1,109 @@
+#ifndef __FV_METRICS_IMPL_HPP__
+#define __FV_METRICS_IMPL_HPP__
+
+
+
+#include <string>
+
+#include <fmt/core.h>
+
+#include "common.hpp"
+#include "metrics.hpp"
+#include "req_res.hpp"
+#include "session.hpp"
+
+
+
+namespace fv {
+inline MetricsSnapshot Metrics::Snapshot () {
+	MetricsSnapshot _ret {};
+	_ret.AcceptedConnections = AcceptedConnections.Get ();
+	_ret.TlsHandshakeFailures = TlsHandshakeFailures.Get ();
+	_ret.HttpRequests = HttpRequests.Get ();
+	_ret.HttpServerErrors = HttpServerErrors.Get ();
+	_ret.ShedRequests = ShedRequests.Get ();
+	_ret.RateLimitedRequests = RateLimitedRequests.Get ();
+	_ret.ActiveConnections = ActiveConnections.Get ();
+	_ret.HandlerLatency = HandlerLatency.Snapshot ();
+	_ret.DrainClosedConnections = DrainClosedConnections.Get ();
+	_ret.DrainForcedConnections = DrainForcedConnections.Get ();
+	_ret.DrainingServers = DrainingServers.Get ();
+	_ret.ClientRequests = ClientRequests.Get ();
+	_ret.ClientErrors = ClientErrors.Get ();
+	_ret.SessionPoolHits = SessionPoolHits.Get ();
+	_ret.SessionPoolMisses = SessionPoolMisses.Get ();
+	{
+		std::unique_lock _ul { SessionPool::m_mtx };
+		for (auto &[_key, _sessions] : SessionPool::m_pool)
+			_ret.IdleSessions += _sessions.size ();
+	}
+	_ret.ClientLatency = ClientLatency.Snapshot ();
+	_ret.BytesIn = BytesIn.Get ();
+	_ret.BytesOut = BytesOut.Get ();
+	_ret.WsMessagesIn = WsMessagesIn.Get ();
+	_ret.WsMessagesOut = WsMessagesOut.Get ();
+	_ret.ActiveWebsockets = ActiveWebsockets.Get ();
+	_ret.WsPongTimeouts = WsPongTimeouts.Get ();
+	_ret.WsIdleTimeouts = WsIdleTimeouts.Get ();
+	for (size_t i = 0; i < Tasks::GetContextCount (); ++i) {
+		auto &_load = Tasks::GetContextLoad (i);
+		_ret.Contexts.push_back (ContextStats { i, _load.ActiveTasks.load (), std::chrono::nanoseconds (_load.LagNs.load ()) });
+	}
+	return _ret;
+}
+
+inline std::string Metrics::ToPrometheus () {
+	MetricsSnapshot _s = Snapshot ();
+	std::string _out;
+	auto _metric = [&_out] (std::string_view _name, std::string_view _type, std::string_view _help, auto _value) {
+		fmt::format_to (std::back_inserter (_out), "# HELP {0} {1}\n# TYPE {0} {2}\n{0} {3}\n", _name, _help, _type, _value);
+	};
+	auto _summary = [&_out] (std::string_view _name, std::string_view _help, const HistogramSnapshot &_h) {
+		fmt::format_to (std::back_inserter (_out), "# HELP {0} {1}\n# TYPE {0} summary\n", _name, _help);
+		for (double _q : { 0.5, 0.9, 0.99, 0.999 })
+			fmt::format_to (std::back_inserter (_out), "{}{{quantile=\"{}\"}} {:.9f}\n", _name, _q, _h.Quantile (_q).count () / 1e9);
+		fmt::format_to (std::back_inserter (_out), "{0}_sum {1:.9f}\n{0}_count {2}\n", _name, _h.Sum.count () / 1e9, _h.Count);
+	};
+	_metric ("fv_accepted_connections_total", "counter", "Accepted TCP and TLS connections.", _s.AcceptedConnections);
+	_metric ("fv_tls_handshake_failures_total", "counter", "Failed server TLS handshakes.", _s.TlsHandshakeFailures);
+	_metric ("fv_active_connections", "gauge", "Open server connections.", _s.ActiveConnections);
+	_metric ("fv_http_requests_total", "counter", "HTTP requests answered by the server.", _s.HttpRequests);
+	_metric ("fv_http_server_errors_total", "counter", "HTTP responses with status 5xx.", _s.HttpServerErrors);
+	_metric ("fv_http_shed_requests_total", "counter", "Requests refused with 503 by the adaptive concurrency limit.", _s.ShedRequests);
+	_metric ("fv_http_rate_limited_requests_total", "counter", "Requests refused with 429 by a rate limit rule.", _s.RateLimitedRequests);
+	_summary ("fv_http_handler_seconds", "Time from parsed request to serialized response.", _s.HandlerLatency);
+	_metric ("fv_drain_closed_connections_total", "counter", "Connections closed cleanly while a server drained.", _s.DrainClosedConnections);
+	_metric ("fv_drain_forced_connections_total", "counter", "Connections cancelled at the drain deadline.", _s.DrainForcedConnections);
+	_metric ("fv_draining_servers", "gauge", "Servers currently draining.", _s.DrainingServers);
+	_metric ("fv_client_requests_total", "counter", "Requests sent by Session.", _s.ClientRequests);
+	_metric ("fv_client_errors_total", "counter", "Session requests that failed with an exception.", _s.ClientErrors);
+	_metric ("fv_session_pool_hits_total", "counter", "Pooled sessions reused.", _s.SessionPoolHits);
+	_metric ("fv_session_pool_misses_total", "counter", "Session pool lookups without an idle session.", _s.SessionPoolMisses);
+	_metric ("fv_session_pool_idle", "gauge", "Idle sessions in the pool.", _s.IdleSessions);
+	_summary ("fv_client_request_seconds", "Session request latency, retries included.", _s.ClientLatency);
+	_metric ("fv_bytes_received_total", "counter", "Bytes received on every connection.", _s.BytesIn);
+	_metric ("fv_bytes_sent_total", "counter", "Bytes sent on every connection.", _s.BytesOut);
+	_metric ("fv_websocket_messages_received_total", "counter", "Websocket messages received.", _s.WsMessagesIn);
+	_metric ("fv_websocket_messages_sent_total", "counter", "Websocket frames sent.", _s.WsMessagesOut);
+	_metric ("fv_active_websockets", "gauge", "Open websocket connections.", _s.ActiveWebsockets);
+	_metric ("fv_websocket_pong_timeouts_total", "counter", "Websockets closed for a missing pong.", _s.WsPongTimeouts);
+	_metric ("fv_websocket_idle_timeouts_total", "counter", "Websockets closed without a message within the idle timeout.", _s.WsIdleTimeouts);
+	_out += "# HELP fv_context_active_tasks Unfinished Tasks::RunAsync tasks per io context.\n# TYPE fv_context_active_tasks gauge\n";
+	for (auto &_ctx : _s.Contexts)
+		fmt::format_to (std::back_inserter (_out), "fv_context_active_tasks{{context=\"{}\"}} {}\n", _ctx.Index, _ctx.ActiveTasks);
+	_out += "# HELP fv_context_lag_seconds Queueing delay of the last probe per io context.\n# TYPE fv_context_lag_seconds gauge\n";
+	for (auto &_ctx : _s.Contexts)
+		fmt::format_to (std::back_inserter (_out), "fv_context_lag_seconds{{context=\"{}\"}} {:.9f}\n", _ctx.Index, _ctx.LoopLag.count () / 1e9);
+	return _out;
+}
+
+inline Task<Response> Metrics::PrometheusHandler (Request &) {
+	Response _res = Response::FromText (ToPrometheus ());
+	_res.Headers ["Content-Type"] = "text/plain; version=0.0.4; charset=utf-8";
+	co_return _res;
+}
+}
+
+
+
+#endif //__FV_METRICS_IMPL_HPP__
@@ -0,0 +1,214 @@
+#ifndef __FV_MICROCACHE_HPP__
+#define __FV_MICROCACHE_HPP__
+
+
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "common_funcs.hpp"
+#include "req_res.hpp"
+
+
+
+namespace fv {
+// Server side cache of fully serialized GET responses. A handler opts in by answering with
+// `Cache-Control: s-maxage=N`, optionally with `stale-while-revalidate=M`; responses that
+// also carry `no-store`, `private` or `Set-Cookie` are never stored. Entries are keyed by
+// path, query and the configured request headers, and are kept both plain and gzipped.
+// Concurrent misses of a key run the handler once, and a stale entry is served while one
+// request refreshes it in the background. A key whose response could not be stored is
+// marked as pass for PassTime, its requests then run the handler without waiting for
+// each other.
+class MicroCache: public std::enable_shared_from_this<MicroCache> {
+public:
+	MicroCache (size_t _max_bytes, std::vector<std::string> _vary_headers, bool _gzip): m_max_bytes (_max_bytes), m_vary_headers (std::move (_vary_headers)), m_gzip (_gzip) {}
+
+	static bool Accepts (Request &_req) { return _req.Method == MethodType::Get && !_req.IsWebsocket (); }
+
+	// Serialized answer to `_req`, from the cache or from `_handler`
+	Task<std::shared_ptr<const std::string>> Get (Request &_req, std::function<Task<Response> (Request &)> _handler) {
+		std::string _key = _make_key (_req);
+		bool _gzip = m_gzip && _to_lower (_req.Headers ["Accept-Encoding"]).find ("gzip") != std::string::npos;
+		bool _waited = false;
+		while (true) {
+			std::unique_lock _ul { m_mtx };
+			auto _now = std::chrono::steady_clock::now ();
+			auto _it = m_items.find (_key);
+			if (_it != m_items.end ()) {
+				auto _entry = _it->second.Item;
+				if (_now < _entry->StaleUntil) {
+					m_lru.splice (m_lru.begin (), m_lru, _it->second.LruIt);
+					if (_now >= _entry->Expire && !m_flights.contains (_key)) {
+						m_flights [_key] = std::make_shared<AsyncEvent> ();
+						Tasks::RunAsync ([_self = shared_from_this (), _key, _handler, _req = Request { _req }] () mutable -> Task<void> {
+							co_await _self->_Fill (_key, _req, _handler);
+						});
+					}
+					co_return _gzip && _entry->Gzip ? _entry->Gzip : _entry->Plain;
+				}
+			}
+
+			auto _pass = m_passes.find (_key);
+			bool _passing = _pass != m_passes.end () && _now < _pass->second;
+			auto _flight = m_flights.find (_key);
+			if (_flight != m_flights.end () && !_waited && !_passing) {
+				auto _done = _flight->second;
+				_ul.unlock ();
+				co_await _done->Wait ();
+				_waited = true;
+				continue;
+			}
+			bool _lead = _flight == m_flights.end () && !_passing;
+			if (_lead)
+				m_flights [_key] = std::make_shared<AsyncEvent> ();
+			_ul.unlock ();
+
+			if (!_lead) {
+				Response _res = co_await _handler (_req);
+				co_return std::make_shared<const std::string> (_res.Serilize ());
+			}
+			auto _entry = co_await _Fill (_key, _req, _handler);
+			co_return _gzip && _entry->Gzip ? _entry->Gzip : _entry->Plain;
+		}
+	}
+
+	void Remove (const std::string &_key) {
+		std::unique_lock _ul { m_mtx };
+		_erase (_key);
+	}
+
+	void Clear () {
+		std::unique_lock _ul { m_mtx };
+		m_items.clear ();
+		m_lru.clear ();
+		m_bytes = 0;
+		m_passes.clear ();
+	}
+
+private:
+	struct Entry {
+		std::shared_ptr<const std::string> Plain, Gzip;
+		std::chrono::steady_clock::time_point Expire, StaleUntil;
+		size_t Bytes = 0;
+	};
+
+	struct Node {
+		std::shared_ptr<Entry> Item;
+		std::list<std::string>::iterator LruIt;
+	};
+
+	// Runs the handler for a key this caller owns the flight of, and stores what may be stored
+	Task<std::shared_ptr<Entry>> _Fill (std::string _key, Request &_req, std::function<Task<Response> (Request &)> &_handler) {
+		auto _entry = std::make_shared<Entry> ();
+		try {
+			Response _res = co_await _handler (_req);
+			std::optional<int64_t> _ttl, _stale;
+			bool _storable = _res.HttpCode >= 200 && _res.HttpCode < 500 && _res.HttpCode != 206 && _res.HttpCode != 304 && !_res.Headers.contains ("Set-Cookie");
+			std::string _cc = _to_lower (_res.Headers ["Cache-Control"]);
+			KvView { _cc, ',' }.ForEach ([&] (std::string_view _k, std::string_view _v) {
+				if (_k == "no-store" || _k == "private") {
+					_storable = false;
+				} else if (_k == "s-maxage") {
+					_ttl = std::atoll (std::string (_v).c_str ());
+				} else if (_k == "stale-while-revalidate") {
+					_stale = std::atoll (std::string (_v).c_str ());
+				}
+				return true;
+			});
+			_storable = _storable && _ttl.value_or (0) > 0;
+
+			bool _compress = _storable && m_gzip && _res.Content.size () >= GzipMinSize && !_res.Headers.contains ("Content-Encoding");
+			if (_compress)
+				_res.Headers ["Vary"] = _res.Headers.contains ("Vary") ? fmt::format ("{}, Accept-Encoding", _res.Headers ["Vary"]) : "Accept-Encoding";
+			_entry->Plain = std::make_shared<const std::string> (_res.Serilize ());
+			if (_compress) {
+				_res.Headers ["Content-Encoding"] = "gzip";
+				_entry->Gzip = std::make_shared<const std::string> (_res.Serilize ());
+			}
+
+			auto _now = std::chrono::steady_clock::now ();
+			_entry->Expire = _now + std::chrono::seconds (_ttl.value_or (0));
+			_entry->StaleUntil = _entry->Expire + std::chrono::seconds (_stale.value_or (0));
+			_entry->Bytes = _entry->Plain->size () + (_entry->Gzip ? _entry->Gzip->size () : 0) + _key.size ();
+			std::unique_lock _ul { m_mtx };
+			_storable = _storable && _entry->Bytes <= m_max_bytes;
+			if (_storable) {
+				m_passes.erase (_key);
+				_erase (_key);
+				m_lru.push_front (_key);
+				m_bytes += _entry->Bytes;
+				m_items [_key] = Node { _entry, m_lru.begin () };
+				while (m_bytes > m_max_bytes)
+					_erase (m_lru.back ());
+			} else {
+				if (m_passes.size () >= MaxPasses)
+					std::erase_if (m_passes, [_now] (auto &_kv) { return _kv.second <= _now; });
+				if (m_passes.size () < MaxPasses)
+					m_passes [_key] = _now + PassTime;
+			}
+		} catch (...) {
+			_Land (_key);
+			throw;
+		}
+		_Land (_key);
+		co_return _entry;
+	}
+
+	void _Land (const std::string &_key) {
+		std::unique_lock _ul { m_mtx };
+		auto _it = m_flights.find (_key);
+		if (_it == m_flights.end ())
+			return;
+		auto _done = _it->second;
+		m_flights.erase (_it);
+		_ul.unlock ();
+		_done->Set ();
+	}
+
+	std::string _make_key (Request &_req) {
+		std::string _key = _req.UrlPath;
+		for (auto &_name : m_vary_headers) {
+			auto _it = _req.Headers.find (_name);
+			_key += '\n';
+			if (_it != _req.Headers.end ())
+				_key += _it->second;
+		}
+		return _key;
+	}
+
+	// caller holds m_mtx
+	void _erase (const std::string &_key) {
+		auto _it = m_items.find (_key);
+		if (_it == m_items.end ())
+			return;
+		m_bytes -= _it->second.Item->Bytes;
+		m_lru.erase (_it->second.LruIt);
+		m_items.erase (_it);
+	}
+
+	static constexpr size_t GzipMinSize = 1024, MaxPasses = 65536;
+	static constexpr std::chrono::seconds PassTime { 10 };
+
+	std::mutex m_mtx;
+	size_t m_max_bytes = 0, m_bytes = 0;
+	std::vector<std::string> m_vary_headers;
+	bool m_gzip = true;
+	std::list<std::string> m_lru;
+	std::unordered_map<std::string, Node> m_items;
+	std::unordered_map<std::string, std::shared_ptr<AsyncEvent>> m_flights;
+	// keys whose last response was not storable, until when they skip request collapsing
+	std::unordered_map<std::string, std::chrono::steady_clock::time_point> m_passes;
+};
+}
+
+
+
+#endif //__FV_MICROCACHE_HPP__
@@ -5,13 +5,17 @@
 
 #include <chrono>
 #include <memory>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
 #include "common.hpp"
 #include "structs.hpp"
+#include "router.hpp"
 
 
 
@@ -22,10 +26,14 @@ struct WsConn;
 
 struct Request {
 	Request () {}
-	Request (std::string _url, MethodType _method): Url (_url), Method (_method) {}
+	Request (std::string _url, MethodType _method): Trace (Tracing::Current ()), Url (_url), Method (_method) {}
 
 	TimeSpan Timeout = std::chrono::seconds (0);
 	std::string Server = "";
+	RetryPolicy Retry = Config::Retry;
+	// Server side the span of this request, client side the parent of the request span;
+	// a new request starts out with the trace of the handler that creates it
+	TraceContext Trace {};
 	//
 	std::string Url = "";
 	MethodType Method = MethodType::Get;
@@ -36,21 +44,53 @@ struct Request {
 	std::vector<std::variant<body_kv, body_file>> ContentItems;
 	CaseInsensitiveMap Headers = DefaultHeaders ();
 	std::unordered_map<std::string, std::string> Cookies;
-
-	static Task<Request> GetFromConn (std::shared_ptr<IConn2> _conn, uint16_t _listen_port);
-	static CaseInsensitiveMap DefaultHeaders () { return m_def_headers; }
-	static void SetDefaultHeader (std::string _key, std::string _value) { m_def_headers [_key] = _value; }
+	RouteParams Params;
+
+	// Throws HttpException 431 or 413 past the limits, 0 disables a limit
+	// `_on_body_chunk` runs before each read of up to 64KB of the body
+	static Task<Request> GetFromConn (std::shared_ptr<IConn2> _conn, uint16_t _listen_port, size_t _max_header_bytes = 0, size_t _max_body_bytes = 0, std::function<void ()> _on_body_chunk = nullptr);
+	// Default headers may be changed while other threads build requests
+	static CaseInsensitiveMap DefaultHeaders () {
+		std::shared_lock _sl { m_def_mtx };
+		return m_def_headers;
+	}
+	static void SetDefaultHeader (std::string _key, std::string _value) {
+		std::unique_lock _ul { m_def_mtx };
+		m_def_headers [_key] = _value;
+	}
+	// Returns the removed value, nullopt when the header was not set
+	static std::optional<std::string> RemoveDefaultHeader (std::string _key) {
+		std::unique_lock _ul { m_def_mtx };
+		auto _it = m_def_headers.find (_key);
+		if (_it == m_def_headers.end ())
+			return std::nullopt;
+		std::string _value = std::move (_it->second);
+		m_def_headers.erase (_it);
+		return _value;
+	}
 
 	std::string Serilize (std::string _host, std::string _port, std::string _path);
 	bool IsWebsocket ();
 	Task<std::shared_ptr<WsConn>> UpgradeWebsocket ();
 	bool IsUpgraded () { return Upgrade; }
+	std::string_view GetPath () const { return std::string_view { UrlPath }.substr (0, UrlPath.find ('?')); }
+	std::string_view GetParam (std::string_view _name) const { return Params.Get (UrlPath, _name).value_or (std::string_view {}); }
+	std::string_view GetQueryString () const;
+	std::optional<std::string_view> GetQuery (std::string_view _name) const { return KvView { GetQueryString (), '&' }.Get (_name); }
+	std::optional<std::string_view> GetForm (std::string_view _name) const;
+	std::optional<std::string_view> GetCookie (std::string_view _name) const;
+	// Server side the peer of the connection, not taking proxies into account
+	asio::ip::address GetRemoteAddress () const;
 
 private:
+	struct _no_default_headers_t {};
+	Request (_no_default_headers_t): Headers {} {}
+
 	bool _content_raw_contains_files ();
 	std::shared_ptr<IConn2> Conn;
 	bool Upgrade = false;
 
+	inline static std::shared_mutex m_def_mtx;
 	inline static CaseInsensitiveMap m_def_headers { { "Accept", "*/*" }, { "Accept-Encoding", "gzip" }, { "Accept-Language", "zh-CN,zh,q=0.9" }, { "Pragma", "no-cache" }, { "Cache-Control", "no-cache" }, { "Connection", "keep-alive" }, { "User-Agent", version } };
 };
 
@@ -66,8 +106,12 @@ struct Response {
 	static Response FromNotFound ();
 	static Response FromText (std::string _text);
 	static Response FromUpgradeWebsocket (Request &_r);
+	// Reason phrase of a status code, "Unknown" when it has none
+	static std::string_view GetStatusText (int _code);
 
 	std::string Serilize ();
+	// Appends to `_out`, so callers can reuse one buffer across responses
+	void SerilizeTo (std::string &_out);
 
 private:
 	static void InitDefaultHeaders (CaseInsensitiveMap &_map);
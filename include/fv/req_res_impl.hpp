@@ -3,6 +3,8 @@
 
 
 
+#include <charconv>
+#include <iterator>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -27,42 +29,69 @@
 
 
 namespace fv {
-inline Task<Request> Request::GetFromConn (std::shared_ptr<IConn2> _conn, uint16_t _listen_port) {
-	std::string _line = co_await _conn->ReadLine ();
+// Content-Length is plain decimal digits; signs, junk and overflow are rejected
+inline bool _parse_length (std::string_view _s, size_t &_val) {
+	auto [_end, _ec] = std::from_chars (_s.data (), _s.data () + _s.size (), _val);
+	return !_s.empty () && _ec == std::errc {} && _end == _s.data () + _s.size ();
+}
+
+inline Task<Request> Request::GetFromConn (std::shared_ptr<IConn2> _conn, uint16_t _listen_port, size_t _max_header_bytes, size_t _max_body_bytes, std::function<void ()> _on_body_chunk) {
+	std::string_view _line;
+	if (!_conn->TryReadLine (_line))
+		_line = co_await _conn->ReadLineView (_max_header_bytes);
+	size_t _header_bytes = _line.size () + 2;
 	size_t _p = _line.find (' ');
-	static std::unordered_map<std::string, MethodType> s_method_vals { { "HEAD", MethodType::Head }, { "OPTION", MethodType::Option }, { "GET", MethodType::Get }, { "POST", MethodType::Post }, { "PUT", MethodType::Put }, { "DELETE", MethodType::Delete } };
-	std::string _tmp = _p != std::string::npos ? _line.substr (0, _p) : "";
-	if (!s_method_vals.contains (_tmp))
+	static std::unordered_map<std::string_view, MethodType> s_method_vals { { "HEAD", MethodType::Head }, { "OPTION", MethodType::Option }, { "GET", MethodType::Get }, { "POST", MethodType::Post }, { "PUT", MethodType::Put }, { "DELETE", MethodType::Delete } };
+	auto _method_it = s_method_vals.find (_p != std::string_view::npos ? _line.substr (0, _p) : std::string_view {});
+	if (_method_it == s_method_vals.end ())
 		throw Exception ("Unrecognized request type");
-	Request _r {};
+	Request _r { _no_default_headers_t {} };
 	_r.Schema = dynamic_cast<SslConn2 *> (_conn.get ()) ? "https" : "http";
-	_r.Method = s_method_vals [_tmp];
-	_line = _line.erase (0, _p + 1);
+	_r.Method = _method_it->second;
+	_line = _line.substr (_p + 1);
 	_p = _line.find (' ');
-	if (_p == std::string::npos)
+	if (_p == std::string_view::npos)
 		throw Exception ("Unrecognized request path");
 	_r.UrlPath = _line.substr (0, _p);
-	while ((_line = co_await _conn->ReadLine ()) != "") {
+	while (true) {
+		if (_max_header_bytes > 0 && _header_bytes >= _max_header_bytes)
+			throw HttpException (431, "Request header too large");
+		if (!_conn->TryReadLine (_line))
+			_line = co_await _conn->ReadLineView (_max_header_bytes > 0 ? _max_header_bytes - _header_bytes : 0);
+		_header_bytes += _line.size () + 2;
+		if (_line == "")
+			break;
 		size_t _p = _line.find (':');
-		std::string _key = _trim (_line.substr (0, _p));
-		std::string _value = _trim (_line.substr (_p + 1));
-		_r.Headers [_key] = _value;
+		if (_p == std::string_view::npos)
+			continue;
+		_r.Headers.insert_or_assign (std::string (_trim_view (_line.substr (0, _p))), std::string (_trim_view (_line.substr (_p + 1))));
 	}
-	_tmp = _to_lower (_r.Headers ["Connection"]);
-	if (_tmp == "upgrade")
+	auto _it = _r.Headers.find ("Connection");
+	if (_it != _r.Headers.end () && _iequals (_it->second, "upgrade"))
 		_r.Schema = _r.Schema == "https" ? "wss" : "ws";
 	std::string _port = "";
 	if (!((_listen_port == 80 && (_r.Schema == "http" || _r.Schema == "ws")) || (_listen_port == 443 && (_r.Schema == "https" || _r.Schema == "wss"))))
 		_port = fmt::format (":{}", _listen_port);
-	std::string _host = _r.Headers ["Host"];
-	if (_host.find (':') != std::string::npos) {
+	_it = _r.Headers.find ("Host");
+	std::string_view _host = _it != _r.Headers.end () ? std::string_view { _it->second } : std::string_view {};
+	if (_host.find (':') != std::string_view::npos) {
 		_r.Url = fmt::format ("{}://{}{}", _r.Schema, _host, _r.UrlPath);
 	} else {
 		_r.Url = fmt::format ("{}://{}{}{}", _r.Schema, _host, _port, _r.UrlPath);
 	}
-	if (_r.Headers.contains ("Content-Length")) {
-		size_t _p = std::stoi (_r.Headers ["Content-Length"]);
-		_r.Content = co_await _conn->ReadCount (_p);
+	_it = _r.Headers.find ("Content-Length");
+	if (_it != _r.Headers.end ()) {
+		size_t _p = 0;
+		if (!_parse_length (_it->second, _p))
+			throw HttpException (400, "Invalid Content-Length");
+		if (_max_body_bytes > 0 && _p > _max_body_bytes)
+			throw HttpException (413, "Request body too large");
+		while (_conn->GetBuffered () < _p) {
+			if (_on_body_chunk)
+				_on_body_chunk ();
+			co_await _conn->Fill (std::min (_p, _conn->GetBuffered () + 64 * 1024));
+		}
+		_r.Content = _conn->Consume (_p);
 	}
 	_r.Conn = _conn;
 	co_return _r;
@@ -156,6 +185,31 @@ inline std::string Request::Serilize (std::string _host, std::string _port, std:
 	return _ss.str ();
 }
 
+inline std::string_view Request::GetQueryString () const {
+	size_t _p = UrlPath.find ('?');
+	if (_p == std::string::npos)
+		return std::string_view {};
+	return std::string_view { UrlPath }.substr (_p + 1);
+}
+
+inline std::optional<std::string_view> Request::GetForm (std::string_view _name) const {
+	auto _it = Headers.find ("Content-Type");
+	if (_it == Headers.end () || !_istarts_with (_it->second, "application/x-www-form-urlencoded"))
+		return std::nullopt;
+	return KvView { Content, '&' }.Get (_name);
+}
+
+inline std::optional<std::string_view> Request::GetCookie (std::string_view _name) const {
+	auto _it = Headers.find ("Cookie");
+	if (_it == Headers.end ())
+		return std::nullopt;
+	return KvView { _it->second, ';' }.Get (_name);
+}
+
+inline asio::ip::address Request::GetRemoteAddress () const {
+	return Conn ? Conn->GetRemoteAddress () : asio::ip::address {};
+}
+
 inline bool Request::IsWebsocket () {
 	return _to_lower (Headers ["Connection"]) == "upgrade" && Headers ["Sec-WebSocket-Version"] == "13" && Headers ["Sec-WebSocket-Key"].size () > 0;
 }
@@ -167,7 +221,11 @@ inline Task<std::shared_ptr<WsConn>> Request::UpgradeWebsocket () {
 	std::string _res_str = _res.Serilize ();
 	co_await Conn->Send (_res_str.data (), _res_str.size ());
 	Upgrade = true;
-	co_return std::make_shared<WsConn> (Conn, false);
+	auto _wsconn = std::make_shared<WsConn> (Conn, false);
+	if (auto _ext = _res.Headers.find ("Sec-WebSocket-Extensions"); _ext != _res.Headers.end ())
+		_wsconn->EnableDeflate (WsDeflateParams::FromResponse (_ext->second).value ());
+	_wsconn->Init ();
+	co_return _wsconn;
 }
 
 inline bool Request::_content_raw_contains_files () {
@@ -200,14 +258,21 @@ inline Task<Response> Response::GetFromConn (std::shared_ptr<IConn> _conn) {
 	}
 	if (_r.HttpCode == 0)
 		throw Exception (fmt::format ("Unrecognized http-protocol header: {}", _line));
-	while ((_line = co_await _conn->ReadLine ()) != "") {
-		size_t _p = _line.find (':');
-		std::string _key = _trim (_line.substr (0, _p));
-		std::string _value = _trim (_line.substr (_p + 1));
-		_r.Headers [_key] = _value;
+	std::string_view _hline;
+	while (true) {
+		if (!_conn->TryReadLine (_hline))
+			_hline = co_await _conn->ReadLineView ();
+		if (_hline == "")
+			break;
+		size_t _p = _hline.find (':');
+		if (_p == std::string_view::npos)
+			continue;
+		_r.Headers.insert_or_assign (std::string (_trim_view (_hline.substr (0, _p))), std::string (_trim_view (_hline.substr (_p + 1))));
 	}
 	if (_r.Headers.contains ("Content-Length")) {
-		size_t _sz = std::stoi (_r.Headers ["Content-Length"]);
+		size_t _sz = 0;
+		if (!_parse_length (_r.Headers ["Content-Length"], _sz))
+			throw Exception ("Invalid Content-Length in response");
 		_r.Content = co_await _conn->ReadCount (_sz);
 	} else if (_r.Headers.contains ("Transfer-Encoding") && _to_lower (_r.Headers ["Transfer-Encoding"]) == "chunked") {
 		_r.Content = "";
@@ -244,6 +309,12 @@ inline Task<Response> Response::GetFromConn (std::shared_ptr<IConn> _conn) {
 	co_return _r;
 }
 
+inline std::string_view Response::GetStatusText (int _code) {
+	static const std::unordered_map<int, std::string_view> s_httpcode { { 100, "Continue" }, { 101, "Switching Protocols" }, { 200, "OK" }, { 201, "Created" }, { 202, "Accepted" }, { 203, "Non-Authoritative Information" }, { 204, "No Content" }, { 205, "Reset Content" }, { 206, "Partial Content" }, { 300, "Multiple Choices" }, { 301, "Moved Permanently" }, { 302, "Found" }, { 303, "See Other" }, { 304, "Not Modified" }, { 305, "Use Proxy" }, { 306, "Unused" }, { 307, "Temporary Redirect" }, { 400, "Bad Request" }, { 401, "Unauthorized" }, { 402, "Payment Required" }, { 403, "Forbidden" }, { 404, "Not Found" }, { 405, "Method Not Allowed" }, { 406, "Not Acceptable" }, { 407, "Proxy Authentication Required" }, { 408, "Request Time-out" }, { 409, "Conflict" }, { 410, "Gone" }, { 411, "Length Required" }, { 412, "Precondition Failed" }, { 413, "Request Entity Too Large" }, { 414, "Request-URI Too Large" }, { 415, "Unsupported Media Type" }, { 416, "Requested range not satisfiable" }, { 417, "Expectation Failed" }, { 429, "Too Many Requests" }, { 431, "Request Header Fields Too Large" }, { 500, "Internal Server Error" }, { 501, "Not Implemented" }, { 502, "Bad Gateway" }, { 503, "Service Unavailable" }, { 504, "Gateway Time-out" }, { 505, "HTTP Version not supported" } };
+	auto _it = s_httpcode.find (_code);
+	return _it != s_httpcode.end () ? _it->second : std::string_view { "Unknown" };
+}
+
 inline Response Response::FromNotFound () {
 	auto _res = Response { .HttpCode = 404, .Content = "404 Not Found" };
 	Response::InitDefaultHeaders (_res.Headers);
@@ -266,29 +337,48 @@ inline Response Response::FromUpgradeWebsocket (Request &_r) {
 	_res.Headers ["Sec-WebSocket-Accept"] = base64_encode (_tmp);
 	_res.Headers ["Connection"] = "Upgrade";
 	_res.Headers ["Upgrade"] = _r.Headers ["Upgrade"];
+	if (auto _ext = _r.Headers.find ("Sec-WebSocket-Extensions"); Config::WebsocketDeflate.Enable && _ext != _r.Headers.end ()) {
+		if (auto _params = WsDeflateParams::Accept (_ext->second, Config::WebsocketDeflate); _params.has_value ())
+			_res.Headers ["Sec-WebSocket-Extensions"] = _params->ToHeader ();
+	}
 	return _res;
 }
 
 inline std::string Response::Serilize () {
-	std::string _cnt = Content;
+	std::string _ret;
+	SerilizeTo (_ret);
+	return _ret;
+}
+
+inline void Response::SerilizeTo (std::string &_out) {
+	std::string _cnt_gzip;
+	std::string_view _cnt = Content;
 	if (_cnt.size () > 0) {
-		std::string _cnt_enc = _to_lower (Headers ["Content-Encoding"]);
-		if (_cnt_enc == "gzip") {
-			_cnt = gzip::compress (_cnt.data (), _cnt.size ());
-		} else if (_cnt_enc != "") {
-			throw Exception (fmt::format ("Unrecognized content encoding type [{}]", _cnt_enc));
+		auto _it = Headers.find ("Content-Encoding");
+		if (_it != Headers.end () && _it->second != "") {
+			if (_to_lower (_it->second) == "gzip") {
+				_cnt_gzip = gzip::compress (Content.data (), Content.size ());
+				_cnt = _cnt_gzip;
+			} else {
+				throw Exception (fmt::format ("Unrecognized content encoding type [{}]", _it->second));
+			}
 		}
 		Headers ["Content-Length"] = fmt::format ("{}", _cnt.size ());
 	}
 
-	std::stringstream _ss;
-	std::unordered_map<int, std::string> s_httpcode { { 100, "Continue" }, { 101, "Switching Protocols" }, { 200, "OK" }, { 201, "Created" }, { 202, "Accepted" }, { 203, "Non-Authoritative Information" }, { 204, "No Content" }, { 205, "Reset Content" }, { 206, "Partial Content" }, { 300, "Multiple Choices" }, { 301, "Moved Permanently" }, { 302, "Found" }, { 303, "See Other" }, { 304, "Not Modified" }, { 305, "Use Proxy" }, { 306, "Unused" }, { 307, "Temporary Redirect" }, { 400, "Bad Request" }, { 401, "Unauthorized" }, { 402, "Payment Required" }, { 403, "Forbidden" }, { 404, "Not Found" }, { 405, "Method Not Allowed" }, { 406, "Not Acceptable" }, { 407, "Proxy Authentication Required" }, { 408, "Request Time-out" }, { 409, "Conflict" }, { 410, "Gone" }, { 411, "Length Required" }, { 412, "Precondition Failed" }, { 413, "Request Entity Too Large" }, { 414, "Request-URI Too Large" }, { 415, "Unsupported Media Type" }, { 416, "Requested range not satisfiable" }, { 417, "Expectation Failed" }, { 500, "Internal Server Error" }, { 501, "Not Implemented" }, { 502, "Bad Gateway" }, { 503, "Service Unavailable" }, { 504, "Gateway Time-out" }, { 505, "HTTP Version not supported" } };
-	_ss << fmt::format ("HTTP/1.1 {} {}\r\n", HttpCode, s_httpcode.contains (HttpCode) ? s_httpcode [HttpCode] : "Unknown");
-	for (auto [_key, _val] : Headers)
-		_ss << _key << ": " << _val << "\r\n";
-	_ss << "\r\n";
-	_ss << _cnt;
-	return _ss.str ();
+	size_t _size = 32 + _cnt.size ();
+	for (const auto &[_key, _val] : Headers)
+		_size += _key.size () + _val.size () + 4;
+	_out.reserve (_out.size () + _size);
+	fmt::format_to (std::back_inserter (_out), "HTTP/1.1 {} {}\r\n", HttpCode, GetStatusText (HttpCode));
+	for (const auto &[_key, _val] : Headers) {
+		_out.append (_key);
+		_out.append (": ");
+		_out.append (_val);
+		_out.append ("\r\n");
+	}
+	_out.append ("\r\n");
+	_out.append (_cnt);
 }
 
 inline void Response::InitDefaultHeaders (CaseInsensitiveMap &_map) {
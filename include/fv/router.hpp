@@ -0,0 +1,178 @@
+#ifndef __FV_ROUTER_HPP__
+#define __FV_ROUTER_HPP__
+
+
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.hpp"
+#include "structs.hpp"
+
+
+
+namespace fv {
+// Path parameters captured by Router::Find. Names point into the router, values are
+// stored as offsets into the matched path, so a copied Request stays valid.
+struct RouteParams {
+	static constexpr size_t MaxCount = 16;
+
+	size_t Size () const { return m_size; }
+	void Clear () { m_size = 0; }
+	std::string_view GetName (size_t _i) const { return m_items [_i].Name; }
+	std::string_view GetValue (std::string_view _path, size_t _i) const { return _path.substr (m_items [_i].Offset, m_items [_i].Length); }
+	std::optional<std::string_view> Get (std::string_view _path, std::string_view _name) const {
+		for (size_t i = 0; i < m_size; ++i) {
+			if (m_items [i].Name == _name)
+				return GetValue (_path, i);
+		}
+		return std::nullopt;
+	}
+
+	bool Push (std::string_view _name, size_t _offset, size_t _length) {
+		if (m_size >= MaxCount)
+			return false;
+		m_items [m_size++] = Item { _name, (uint32_t) _offset, (uint32_t) _length };
+		return true;
+	}
+	void Resize (size_t _size) { m_size = _size; }
+
+private:
+	struct Item {
+		std::string_view Name;
+		uint32_t Offset = 0, Length = 0;
+	};
+	std::array<Item, MaxCount> m_items {};
+	size_t m_size = 0;
+};
+
+
+
+// Segment radix tree. Patterns are split on '/', each segment is either static text,
+// a named parameter (`:id`) matching one segment, or a trailing wildcard (`*path`)
+// matching the rest of the path. Static segments win over parameters, parameters win
+// over wildcards. Lookup does not allocate.
+template<typename THandler>
+class Router {
+public:
+	void Add (std::optional<MethodType> _method, std::string_view _pattern, THandler _handler) {
+		if (_pattern.empty () || _pattern [0] != '/')
+			throw Exception (fmt::format ("Route must start with '/': {}", _pattern));
+		Node *_node = &m_root;
+		std::string_view _rest = _pattern.substr (1);
+		while (true) {
+			size_t _p = _rest.find ('/');
+			std::string_view _seg = _rest.substr (0, _p);
+			if (_seg.size () > 0 && _seg [0] == ':') {
+				if (_seg.size () == 1)
+					throw Exception (fmt::format ("Route parameter needs a name: {}", _pattern));
+				if (!_node->Param) {
+					_node->Param = std::make_unique<Node> ();
+					_node->Param->Segment = _seg.substr (1);
+				} else if (_node->Param->Segment != _seg.substr (1)) {
+					throw Exception (fmt::format ("Route parameter name conflict: {}", _pattern));
+				}
+				_node = _node->Param.get ();
+			} else if (_seg.size () > 0 && _seg [0] == '*') {
+				if (_p != std::string_view::npos)
+					throw Exception (fmt::format ("Route wildcard must be the last segment: {}", _pattern));
+				if (!_node->Wildcard) {
+					_node->Wildcard = std::make_unique<Node> ();
+					_node->Wildcard->Segment = _seg.size () > 1 ? _seg.substr (1) : "*";
+				}
+				_node = _node->Wildcard.get ();
+			} else {
+				auto _it = std::lower_bound (_node->Statics.begin (), _node->Statics.end (), _seg, [] (const std::unique_ptr<Node> &_a, std::string_view _b) {
+					return _a->Segment < _b;
+				});
+				if (_it == _node->Statics.end () || (*_it)->Segment != _seg) {
+					auto _child = std::make_unique<Node> ();
+					_child->Segment = _seg;
+					_it = _node->Statics.insert (_it, std::move (_child));
+				}
+				_node = _it->get ();
+			}
+			if (_p == std::string_view::npos)
+				break;
+			_rest = _rest.substr (_p + 1);
+		}
+		size_t _idx = _method.has_value () ? (size_t) _method.value () : AnyMethod;
+		if (!_node->Handlers [_idx].has_value ())
+			++m_size;
+		_node->Handlers [_idx] = std::move (_handler);
+	}
+
+	// `_path` must not contain the query string. On success `_params` holds offsets into `_path`.
+	const THandler *Find (MethodType _method, std::string_view _path, RouteParams &_params) const {
+		_params.Clear ();
+		if (_path.empty () || _path [0] != '/')
+			return nullptr;
+		return _find (m_root, _path, 1, (size_t) _method, _params);
+	}
+
+	size_t Size () const { return m_size; }
+
+private:
+	static constexpr size_t AnyMethod = 6;
+
+	struct Node {
+		std::string Segment = "";
+		std::vector<std::unique_ptr<Node>> Statics;
+		std::unique_ptr<Node> Param, Wildcard;
+		std::array<std::optional<THandler>, AnyMethod + 1> Handlers;
+
+		const THandler *GetHandler (size_t _method) const {
+			if (Handlers [_method].has_value ())
+				return &Handlers [_method].value ();
+			if (Handlers [AnyMethod].has_value ())
+				return &Handlers [AnyMethod].value ();
+			return nullptr;
+		}
+	};
+
+	// `_pos` is the start of the segment to match under `_node`
+	static const THandler *_find (const Node &_node, std::string_view _path, size_t _pos, size_t _method, RouteParams &_params) {
+		size_t _end = _path.find ('/', _pos);
+		std::string_view _seg = _path.substr (_pos, _end == std::string_view::npos ? std::string_view::npos : _end - _pos);
+		auto _next = [&] (const Node &_child) -> const THandler * {
+			if (_end == std::string_view::npos)
+				return _child.GetHandler (_method);
+			return _find (_child, _path, _end + 1, _method, _params);
+		};
+
+		auto _it = std::lower_bound (_node.Statics.begin (), _node.Statics.end (), _seg, [] (const std::unique_ptr<Node> &_a, std::string_view _b) {
+			return _a->Segment < _b;
+		});
+		if (_it != _node.Statics.end () && (*_it)->Segment == _seg) {
+			if (const THandler *_h = _next (**_it))
+				return _h;
+		}
+
+		size_t _saved = _params.Size ();
+		if (_node.Param && _seg.size () > 0 && _params.Push (_node.Param->Segment, _pos, _seg.size ())) {
+			if (const THandler *_h = _next (*_node.Param))
+				return _h;
+			_params.Resize (_saved);
+		}
+
+		if (_node.Wildcard && _params.Push (_node.Wildcard->Segment, _pos, _path.size () - _pos)) {
+			if (const THandler *_h = _node.Wildcard->GetHandler (_method))
+				return _h;
+			_params.Resize (_saved);
+		}
+		return nullptr;
+	}
+
+	Node m_root {};
+	size_t m_size = 0;
+};
+}
+
+
+
+#endif //__FV_ROUTER_HPP__
@@ -3,54 +3,357 @@
 
 
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
-#include <unordered_set>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "common.hpp"
 #include "conn.hpp"
+#include "limiter.hpp"
+#include "listeners.hpp"
+#include "microcache.hpp"
+#include "router.hpp"
 
 
 
 namespace fv {
-struct TcpServer {
-	void SetOnConnect (std::function<Task<void> (std::shared_ptr<IConn2>)> _on_connect) { OnConnect = _on_connect; }
-	void RegisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { std::unique_lock _ul { Mutex }; Clients [_id] = _conn; }
-	void UnregisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) {
-		std::unique_lock _ul { Mutex };
-		if (Clients [_id].get () == _conn.get ())
-			Clients.erase (_id);
+// Queues one shared payload to every connection without waiting for any of them to
+// write it. Connections are grouped by I/O context and each group is enqueued on its
+// own thread; peers whose queue is above the high watermark are counted as dropped.
+inline Task<BroadcastResult> BroadcastTo (std::vector<std::shared_ptr<IConn2>> _conns, std::shared_ptr<const std::string> _payload) {
+	std::unordered_map<asio::execution_context *, std::vector<std::shared_ptr<IConn2>>> _groups;
+	for (auto &_conn : _conns) {
+		if (!_conn)
+			continue;
+		asio::execution_context *_ctx = &asio::query (_conn->GetExecutor (), asio::execution::context);
+		_groups [_ctx].emplace_back (std::move (_conn));
 	}
-	Task<bool> SendData (int64_t _id, char *_data, size_t _size) {
-		try {
-			std::unique_lock _ul { Mutex };
-			if (Clients.contains (_id)) {
-				auto _conn = Clients [_id];
-				_ul.unlock ();
-				co_await _conn->Send (_data, _size);
-				co_return true;
+	if (_groups.empty ())
+		co_return BroadcastResult {};
+	struct _State {
+		std::atomic_size_t Delivered { 0 }, Dropped { 0 }, Remaining { 0 };
+		AsyncEvent Done {};
+	};
+	auto _state = std::make_shared<_State> ();
+	_state->Remaining.store (_groups.size ());
+	for (auto &[_ctx, _group] : _groups) {
+		auto _executor = _group [0]->GetExecutor ();
+		asio::post (_executor, [_state, _payload, _group = std::move (_group)] () {
+			size_t _delivered = 0;
+			for (auto &_conn : _group) {
+				if (_conn->TryWrite (_payload))
+					_delivered++;
 			}
-		} catch (...) {
+			_state->Delivered += _delivered;
+			_state->Dropped += _group.size () - _delivered;
+			if (--_state->Remaining == 0)
+				_state->Done.Set ();
+		});
+	}
+	co_await _state->Done.Wait ();
+	co_return BroadcastResult { _state->Delivered.load (), _state->Dropped.load () };
+}
+
+
+
+// Client table shared by TcpServer/SslServer. Ids are spread over shards with their
+// own reader/writer lock, so sends to different clients and connect/disconnect on
+// different I/O threads do not contend on one mutex. Clients can join named groups
+// for targeted multicast.
+class ClientRegistry {
+public:
+	static constexpr size_t ShardCount = 64;
+
+	void Register (int64_t _id, std::shared_ptr<IConn2> _conn) {
+		auto &_shard = _get_shard (_id);
+		std::unique_lock _ul { _shard.Mutex };
+		auto &_entry = _shard.Clients [_id];
+		_entry.Conn = _conn;
+		for (auto &_group : _entry.Groups) {
+			auto &_gshard = _get_group_shard (_group);
+			std::unique_lock _ul2 { _gshard.Mutex };
+			_gshard.Groups [_group] [_id] = _conn;
 		}
-		co_return false;
 	}
-	Task<size_t> BroadcastData (char *_data, size_t _size) {
-		std::unique_lock _ul { Mutex };
-		std::unordered_set<std::shared_ptr<IConn2>> _conns;
-		for (auto [_key, _val] : Clients)
-			_conns.emplace (_val);
-		_ul.unlock ();
+
+	// Only removes the entry if it still belongs to `_conn`, a reconnect may have replaced it
+	void Unregister (int64_t _id, std::shared_ptr<IConn2> _conn) {
+		auto &_shard = _get_shard (_id);
+		std::unique_lock _ul { _shard.Mutex };
+		auto _it = _shard.Clients.find (_id);
+		if (_it == _shard.Clients.end () || _it->second.Conn.get () != _conn.get ())
+			return;
+		for (auto &_group : _it->second.Groups) {
+			auto &_gshard = _get_group_shard (_group);
+			std::unique_lock _ul2 { _gshard.Mutex };
+			_remove_member (_gshard, _group, _id);
+		}
+		_shard.Clients.erase (_it);
+	}
+
+	std::shared_ptr<IConn2> Get (int64_t _id) {
+		auto &_shard = _get_shard (_id);
+		std::shared_lock _sl { _shard.Mutex };
+		auto _it = _shard.Clients.find (_id);
+		return _it != _shard.Clients.end () ? _it->second.Conn : nullptr;
+	}
+
+	size_t Size () {
+		size_t _size = 0;
+		for (auto &_shard : m_shards) {
+			std::shared_lock _sl { _shard.Mutex };
+			_size += _shard.Clients.size ();
+		}
+		return _size;
+	}
+
+	// Shards are copied one at a time, writers are only blocked on the shard being copied
+	std::vector<std::shared_ptr<IConn2>> Snapshot () {
+		std::vector<std::shared_ptr<IConn2>> _conns;
+		for (auto &_shard : m_shards) {
+			std::shared_lock _sl { _shard.Mutex };
+			for (auto &[_id, _entry] : _shard.Clients)
+				_conns.emplace_back (_entry.Conn);
+		}
+		return _conns;
+	}
+
+	bool JoinGroup (int64_t _id, const std::string &_group) {
+		auto &_shard = _get_shard (_id);
+		std::unique_lock _ul { _shard.Mutex };
+		auto _it = _shard.Clients.find (_id);
+		if (_it == _shard.Clients.end ())
+			return false;
+		auto &_groups = _it->second.Groups;
+		if (std::find (_groups.begin (), _groups.end (), _group) == _groups.end ())
+			_groups.emplace_back (_group);
+		auto &_gshard = _get_group_shard (_group);
+		std::unique_lock _ul2 { _gshard.Mutex };
+		_gshard.Groups [_group] [_id] = _it->second.Conn;
+		return true;
+	}
+
+	void LeaveGroup (int64_t _id, const std::string &_group) {
+		auto &_shard = _get_shard (_id);
+		std::unique_lock _ul { _shard.Mutex };
+		auto _it = _shard.Clients.find (_id);
+		if (_it != _shard.Clients.end ()) {
+			auto &_groups = _it->second.Groups;
+			_groups.erase (std::remove (_groups.begin (), _groups.end (), _group), _groups.end ());
+		}
+		auto &_gshard = _get_group_shard (_group);
+		std::unique_lock _ul2 { _gshard.Mutex };
+		_remove_member (_gshard, _group, _id);
+	}
+
+	std::vector<std::shared_ptr<IConn2>> SnapshotGroup (const std::string &_group) {
+		std::vector<std::shared_ptr<IConn2>> _conns;
+		auto &_gshard = _get_group_shard (_group);
+		std::shared_lock _sl { _gshard.Mutex };
+		auto _it = _gshard.Groups.find (_group);
+		if (_it != _gshard.Groups.end ()) {
+			_conns.reserve (_it->second.size ());
+			for (auto &[_id, _conn] : _it->second)
+				_conns.emplace_back (_conn);
+		}
+		return _conns;
+	}
+
+private:
+	struct Entry {
+		std::shared_ptr<IConn2> Conn;
+		std::vector<std::string> Groups;
+	};
+	struct alignas (64) Shard {
+		std::shared_mutex Mutex;
+		std::unordered_map<int64_t, Entry> Clients;
+	};
+	struct alignas (64) GroupShard {
+		std::shared_mutex Mutex;
+		std::unordered_map<std::string, std::unordered_map<int64_t, std::shared_ptr<IConn2>>> Groups;
+	};
+
+	Shard &_get_shard (int64_t _id) { return m_shards [std::hash<int64_t> {} (_id) % ShardCount]; }
+	GroupShard &_get_group_shard (const std::string &_group) { return m_group_shards [std::hash<std::string> {} (_group) % ShardCount]; }
+	static void _remove_member (GroupShard &_gshard, const std::string &_group, int64_t _id) {
+		auto _it = _gshard.Groups.find (_group);
+		if (_it == _gshard.Groups.end ())
+			return;
+		_it->second.erase (_id);
+		if (_it->second.empty ())
+			_gshard.Groups.erase (_it);
+	}
+
+	std::array<Shard, ShardCount> m_shards;
+	std::array<GroupShard, ShardCount> m_group_shards;
+};
+
+
+
+// Connections a server is serving. The HTTP server marks the ones waiting for their next
+// request idle, so a drain can close those at once and wait for the others.
+class ConnTracker {
+public:
+	struct Entry {
+		std::shared_ptr<IConn2> Conn;
+		std::atomic_bool Idle { false };
+	};
+
+	std::shared_ptr<Entry> Add (std::shared_ptr<IConn2> _conn) {
+		auto _entry = std::make_shared<Entry> ();
+		_entry->Conn = _conn;
+		std::unique_lock _ul { m_mtx };
+		m_entries [_conn.get ()] = _entry;
+		return _entry;
+	}
+	void Remove (IConn2 *_conn) {
+		std::unique_lock _ul { m_mtx };
+		m_entries.erase (_conn);
+	}
+	std::shared_ptr<Entry> Find (IConn2 *_conn) {
+		std::unique_lock _ul { m_mtx };
+		auto _it = m_entries.find (_conn);
+		return _it != m_entries.end () ? _it->second : nullptr;
+	}
+	size_t Size () {
+		std::unique_lock _ul { m_mtx };
+		return m_entries.size ();
+	}
+
+	bool IsDraining () const { return m_draining.load (std::memory_order_relaxed); }
+	// false when a drain already started
+	bool StartDrain () { return !m_draining.exchange (true); }
+
+	// Cancels the idle connections, or every one; returns how many
+	size_t Close (bool _idle_only) {
+		std::unique_lock _ul { m_mtx };
 		size_t _count = 0;
-		for (auto _conn : _conns) {
-			try {
-				co_await _conn->Send (_data, _size);
-				_count++;
-			} catch (...) {
-			}
+		for (auto &[_ptr, _entry] : m_entries) {
+			if (_idle_only && !_entry->Idle.load ())
+				continue;
+			asio::post (_entry->Conn->GetExecutor (), [_conn = _entry->Conn] () { _conn->Cancel (); });
+			++_count;
+		}
+		return _count;
+	}
+
+private:
+	std::mutex m_mtx;
+	std::unordered_map<IConn2 *, std::shared_ptr<Entry>> m_entries;
+	std::atomic_bool m_draining { false };
+};
+
+// Stops accepting, closes idle connections and waits for the rest to finish; the ones left
+// at the deadline are cancelled. True when every connection finished in time.
+inline Task<bool> _drain (std::shared_ptr<ConnTracker> _conns, std::shared_ptr<Tcp::acceptor> _acceptor, TimeSpan _deadline) {
+	if (!_conns->StartDrain ())
+		co_return false;
+	Metrics::DrainingServers.Add (1);
+	if (_acceptor)
+		asio::post (_acceptor->get_executor (), [_acceptor] () { ErrorCode _ec; _acceptor->close (_ec); });
+	Metrics::DrainClosedConnections.Add (_conns->Close (true));
+	auto _until = std::chrono::steady_clock::now () + _deadline;
+	while (_conns->Size () > 0 && std::chrono::steady_clock::now () < _until)
+		co_await Tasks::Delay (std::chrono::milliseconds (10));
+	bool _drained = _conns->Size () == 0;
+	if (!_drained)
+		Metrics::DrainForcedConnections.Add (_conns->Close (false));
+	Metrics::DrainingServers.Add (-1);
+	co_return _drained;
+}
+
+// Runs a connection handler while it is counted in Metrics::ActiveConnections and in the
+// server's tracker, and gives its connection slot back afterwards. The accept span covers
+// the time from accept until the handler got scheduled.
+inline Task<void> _serve_counted (std::function<Task<void> (std::shared_ptr<IConn2>)> &_on_connect, std::shared_ptr<IConn2> _conn, std::chrono::steady_clock::time_point _accepted, std::shared_ptr<AsyncSemaphore> _slots, std::shared_ptr<ConnTracker> _conns) {
+	if (Tracing::IsEnabled ())
+		Tracing::Record ("accept", Tracing::NewSpan (TraceContext {}), 0, _accepted, std::chrono::steady_clock::now (), 1);
+	if (_conns->IsDraining ()) {
+		// accepted or handshaken while the drain started
+		Metrics::DrainClosedConnections.Add ();
+		if (_slots)
+			_slots->Release ();
+		co_return;
+	}
+	_conns->Add (_conn);
+	Metrics::ActiveConnections.Add (1);
+	try {
+		co_await _on_connect (_conn);
+	} catch (...) {
+		Metrics::ActiveConnections.Add (-1);
+		_conns->Remove (_conn.get ());
+		if (_slots)
+			_slots->Release ();
+		throw;
+	}
+	Metrics::ActiveConnections.Add (-1);
+	_conns->Remove (_conn.get ());
+	if (_slots)
+		_slots->Release ();
+}
+
+// Closes a connection whose deadline passed. The deadline is a timer on the TimerWheel of
+// the connection's context, so moving it at every request stage is an O(1) relink and a
+// connection costs no coroutine or steady_timer of its own. Use it on that context only.
+class ConnWatchdog {
+public:
+	ConnWatchdog (std::shared_ptr<IConn2> _conn): m_wheel (TimerWheel::Get (_conn->GetExecutor ())) {
+		m_timer = std::make_shared<TimerWheel::Timer> ([_wconn = std::weak_ptr<IConn2> (_conn)] () {
+			if (auto _conn = _wconn.lock ())
+				_conn->Cancel ();
+		});
+	}
+	ConnWatchdog (const ConnWatchdog &) = delete;
+	ConnWatchdog &operator= (const ConnWatchdog &) = delete;
+	~ConnWatchdog () { m_wheel.Cancel (m_timer); }
+
+	// <= 0 clears the deadline
+	void Arm (TimeSpan _timeout) {
+		if (_timeout.count () > 0) {
+			m_wheel.Reschedule (m_timer, _timeout);
+		} else {
+			m_wheel.Cancel (m_timer);
 		}
-		co_return _count;
+	}
+
+private:
+	TimerWheel &m_wheel;
+	std::shared_ptr<TimerWheel::Timer> m_timer;
+};
+
+
+
+struct TcpServer {
+	void SetOnConnect (std::function<Task<void> (std::shared_ptr<IConn2>)> _on_connect) { OnConnect = _on_connect; }
+	// Call before Run; only MaxConnections applies here
+	void SetLimits (const ServerLimits &_limits) { Slots = _limits.MaxConnections > 0 ? std::make_shared<AsyncSemaphore> (_limits.MaxConnections) : nullptr; }
+	void RegisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { Clients.Register (_id, _conn); }
+	void UnregisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { Clients.Unregister (_id, _conn); }
+	bool JoinGroup (int64_t _id, const std::string &_group) { return Clients.JoinGroup (_id, _group); }
+	void LeaveGroup (int64_t _id, const std::string &_group) { Clients.LeaveGroup (_id, _group); }
+	size_t GetClientCount () { return Clients.Size (); }
+	Task<bool> SendData (int64_t _id, char *_data, size_t _size, WritePolicy _policy = WritePolicy::Wait) {
+		auto _conn = Clients.Get (_id);
+		if (!_conn)
+			co_return false;
+		co_return co_await _conn->Write (std::string (_data, _size), _policy);
+	}
+	Task<size_t> BroadcastData (char *_data, size_t _size) {
+		BroadcastResult _ret = co_await Broadcast (std::make_shared<const std::string> (_data, _size));
+		co_return _ret.Delivered;
+	}
+	Task<BroadcastResult> Broadcast (std::shared_ptr<const std::string> _payload) {
+		co_return co_await BroadcastTo (Clients.Snapshot (), std::move (_payload));
+	}
+	Task<BroadcastResult> BroadcastGroup (std::string _group, std::shared_ptr<const std::string> _payload) {
+		co_return co_await BroadcastTo (Clients.SnapshotGroup (_group), std::move (_payload));
 	}
 	Task<void> Run (std::string _ip, uint16_t _port) {
 		if (IsRun.load ())
@@ -58,33 +361,53 @@ struct TcpServer {
 		IsRun.store (true);
 		auto _executor = co_await asio::this_coro::executor;
 		Tcp::endpoint _ep { asio::ip::address::from_string (_ip), _port };
-		Acceptor = std::make_unique<Tcp::acceptor> (_executor, _ep, true);
+		Acceptor = Listeners::Open (_executor, _ep);
+		size_t _hook = Tasks::AddDrainHook ([_conns = Conns, _acceptor = Acceptor] (TimeSpan _deadline) -> Task<void> { co_await _drain (_conns, _acceptor, _deadline); });
 		try {
-			for (; IsRun.load ();) {
-				std::shared_ptr<IConn2> _conn = std::shared_ptr<IConn2> ((IConn2 *) new TcpConn2 (co_await Acceptor->async_accept (UseAwaitable)));
-				Tasks::RunAsync ([this, _conn] () -> Task<void> {
-					co_await OnConnect (_conn);
+			for (; IsRun.load () && !Conns->IsDraining ();) {
+				// past MaxConnections further clients wait in the listen backlog
+				if (Slots)
+					co_await Slots->Acquire ();
+				if (Conns->IsDraining ())
+					break;
+				// the socket and its connection task share a worker context, spread round robin
+				size_t _index = Tasks::NextContextIndex ();
+				std::shared_ptr<IConn2> _conn = std::shared_ptr<IConn2> ((IConn2 *) new TcpConn2 (co_await Acceptor->async_accept (Tasks::GetContext (_index), UseAwaitable)));
+				Metrics::AcceptedConnections.Add ();
+				Tasks::RunAsyncOn (_index, [this, _conn, _accepted = std::chrono::steady_clock::now (), _slots = Slots, _conns = Conns] () -> Task<void> {
+					co_await _serve_counted (OnConnect, _conn, _accepted, _slots, _conns);
 				});
 			}
 		} catch (...) {
 		}
+		Tasks::RemoveDrainHook (_hook);
+		// handlers use this server, so a drain keeps Run from returning until they finished
+		while (Conns->IsDraining () && Conns->Size () > 0)
+			co_await Tasks::Delay (std::chrono::milliseconds (10));
 	}
 	Task<void> Run (uint16_t _port) {
 		co_await Run ("0.0.0.0", _port);
 	}
 	void Stop () {
 		IsRun.store (false);
+		ErrorCode _ec;
 		if (Acceptor)
-			Acceptor->cancel ();
+			Acceptor->cancel (_ec);
 	}
+	// Stops accepting, closes idle connections and waits up to `_deadline` for the others,
+	// then cancels them. True when all finished in time.
+	Task<bool> Shutdown (TimeSpan _deadline) { co_return co_await _drain (Conns, Acceptor, _deadline); }
+	bool IsDraining () const { return Conns->IsDraining (); }
+	std::shared_ptr<ConnTracker> GetConnTracker () { return Conns; }
 
 private:
 	std::function<Task<void> (std::shared_ptr<IConn2>)> OnConnect;
-	std::mutex Mutex;
-	std::unordered_map<int64_t, std::shared_ptr<IConn2>> Clients;
+	ClientRegistry Clients;
 
-	std::unique_ptr<Tcp::acceptor> Acceptor;
+	std::shared_ptr<Tcp::acceptor> Acceptor;
 	std::atomic_bool IsRun { false };
+	std::shared_ptr<AsyncSemaphore> Slots;
+	std::shared_ptr<ConnTracker> Conns = std::make_shared<ConnTracker> ();
 };
 
 
@@ -92,40 +415,31 @@ private:
 
 struct SslServer {
 	void SetOnConnect (std::function<Task<void> (std::shared_ptr<IConn2>)> _on_connect) { OnConnect = _on_connect; }
-	void RegisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { std::unique_lock _ul { Mutex }; Clients [_id] = _conn; }
-	void UnregisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) {
-		std::unique_lock _ul { Mutex };
-		if (Clients [_id].get () == _conn.get ())
-			Clients.erase (_id);
+	// Call before Run; MaxConnections, and HeaderTimeout bounds the TLS handshake
+	void SetLimits (const ServerLimits &_limits) {
+		Slots = _limits.MaxConnections > 0 ? std::make_shared<AsyncSemaphore> (_limits.MaxConnections) : nullptr;
+		HandshakeTimeout = _limits.HeaderTimeout;
 	}
-	Task<bool> SendData (int64_t _id, char *_data, size_t _size) {
-		try {
-			std::unique_lock _ul { Mutex };
-			if (Clients.contains (_id)) {
-				auto _conn = Clients [_id];
-				_ul.unlock ();
-				co_await _conn->Send (_data, _size);
-				co_return true;
-			}
-		} catch (...) {
-		}
-		co_return false;
+	void RegisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { Clients.Register (_id, _conn); }
+	void UnregisterClient (int64_t _id, std::shared_ptr<IConn2> _conn) { Clients.Unregister (_id, _conn); }
+	bool JoinGroup (int64_t _id, const std::string &_group) { return Clients.JoinGroup (_id, _group); }
+	void LeaveGroup (int64_t _id, const std::string &_group) { Clients.LeaveGroup (_id, _group); }
+	size_t GetClientCount () { return Clients.Size (); }
+	Task<bool> SendData (int64_t _id, char *_data, size_t _size, WritePolicy _policy = WritePolicy::Wait) {
+		auto _conn = Clients.Get (_id);
+		if (!_conn)
+			co_return false;
+		co_return co_await _conn->Write (std::string (_data, _size), _policy);
 	}
 	Task<size_t> BroadcastData (char *_data, size_t _size) {
-		std::unique_lock _ul { Mutex };
-		std::unordered_set<std::shared_ptr<IConn2>> _conns;
-		for (auto [_key, _val] : Clients)
-			_conns.emplace (_val);
-		_ul.unlock ();
-		size_t _count = 0;
-		for (auto _conn : _conns) {
-			try {
-				co_await _conn->Send (_data, _size);
-				_count++;
-			} catch (...) {
-			}
-		}
-		co_return _count;
+		BroadcastResult _ret = co_await Broadcast (std::make_shared<const std::string> (_data, _size));
+		co_return _ret.Delivered;
+	}
+	Task<BroadcastResult> Broadcast (std::shared_ptr<const std::string> _payload) {
+		co_return co_await BroadcastTo (Clients.Snapshot (), std::move (_payload));
+	}
+	Task<BroadcastResult> BroadcastGroup (std::string _group, std::shared_ptr<const std::string> _payload) {
+		co_return co_await BroadcastTo (Clients.SnapshotGroup (_group), std::move (_payload));
 	}
 	Task<void> Run (std::string _ip, uint16_t _port, Ssl::context& _ssl_ctx) {
 		if (IsRun.load ())
@@ -133,20 +447,41 @@ struct SslServer {
 		IsRun.store (true);
 		auto _executor = co_await asio::this_coro::executor;
 		Tcp::endpoint _ep { asio::ip::address::from_string (_ip), _port };
-		Acceptor = std::make_unique<Tcp::acceptor> (_executor, _ep, true);
+		Acceptor = Listeners::Open (_executor, _ep);
+		size_t _hook = Tasks::AddDrainHook ([_conns = Conns, _acceptor = Acceptor] (TimeSpan _deadline) -> Task<void> { co_await _drain (_conns, _acceptor, _deadline); });
 		try {
-			for (; IsRun.load ();) {
+			for (; IsRun.load () && !Conns->IsDraining ();) {
+				// past MaxConnections further clients wait in the listen backlog
+				if (Slots)
+					co_await Slots->Acquire ();
+				if (Conns->IsDraining ())
+					break;
 				try {
-					Tcp::socket _socket(co_await Acceptor->async_accept (UseAwaitable));
-					Ssl::stream<Tcp::socket> _ssl_socket(std::move(_socket), _ssl_ctx);
-					// Perform SSL handshake
-					co_await _ssl_socket.async_handshake(Ssl::stream_base::server, UseAwaitable);
-					std::shared_ptr<IConn2> _conn = std::make_shared<SslConn2>(std::move(_ssl_socket));
-					Tasks::RunAsync ([this, _conn] () -> Task<void> {
-						co_await OnConnect (_conn);
+					size_t _index = Tasks::NextContextIndex ();
+					auto _socket = std::make_shared<Tcp::socket> (co_await Acceptor->async_accept (Tasks::GetContext (_index), UseAwaitable));
+					Metrics::AcceptedConnections.Add ();
+					// the handshake runs with the connection, so a slow client never stalls accept
+					Tasks::RunAsyncOn (_index, [this, _socket, &_ssl_ctx, _accepted = std::chrono::steady_clock::now (), _slots = Slots, _conns = Conns] () -> Task<void> {
+						auto _ssl_socket = std::make_shared<Ssl::stream<Tcp::socket>> (std::move (*_socket), _ssl_ctx);
+						try {
+							Deadline _deadline { HandshakeTimeout, [_ssl_socket] () { _close_socket (_ssl_socket, _ssl_socket->next_layer ()); } };
+							co_await _ssl_socket->async_handshake (Ssl::stream_base::server, UseAwaitable);
+						} catch (...) {
+							Metrics::TlsHandshakeFailures.Add ();
+							if (Tracing::IsEnabled ())
+								Tracing::Record ("tls_handshake", Tracing::NewSpan (TraceContext {}), 0, _accepted, std::chrono::steady_clock::now (), 0);
+							if (_slots)
+								_slots->Release ();
+							co_return;
+						}
+						if (Tracing::IsEnabled ())
+							Tracing::Record ("tls_handshake", Tracing::NewSpan (TraceContext {}), 0, _accepted, std::chrono::steady_clock::now (), 1);
+						std::shared_ptr<IConn2> _conn = std::make_shared<SslConn2> (std::move (*_ssl_socket));
+						co_await _serve_counted (OnConnect, _conn, _accepted, _slots, _conns);
 					});
 				} catch (...) {
-					// Handle SSL handshake errors properly
+					if (Slots)
+						Slots->Release ();
 					// Continue to next iteration to accept new connections
 					continue;
 				}
@@ -154,23 +489,33 @@ struct SslServer {
 		} catch (...) {
 			// Log error or handle outer exception as needed
 		}
+		Tasks::RemoveDrainHook (_hook);
+		while (Conns->IsDraining () && Conns->Size () > 0)
+			co_await Tasks::Delay (std::chrono::milliseconds (10));
 	}
 	Task<void> Run (uint16_t _port, Ssl::context& _ssl_ctx) {
 		co_await Run ("0.0.0.0", _port, _ssl_ctx);
 	}
 	void Stop () {
 		IsRun.store (false);
+		ErrorCode _ec;
 		if (Acceptor)
-			Acceptor->cancel ();
+			Acceptor->cancel (_ec);
 	}
+	// Same as TcpServer::Shutdown; handshakes still running are bounded by HeaderTimeout
+	Task<bool> Shutdown (TimeSpan _deadline) { co_return co_await _drain (Conns, Acceptor, _deadline); }
+	bool IsDraining () const { return Conns->IsDraining (); }
+	std::shared_ptr<ConnTracker> GetConnTracker () { return Conns; }
 
 private:
 	std::function<Task<void> (std::shared_ptr<IConn2>)> OnConnect;
-	std::mutex Mutex;
-	std::unordered_map<int64_t, std::shared_ptr<IConn2>> Clients;
+	ClientRegistry Clients;
 
-	std::unique_ptr<Tcp::acceptor> Acceptor;
+	std::shared_ptr<Tcp::acceptor> Acceptor;
 	std::atomic_bool IsRun { false };
+	std::shared_ptr<AsyncSemaphore> Slots;
+	TimeSpan HandshakeTimeout = ServerLimits {}.HeaderTimeout;
+	std::shared_ptr<ConnTracker> Conns = std::make_shared<ConnTracker> ();
 };
 
 
@@ -179,53 +524,204 @@ private:
 template<typename ServerType>
 struct HttpServerBase {
 	void OnBefore (std::function<Task<std::optional<fv::Response>> (fv::Request &)> _cb) { m_before = _cb; }
-	void SetHttpHandler (std::string _path, std::function<Task<fv::Response> (fv::Request &)> _cb) { m_map_proc [_path] = _cb; }
+	void SetHttpHandler (std::string _path, std::function<Task<fv::Response> (fv::Request &)> _cb) { m_router.Add (std::nullopt, _path, _cb); }
+	void SetHttpHandler (MethodType _method, std::string _path, std::function<Task<fv::Response> (fv::Request &)> _cb) { m_router.Add (_method, _path, _cb); }
 	void OnUnhandled (std::function<Task<fv::Response> (fv::Request &)> _cb) { m_unhandled_proc = _cb; }
 	void OnAfter (std::function<Task<void> (fv::Request &, fv::Response &)> _cb) { m_after = _cb; }
+	// Caches GET responses whose handler opted in with `Cache-Control: s-maxage=N`. Hits
+	// skip the handler and OnAfter, OnBefore still runs for every request.
+	void EnableMicroCache (size_t _max_bytes = 64 * 1024 * 1024, std::vector<std::string> _vary_headers = {}, bool _gzip = true) {
+		m_microcache = std::make_shared<MicroCache> (_max_bytes, std::move (_vary_headers), _gzip);
+	}
+	std::shared_ptr<MicroCache> GetMicroCache () { return m_microcache; }
+	// Call before Run
+	void SetLimits (ServerLimits _limits) { m_limits = _limits; m_server.SetLimits (_limits); }
+	// Refuses requests with 503 once more handlers run than the latency derived limit
+	// allows. Websocket upgrades and microcache hits are not counted.
+	void EnableAdaptiveConcurrency (AdaptiveLimiter::Options _opts = {}) { m_limiter = std::make_shared<AdaptiveLimiter> (_opts); }
+	std::shared_ptr<AdaptiveLimiter> GetConcurrencyLimiter () { return m_limiter; }
+	// Call before Run; a request is checked against every rule it matches
+	void AddRateLimit (RateLimitRule _rule) {
+		auto _limiter = std::make_shared<RateLimiter> (_rule.Rate, _rule.Burst, _rule.MaxKeys);
+		m_rate_limits.emplace_back (std::move (_rule), std::move (_limiter));
+	}
 
 	// Common request processing logic to avoid duplication
 	Task<void> ProcessRequests(std::shared_ptr<IConn2> _conn, uint16_t _port) {
+		// Serialized responses are written into one buffer per connection; clearing it keeps
+		// the capacity, so steady-state keep-alive traffic does not allocate for it
+		std::string _str_res;
+		std::optional<ConnWatchdog> _watchdog;
+		if (m_limits.HeaderTimeout.count () > 0 || m_limits.BodyTimeout.count () > 0 || m_limits.IdleTimeout.count () > 0) {
+			_watchdog.emplace (_conn);
+			_watchdog->Arm (m_limits.IdleTimeout);
+		}
+		// the body deadline restarts with every chunk received, so a large upload at a
+		// steady pace is never cut off by a fixed deadline
+		std::function<void ()> _on_body_chunk;
+		if (_watchdog)
+			_on_body_chunk = [&_watchdog, this] () { _watchdog->Arm (m_limits.BodyTimeout); };
+		auto _conns = m_server.GetConnTracker ();
+		auto _tracked = _conns->Find (_conn.get ());
 		while (true) {
-			Request _req = co_await Request::GetFromConn (_conn, _port);
-			if (m_before) {
-				std::optional<Response> _ores = co_await m_before (_req);
-				if (_ores.has_value ()) {
-					if (m_after)
-						co_await m_after (_req, _ores.value ());
-					std::string _str_res = _ores.value ().Serilize ();
-					try {
-						co_await _conn->Send (_str_res.data (), _str_res.size ());
-					} catch (...) {
-						break;
-					}
-					continue;
+			_str_res.clear ();
+			// pipelined requests that are already buffered are still answered
+			if (_conn->GetBuffered () == 0) {
+				if (_conns->IsDraining ()) {
+					Metrics::DrainClosedConnections.Add ();
+					break;
 				}
+				if (_tracked)
+					_tracked->Idle.store (true);
 			}
-			Response _res {};
-			if (m_map_proc.contains (_req.UrlPath)) {
+			StagedSpan _span {};
+			std::chrono::steady_clock::time_point _parse_start {};
+			bool _traced = Tracing::IsEnabled ();
+			// the header timeout and the parse span start at the first byte, not while the
+			// connection idles
+			if ((_watchdog || _traced) && _conn->GetBuffered () == 0) {
+				co_await _conn->Fill (1);
+				if (_tracked)
+					_tracked->Idle.store (false);
+			}
+			if (_watchdog)
+				_watchdog->Arm (m_limits.HeaderTimeout);
+			if (_traced)
+				_parse_start = std::chrono::steady_clock::now ();
+			std::optional<Request> _oreq;
+			int _reject = 0;
+			try {
+				_oreq.emplace (co_await Request::GetFromConn (_conn, _port, m_limits.MaxHeaderBytes, m_limits.MaxBodyBytes, _on_body_chunk));
+			} catch (HttpException &_e) {
+				_reject = _e.HttpCode;
+			}
+			if (_reject != 0) {
+				// the rest of the request is unread, so the connection cannot be reused
+				Response _res = Response::FromText (std::string (Response::GetStatusText (_reject)));
+				_res.HttpCode = _reject;
+				_res.Headers ["Connection"] = "close";
+				_res.SerilizeTo (_str_res);
 				try {
-					_res = co_await m_map_proc [_req.UrlPath] (_req);
+					co_await _conn->Send (_str_res.data (), _str_res.size ());
 				} catch (...) {
 				}
+				break;
+			}
+			Request &_req = _oreq.value ();
+			if (_tracked)
+				_tracked->Idle.store (false);
+			if (_watchdog)
+				_watchdog->Arm (TimeSpan::zero ());
+			auto _start = std::chrono::steady_clock::now ();
+			if (_parse_start != std::chrono::steady_clock::time_point {}) {
+				auto _it = _req.Headers.find ("traceparent");
+				auto _parent = _it != _req.Headers.end () ? TraceContext::FromTraceparent (_it->second) : std::nullopt;
+				_span.Start ("http.server", _parent.value_or (TraceContext {}), "parse", _parse_start);
+				_span.Stage ("handler");
+				_req.Trace = _span.Context ();
+			}
+			std::optional<Response> _ores = _check_rate_limits (_req);
+			if (!_ores.has_value () && m_before)
+				_ores = co_await _with_trace (_req.Trace, m_before (_req));
+			if (_ores.has_value ()) {
+				if (m_after)
+					co_await _with_trace (_req.Trace, m_after (_req, _ores.value ()));
+				_span.Stage ("serialize");
+				bool _closing = _conns->IsDraining ();
+				if (_closing)
+					_ores.value ().Headers ["Connection"] = "close";
+				_ores.value ().SerilizeTo (_str_res);
+				_count_request (_ores.value ().HttpCode, _start);
+				if (_watchdog)
+					_watchdog->Arm (m_limits.IdleTimeout);
+				_span.Stage ("send");
+				try {
+					co_await _conn->Send (_str_res.data (), _str_res.size ());
+				} catch (...) {
+					_span.End (0, _req.GetPath ());
+					break;
+				}
+				_span.End (_ores.value ().HttpCode, _req.GetPath ());
+				if (_closing) {
+					Metrics::DrainClosedConnections.Add ();
+					break;
+				}
+				continue;
+			}
+			// cached bytes cannot carry `Connection: close`, so draining skips the cache
+			if (m_microcache && !_conns->IsDraining () && MicroCache::Accepts (_req)) {
+				std::function<Task<Response> (Request &)> _handler = [this] (Request &_req) -> Task<Response> { co_return co_await _with_trace (_req.Trace, _HandleCacheable (_req)); };
+				std::shared_ptr<const std::string> _bytes;
+				try {
+					_bytes = co_await m_microcache->Get (_req, _handler);
+					// the status code sits right after "HTTP/1.1 "
+					_count_request (_bytes->size () > 9 && (*_bytes) [9] == '5' ? 500 : 200, _start);
+					if (_watchdog)
+						_watchdog->Arm (m_limits.IdleTimeout);
+					_span.Stage ("send");
+					co_await _conn->Send (const_cast<char *> (_bytes->data ()), _bytes->size ());
+				} catch (...) {
+					_span.End (0, _req.GetPath ());
+					break;
+				}
+				_span.End (_bytes->size () > 12 ? std::atoi (_bytes->data () + 9) : 0, _req.GetPath ());
+				continue;
+			}
+			Response _res {};
+			bool _admitted = false;
+			if (m_limiter && !_req.IsWebsocket ()) {
+				_admitted = m_limiter->TryAcquire ();
+				if (!_admitted) {
+					Metrics::ShedRequests.Add ();
+					_res = Response::FromText (std::string (Response::GetStatusText (503)));
+					_res.HttpCode = 503;
+					_res.Headers ["Retry-After"] = "1";
+				}
+			}
+			if (_res.HttpCode == -1) {
+				if (auto _proc = m_router.Find (_req.Method, _req.GetPath (), _req.Params)) {
+					try {
+						_res = co_await _with_trace (_req.Trace, (*_proc) (_req));
+					} catch (...) {
+					}
+				}
 			}
 			if (_res.HttpCode == -1) {
 				try {
-					_res = co_await m_unhandled_proc (_req);
+					_res = co_await _with_trace (_req.Trace, m_unhandled_proc (_req));
 				} catch (...) {
 					// 如果未处理的请求处理器也失败了，默认返回404
 					_res = Response::FromNotFound();
 				}
 			}
-			if (_req.IsUpgraded ())
+			if (_admitted)
+				m_limiter->Release (std::chrono::steady_clock::now () - _start, _res.HttpCode < 500);
+			if (_req.IsUpgraded ()) {
+				_span.End (101, _req.GetPath ());
 				break;
+			}
 			if (_res.HttpCode == -1)
 				_res = Response::FromNotFound ();
 			if (m_after)
-				co_await m_after (_req, _res);
-			std::string _str_res = _res.Serilize ();
+				co_await _with_trace (_req.Trace, m_after (_req, _res));
+			_span.Stage ("serialize");
+			bool _closing = _conns->IsDraining ();
+			if (_closing)
+				_res.Headers ["Connection"] = "close";
+			_res.SerilizeTo (_str_res);
+			_count_request (_res.HttpCode, _start);
+			if (_watchdog)
+				_watchdog->Arm (m_limits.IdleTimeout);
+			_span.Stage ("send");
 			try {
 				co_await _conn->Send (_str_res.data (), _str_res.size ());
 			} catch (...) {
+				_span.End (0, _req.GetPath ());
+				break;
+			}
+			_span.End (_res.HttpCode, _req.GetPath ());
+			if (_closing) {
+				Metrics::DrainClosedConnections.Add ();
 				break;
 			}
 		}
@@ -252,11 +748,92 @@ struct HttpServerBase {
 	}
 
 	void Stop () { m_server.Stop (); }
+	// Graceful stop: no new connections, idle keep-alives are closed at once, the next
+	// response on every other connection carries `Connection: close`, and whatever still
+	// runs at `_deadline` is cancelled. True when every connection finished in time.
+	Task<bool> Shutdown (TimeSpan _deadline = std::chrono::seconds (30)) { co_return co_await m_server.Shutdown (_deadline); }
+	bool IsDraining () const { return m_server.IsDraining (); }
 
 private:
+	// Runs user code with the request's trace current. The context is only set while that
+	// code runs, not while this connection waits on the socket and other requests run here.
+	template<typename T>
+	static Task<T> _with_trace (const TraceContext &_ctx, Task<T> _task) {
+		TraceScope _trace { _ctx };
+		co_return co_await std::move (_task);
+	}
+
+	static void _count_request (int _code, std::chrono::steady_clock::time_point _start) {
+		Metrics::HandlerLatency.Record (std::chrono::steady_clock::now () - _start);
+		Metrics::HttpRequests.Add ();
+		if (_code >= 500)
+			Metrics::HttpServerErrors.Add ();
+	}
+
+	// 429 for the first rule whose bucket is empty
+	std::optional<Response> _check_rate_limits (Request &_req) {
+		for (auto &[_rule, _limiter] : m_rate_limits) {
+			if (!_req.GetPath ().starts_with (_rule.PathPrefix))
+				continue;
+			uint64_t _key = 0;
+			if (_rule.By == RateLimitKey::RemoteIp) {
+				auto _addr = _req.GetRemoteAddress ();
+				if (_addr.is_v4 ()) {
+					auto _bytes = _addr.to_v4 ().to_bytes ();
+					_key = RateLimiter::Hash (std::string_view { (const char *) _bytes.data (), _bytes.size () });
+				} else {
+					auto _bytes = _addr.to_v6 ().to_bytes ();
+					_key = RateLimiter::Hash (std::string_view { (const char *) _bytes.data (), _bytes.size () });
+				}
+			} else if (_rule.By == RateLimitKey::Header) {
+				auto _it = _req.Headers.find (_rule.Header);
+				if (_it == _req.Headers.end ())
+					continue;
+				_key = RateLimiter::Hash (_it->second);
+			} else {
+				_key = RateLimiter::Hash (_req.GetPath ());
+			}
+			auto _wait = _limiter->TryAcquire (_key);
+			if (_wait.count () == 0)
+				continue;
+			Metrics::RateLimitedRequests.Add ();
+			Response _res = Response::FromText (std::string (Response::GetStatusText (429)));
+			_res.HttpCode = 429;
+			_res.Headers ["Retry-After"] = std::to_string (std::chrono::ceil<std::chrono::seconds> (_wait).count ());
+			return _res;
+		}
+		return std::nullopt;
+	}
+
+	// Handler chain for requests that may be answered from the microcache
+	Task<Response> _HandleCacheable (Request &_req) {
+		Response _res {};
+		if (auto _proc = m_router.Find (_req.Method, _req.GetPath (), _req.Params)) {
+			try {
+				_res = co_await (*_proc) (_req);
+			} catch (...) {
+			}
+		}
+		if (_res.HttpCode == -1) {
+			try {
+				_res = co_await m_unhandled_proc (_req);
+			} catch (...) {
+			}
+		}
+		if (_res.HttpCode == -1)
+			_res = Response::FromNotFound ();
+		if (m_after)
+			co_await m_after (_req, _res);
+		co_return _res;
+	}
+
 	ServerType m_server {};
+	ServerLimits m_limits {};
+	std::shared_ptr<AdaptiveLimiter> m_limiter;
+	std::vector<std::pair<RateLimitRule, std::shared_ptr<RateLimiter>>> m_rate_limits;
+	std::shared_ptr<MicroCache> m_microcache;
 	std::function<Task<std::optional<Response>> (Request &)> m_before;
-	std::unordered_map<std::string, std::function<Task<Response> (Request &)>> m_map_proc;
+	Router<std::function<Task<Response> (Request &)>> m_router;
 	std::function<Task<Response> (Request &)> m_unhandled_proc = [] (Request &) -> Task<Response> { co_return Response::FromNotFound (); };
 	std::function<Task<void> (Request &, Response &)> m_after;
 };
@@ -3,12 +3,20 @@
 
 
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <random>
+#include <unordered_map>
 #include <vector>
 
 #include "common.hpp"
 #include "common_funcs.hpp"
 #include "conn.hpp"
+#include "http_cache.hpp"
 #include "req_res.hpp"
 
 
@@ -18,6 +26,7 @@ template<TFormOption _Op1>
 inline void _OptionApply (Request &_r, _Op1 &_op) { throw Exception ("Unsupported dest type template instance"); }
 template<> inline void _OptionApply (Request &_r, timeout &_t) { _r.Timeout = _t.m_exp; }
 template<> inline void _OptionApply (Request &_r, server &_s) { _r.Server = _s.m_ip; }
+template<> inline void _OptionApply (Request &_r, retry &_re) { _r.Retry = _re.m_policy; }
 template<> inline void _OptionApply (Request &_r, header &_hh) { _r.Headers [_hh.m_key] = _hh.m_value; }
 template<> inline void _OptionApply (Request &_r, authorization &_auth) { _r.Headers [_auth.m_key] = _auth.m_value; }
 template<> inline void _OptionApply (Request &_r, connection &_co) { _r.Headers [_co.m_key] = _co.m_value; }
@@ -50,6 +59,174 @@ inline void _OptionApplys (Request &_r, _Op1 _op1, _Ops ..._ops) { _OptionApply
 
 
 
+// Request history per destination, shared by every session: the retry budget and the
+// recent latencies hedging derives its delay from
+struct HostStats {
+	void OnRequest () {
+		std::unique_lock _ul { m_mtx };
+		_Decay ();
+		m_requests += 1;
+	}
+
+	bool TryRetry (const RetryPolicy &_policy) {
+		std::unique_lock _ul { m_mtx };
+		_Decay ();
+		if (m_retries + 1 > m_requests * _policy.BudgetRatio + _policy.BudgetMinPerSecond * DecaySeconds)
+			return false;
+		m_retries += 1;
+		return true;
+	}
+
+	void AddLatency (TimeSpan _elapse) {
+		std::unique_lock _ul { m_mtx };
+		m_latencies [m_lat_pos] = _elapse;
+		m_lat_pos = (m_lat_pos + 1) % m_latencies.size ();
+		m_lat_count = std::min (m_lat_count + 1, m_latencies.size ());
+	}
+
+	// nullopt until enough samples were seen
+	std::optional<TimeSpan> GetLatencyQuantile (double _q) {
+		std::unique_lock _ul { m_mtx };
+		if (m_lat_count < MinSamples)
+			return std::nullopt;
+		std::vector<TimeSpan> _v (m_latencies.begin (), m_latencies.begin () + m_lat_count);
+		_ul.unlock ();
+		size_t _n = std::min ((size_t) (_q * _v.size ()), _v.size () - 1);
+		std::nth_element (_v.begin (), _v.begin () + _n, _v.end ());
+		return _v [_n];
+	}
+
+	// Locks one of ShardCount shards, so requests to different destinations rarely contend
+	static std::shared_ptr<HostStats> Get (const std::string &_key) {
+		Shard &_shard = s_shards [std::hash<std::string> {} (_key) % ShardCount];
+		auto _now = std::chrono::steady_clock::now ();
+		std::unique_lock _ul { _shard.Mtx };
+		auto _it = _shard.Items.find (_key);
+		if (_it == _shard.Items.end ()) {
+			if (_shard.Items.size () >= MaxSize / ShardCount)
+				_Prune (_shard, _now);
+			_it = _shard.Items.emplace (_key, Shard::Entry { std::make_shared<HostStats> () }).first;
+		}
+		_it->second.Used = _now;
+		return _it->second.Stats;
+	}
+
+private:
+	static constexpr double DecaySeconds = 10;
+	static constexpr size_t MinSamples = 20, MaxSize = 4096, ShardCount = 16;
+	static constexpr std::chrono::minutes IdleExpire { 5 };
+
+	// own cache line each, so threads on different shards do not contend through it
+	struct alignas (64) Shard {
+		struct Entry {
+			std::shared_ptr<HostStats> Stats;
+			std::chrono::steady_clock::time_point Used {};
+		};
+		std::mutex Mtx;
+		std::unordered_map<std::string, Entry> Items;
+	};
+
+	// Drops destinations unused for IdleExpire, then the least recently used until an
+	// eighth of the shard is free again. Stats still held by a request are kept.
+	static void _Prune (Shard &_shard, std::chrono::steady_clock::time_point _now) {
+		std::erase_if (_shard.Items, [_now] (auto &_kv) { return _kv.second.Stats.use_count () == 1 && _now - _kv.second.Used >= IdleExpire; });
+		size_t _max = MaxSize / ShardCount;
+		if (_shard.Items.size () < _max)
+			return;
+		std::vector<std::pair<std::chrono::steady_clock::time_point, std::string>> _oldest;
+		for (auto &[_key, _entry] : _shard.Items) {
+			if (_entry.Stats.use_count () == 1)
+				_oldest.emplace_back (_entry.Used, _key);
+		}
+		size_t _drop = std::min (_oldest.size (), _shard.Items.size () - _max * 7 / 8);
+		std::nth_element (_oldest.begin (), _oldest.begin () + _drop, _oldest.end ());
+		for (size_t i = 0; i < _drop; ++i)
+			_shard.Items.erase (_oldest [i].second);
+	}
+
+	// Exponentially decayed counters, so the budget tracks roughly the last DecaySeconds
+	void _Decay () {
+		auto _now = std::chrono::steady_clock::now ();
+		double _dt = std::chrono::duration<double> (_now - m_last).count ();
+		m_last = _now;
+		double _f = std::exp (-_dt / DecaySeconds);
+		m_requests *= _f;
+		m_retries *= _f;
+	}
+
+	std::mutex m_mtx;
+	double m_requests = 0, m_retries = 0;
+	std::chrono::steady_clock::time_point m_last = std::chrono::steady_clock::now ();
+	std::array<TimeSpan, 128> m_latencies {};
+	size_t m_lat_pos = 0, m_lat_count = 0;
+
+	inline static std::array<Shard, ShardCount> s_shards;
+};
+
+inline bool _is_idempotent (MethodType _method) { return _method != MethodType::Post; }
+
+// Runs `_attempt`, and once it has been outstanding longer than the hedge delay runs it
+// a second time; the first success wins. The loser keeps running detached, so
+// `_attempt` must own everything it touches.
+inline Task<Response> _hedged (std::function<Task<Response> ()> _attempt, RetryPolicy _policy, std::shared_ptr<HostStats> _stats) {
+	auto _delay = _stats->GetLatencyQuantile (_policy.HedgeQuantile);
+	if (!_delay.has_value ())
+		co_return co_await _attempt ();
+
+	struct State {
+		std::mutex Mtx;
+		std::optional<Response> Res;
+		std::exception_ptr Ex = nullptr;
+		size_t Launched = 0, Failed = 0;
+		AsyncEvent Done {};
+	};
+	auto _state = std::make_shared<State> ();
+	// caller holds State::Mtx
+	auto _launch = [_state, _attempt] () {
+		_state->Launched++;
+		asio::co_spawn (Tasks::GetContext (), [_state, _attempt] () -> Task<void> {
+			std::optional<Response> _res;
+			std::exception_ptr _ex = nullptr;
+			try {
+				_res = co_await _attempt ();
+			} catch (...) {
+				_ex = std::current_exception ();
+			}
+			std::unique_lock _ul { _state->Mtx };
+			bool _done = false;
+			if (_res.has_value ()) {
+				if (!_state->Res.has_value ()) {
+					_state->Res = std::move (_res);
+					_done = true;
+				}
+			} else {
+				_state->Ex = _ex;
+				_done = ++_state->Failed == _state->Launched;
+			}
+			_ul.unlock ();
+			if (_done)
+				_state->Done.Set ();
+		}, asio::detached);
+	};
+
+	{
+		std::unique_lock _ul { _state->Mtx };
+		_launch ();
+	}
+	if (!co_await _state->Done.Wait (std::max (_delay.value (), _policy.HedgeMinDelay))) {
+		std::unique_lock _ul { _state->Mtx };
+		if (!_state->Res.has_value () && _state->Failed < _state->Launched && _stats->TryRetry (_policy))
+			_launch ();
+	}
+	co_await _state->Done.Wait ();
+	std::unique_lock _ul { _state->Mtx };
+	if (_state->Res.has_value ())
+		co_return std::move (_state->Res.value ());
+	std::rethrow_exception (_state->Ex);
+}
+
+
+
 struct Session {
 	std::shared_ptr<IConn> Conn;
 	std::string ConnFlag = "";
@@ -61,51 +238,17 @@ struct Session {
 	bool IsConnect () { return Conn && Conn->IsConnect (); }
 
 	Task<Response> DoMethod (Request _r) {
-		LastUseTime = std::chrono::steady_clock::now ();
-		auto [_schema, _host, _port, _path] = _parse_url (_r.Url);
-		std::string _conn_flag = fmt::format ("{}://{}:{}", _schema, _host, _port);
-		if (!Conn || ConnFlag != _conn_flag) {
-			ConnFlag = _conn_flag;
-			if (_schema == "https") {
-				Conn = std::shared_ptr<IConn> (new SslConn {});
-			} else {
-				Conn = std::shared_ptr<IConn> (new TcpConn {});
-			}
-			co_await Conn->Connect (_host, _port);
+		TraceRestore _trace {};
+		if (!HttpCache::IsEnabled ())
+			co_return co_await _DoRetry (std::move (_r));
+		if (_r.Method != MethodType::Get) {
+			Request _unsafe = _r;
+			Response _res = co_await _DoRetry (std::move (_r));
+			HttpCache::OnUnsafe (_unsafe, _res);
+			co_return _res;
 		}
-
-		_r.Schema = _schema;
-		_r.UrlPath = _path;
-
-		//// cancel
-		//AsyncTimer _timer {};
-		//if (std::chrono::duration_cast<std::chrono::nanoseconds> (_r.Timeout).count () > 0) {
-		//	_timer.WaitCallback (_r.Timeout, [_tconn = std::weak_ptr (Conn)] ()->Task<void> {
-		//		auto _conn = _tconn.lock ();
-		//		if (_conn)
-		//			_conn->Cancel ();
-		//	});
-		//}
-
-		// generate data
-		std::string _data = _r.Serilize (_host, _port, _path);
-
-		// try once
-		bool _suc = true;
-		try {
-			co_await Conn->Send (_data.data (), _data.size ());
-		} catch (...) {
-			_suc = false;
-		}
-		if (_suc) {
-			co_return co_await Response::GetFromConn (Conn);
-		}
-
-		// try second
-		co_await Conn->Reconnect ();
-		co_await Conn->Send (_data.data (), _data.size ());
-		co_return co_await Response::GetFromConn (Conn);
-		//_timer.Cancel ();
+		std::function<Task<Response> (Request)> _fetch = [this] (Request _r) -> Task<Response> { co_return co_await _DoRetry (std::move (_r)); };
+		co_return co_await HttpCache::Do (std::move (_r), _fetch);
 	}
 
 	Task<Response> Head (std::string _url) {
@@ -187,6 +330,155 @@ struct Session {
 		_OptionApplys (_r, _ops...);
 		co_return co_await DoMethod (_r);
 	}
+
+private:
+	friend Task<Response> _DoPooledUncached (Request _r);
+
+	// Retry loop of DoMethod, below the response cache
+	Task<Response> _DoRetry (Request _r) {
+		LastUseTime = std::chrono::steady_clock::now ();
+		std::optional<std::chrono::steady_clock::time_point> _expire;
+		if (_r.Timeout.count () > 0)
+			_expire = LastUseTime + _r.Timeout;
+		auto [_schema, _host, _port, _path] = _parse_url (_r.Url);
+		auto _stats = HostStats::Get (fmt::format ("{}://{}:{}", _schema, _host, _port));
+		_stats->OnRequest ();
+		Metrics::ClientRequests.Add ();
+		bool _can_retry = _is_idempotent (_r.Method) || _r.Retry.RetryNonIdempotent;
+		for (size_t _retry = 0; ; ++_retry) {
+			auto _start = std::chrono::steady_clock::now ();
+			Response _res {};
+			std::exception_ptr _ex = nullptr;
+			// one span per attempt, its id goes out as the traceparent parent
+			StagedSpan _span {};
+			if (Tracing::IsEnabled ()) {
+				_span.Start ("http.client", _r.Trace, "send", _start);
+				_r.Headers ["traceparent"] = _span.Context ().ToTraceparent ();
+			}
+			try {
+				_res = co_await _DoOnce (_r, _expire, _span);
+			} catch (...) {
+				_ex = std::current_exception ();
+			}
+			_span.End (_ex ? 0 : _res.HttpCode, _r.Url);
+			bool _failed = _ex || _res.HttpCode == 502 || _res.HttpCode == 503 || _res.HttpCode == 504;
+			if (!_ex)
+				_stats->AddLatency (std::chrono::duration_cast<TimeSpan> (std::chrono::steady_clock::now () - _start));
+			if (!_failed || !_can_retry || _retry >= _r.Retry.MaxRetries || !_stats->TryRetry (_r.Retry)) {
+				Metrics::ClientLatency.Record (std::chrono::steady_clock::now () - LastUseTime);
+				if (_ex) {
+					Metrics::ClientErrors.Add ();
+					std::rethrow_exception (_ex);
+				}
+				co_return _res;
+			}
+
+			// full jitter backoff, never sleeping past the request deadline
+			TimeSpan _cap = std::min (_r.Retry.BackoffMax, _r.Retry.BackoffBase * (int64_t) (1ull << std::min<size_t> (_retry, 20)));
+			thread_local std::mt19937_64 s_rng { std::random_device {} () };
+			TimeSpan _backoff { _cap.count () > 0 ? (TimeSpan::rep) (s_rng () % (uint64_t) _cap.count ()) : 0 };
+			if (_expire.has_value () && std::chrono::steady_clock::now () + _backoff >= _expire.value ()) {
+				Metrics::ClientLatency.Record (std::chrono::steady_clock::now () - LastUseTime);
+				if (_ex) {
+					Metrics::ClientErrors.Add ();
+					std::rethrow_exception (_ex);
+				}
+				co_return _res;
+			}
+			if (_backoff.count () > 0)
+				co_await Tasks::Delay (_backoff);
+		}
+	}
+
+	// One exchange. A send failure on a pooled connection means the peer closed it before
+	// the request could be written, so reconnecting and sending again is safe for any method.
+	Task<Response> _DoOnce (Request &_r, std::optional<std::chrono::steady_clock::time_point> _expire, StagedSpan &_span) {
+		auto [_schema, _host, _port, _path] = _parse_url (_r.Url);
+		std::string _conn_flag = fmt::format ("{}://{}:{}", _schema, _host, _port);
+		if (!Conn || ConnFlag != _conn_flag) {
+			ConnFlag = _conn_flag;
+			if (_schema == "https") {
+				Conn = std::shared_ptr<IConn> (new SslConn {});
+			} else {
+				Conn = std::shared_ptr<IConn> (new TcpConn {});
+			}
+			Conn->ConnectTimeout = _GetConnectTimeout (_expire);
+			co_await Conn->Connect (_host, _port);
+			_TraceConnect (_span);
+		}
+
+		_r.Schema = _schema;
+		_r.UrlPath = _path;
+
+		// generate data
+		std::string _data = _r.Serilize (_host, _port, _path);
+
+		// a fired deadline closes the connection, so the pending send/recv fails and the
+		// session reconnects on next use
+		Deadline _deadline { _GetRemaining (_expire), [_conn = Conn] () { _conn->Cancel (); } };
+		try {
+			// try once
+			bool _suc = true;
+			try {
+				co_await Conn->Send (_data.data (), _data.size ());
+			} catch (...) {
+				_suc = false;
+			}
+
+			// try second
+			if (!_suc) {
+				if (_deadline.IsExpired ())
+					throw Exception ("Request timeout");
+				_deadline.Cancel ();
+				Conn->ConnectTimeout = _GetConnectTimeout (_expire);
+				co_await Conn->Reconnect ();
+				_TraceConnect (_span);
+				_deadline.Reset (_GetRemaining (_expire));
+				co_await Conn->Send (_data.data (), _data.size ());
+			}
+			if (_span.IsStarted ()) {
+				_span.Stage ("ttfb");
+				if (Conn->GetBuffered () == 0)
+					co_await Conn->Fill (1);
+				_span.Stage ("recv");
+			}
+			co_return co_await Response::GetFromConn (Conn);
+		} catch (...) {
+			if (_deadline.IsExpired ())
+				throw Exception ("Request timeout");
+			throw;
+		}
+	}
+
+	// dns, connect and tls spans of the connection just made, below the request span
+	void _TraceConnect (StagedSpan &_span) {
+		if (!_span.IsStarted ())
+			return;
+		auto &_t = Conn->LastConnect;
+		uint64_t _parent = _span.Context ().SpanId;
+		Tracing::Record ("dns", Tracing::NewSpan (_span.Context ()), _parent, _t.Start, _t.Resolved, 1, ConnFlag);
+		Tracing::Record ("connect", Tracing::NewSpan (_span.Context ()), _parent, _t.Resolved, _t.Connected, 1, ConnFlag);
+		if (_t.Secured != _t.Connected)
+			Tracing::Record ("tls", Tracing::NewSpan (_span.Context ()), _parent, _t.Connected, _t.Secured, 1, ConnFlag);
+	}
+
+	static TimeSpan _GetRemaining (std::optional<std::chrono::steady_clock::time_point> _expire) {
+		if (!_expire.has_value ())
+			return TimeSpan::zero ();
+		auto _remaining = std::chrono::duration_cast<TimeSpan> (_expire.value () - std::chrono::steady_clock::now ());
+		if (_remaining.count () <= 0)
+			throw Exception ("Request timeout");
+		return _remaining;
+	}
+
+	static TimeSpan _GetConnectTimeout (std::optional<std::chrono::steady_clock::time_point> _expire) {
+		if (!_expire.has_value ())
+			return Config::ConnectTimeout;
+		TimeSpan _remaining = _GetRemaining (_expire);
+		if (Config::ConnectTimeout.count () > 0 && Config::ConnectTimeout < _remaining)
+			return Config::ConnectTimeout;
+		return _remaining;
+	}
 };
 
 
@@ -204,6 +496,7 @@ struct SessionPool {
 			if (!_v.empty ()) {
 				Session _sess = _v [0];
 				_v.erase (_v.begin ());
+				Metrics::SessionPoolHits.Add ();
 				return _sess;
 			}
 		} else {
@@ -211,6 +504,7 @@ struct SessionPool {
 		}
 
 		_ul.unlock ();
+		Metrics::SessionPoolMisses.Add ();
 		return Session {};
 	}
 
@@ -234,104 +528,118 @@ struct SessionPool {
 
 
 
-inline Task<Response> Head (std::string _url) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Head (_url);
+inline Task<Response> _DoPooledUncached (Request _r) {
+	if (_r.Retry.Hedge && _is_idempotent (_r.Method)) {
+		auto [_schema, _host, _port, _path] = _parse_url (_r.Url);
+		auto _stats = HostStats::Get (fmt::format ("{}://{}:{}", _schema, _host, _port));
+		std::function<Task<Response> ()> _attempt = [_r] () -> Task<Response> {
+			Session _sess = SessionPool::GetSession (_r.Url);
+			Response _ret = co_await _sess._DoRetry (_r);
+			SessionPool::FreeSession (_sess);
+			co_return _ret;
+		};
+		co_return co_await _hedged (_attempt, _r.Retry, _stats);
+	}
+	Session _sess = SessionPool::GetSession (_r.Url);
+	Response _ret = co_await _sess._DoRetry (_r);
 	SessionPool::FreeSession (_sess);
 	co_return _ret;
 }
+
+// Runs `_r` on a pooled session, hedged when the retry policy asks for it. The response
+// cache sits above hedging, so a hedged copy never waits for its own twin's cache miss.
+inline Task<Response> _DoPooled (Request _r) {
+	TraceRestore _trace {};
+	if (!HttpCache::IsEnabled ())
+		co_return co_await _DoPooledUncached (std::move (_r));
+	if (_r.Method != MethodType::Get) {
+		Request _unsafe = _r;
+		Response _res = co_await _DoPooledUncached (std::move (_r));
+		HttpCache::OnUnsafe (_unsafe, _res);
+		co_return _res;
+	}
+	std::function<Task<Response> (Request)> _fetch = [] (Request _r) -> Task<Response> { co_return co_await _DoPooledUncached (std::move (_r)); };
+	co_return co_await HttpCache::Do (std::move (_r), _fetch);
+}
+
+inline Task<Response> Head (std::string _url) {
+	co_return co_await _DoPooled (Request { _url, MethodType::Head });
+}
 template<TOption ..._Ops>
 inline Task<Response> Head (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Head (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Head };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 
 inline Task<Response> Option (std::string _url) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Option (_url);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	co_return co_await _DoPooled (Request { _url, MethodType::Option });
 }
 template<TOption ..._Ops>
 inline Task<Response> Option (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Option (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Option };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 
 inline Task<Response> Get (std::string _url) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Get (_url);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	co_return co_await _DoPooled (Request { _url, MethodType::Get });
 }
 template<TOption ..._Ops>
 inline Task<Response> Get (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Get (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Get };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 
 template<TFormOption ..._Ops>
 inline Task<Response> Post (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Post (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Post };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 template<TBodyOption _Body>
 inline Task<Response> Post (std::string _url, _Body _body) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Post (_url, std::forward<_Body> (_body));
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Post };
+	_OptionApplyBody (_r, _body);
+	co_return co_await _DoPooled (_r);
 }
 template<TBodyOption _Body, TOption ..._Ops>
 inline Task<Response> Post (std::string _url, _Body _body, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Post (_url, std::forward<_Body> (_body), std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Post };
+	_OptionApplyBody (_r, _body);
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 
 template<TFormOption ..._Ops>
 inline Task<Response> Put (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Put (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Put };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 template<TBodyOption _Body>
 inline Task<Response> Put (std::string _url, _Body _body) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Put (_url, std::forward<_Body> (_body));
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Put };
+	_OptionApplyBody (_r, _body);
+	co_return co_await _DoPooled (_r);
 }
 template<TBodyOption _Body, TOption ..._Ops>
 inline Task<Response> Put (std::string _url, _Body _body, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Put (_url, std::forward<_Body> (_body), std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Put };
+	_OptionApplyBody (_r, _body);
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 
 inline Task<Response> Delete (std::string _url) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Delete (_url);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	co_return co_await _DoPooled (Request { _url, MethodType::Delete });
 }
 template<TOption ..._Ops>
 inline Task<Response> Delete (std::string _url, _Ops ..._ops) {
-	Session _sess = SessionPool::GetSession (_url);
-	Response _ret = co_await _sess.Delete (_url, std::forward<_Ops> (_ops)...);
-	SessionPool::FreeSession (_sess);
-	co_return _ret;
+	Request _r { _url, MethodType::Delete };
+	_OptionApplys (_r, _ops...);
+	co_return co_await _DoPooled (_r);
 }
 }
 
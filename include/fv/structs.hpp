@@ -16,6 +16,83 @@
 namespace fv {
 enum class MethodType { Head, Option, Get, Post, Put, Delete };
 enum class WsType { Continue = 0, Text = 1, Binary = 2, Close = 8, Ping = 9, Pong = 10 };
+enum class WritePolicy { Wait, Drop };
+enum class LoadBalance { PowerOfTwoChoices, LeastOutstanding };
+enum class RateLimitKey { RemoteIp, Header, Path };
+enum class SlowConsumer { Drop, Disconnect, Coalesce };
+
+
+
+struct BroadcastResult {
+	// Coalesced: held back by SlowConsumer::Coalesce, sent unless a newer message replaces it
+	size_t Delivered = 0, Dropped = 0, Coalesced = 0;
+};
+
+
+
+struct WriteQueueStats {
+	size_t QueuedBytes = 0, QueuedCount = 0;
+	uint64_t WrittenBytes = 0, WriteCount = 0, DroppedCount = 0;
+};
+
+
+
+// Client retry and hedging. Retries apply to connection errors and 502/503/504 answers,
+// POST only with RetryNonIdempotent. Retries and hedges together may add at most
+// BudgetRatio of the recent request rate to a host, plus BudgetMinPerSecond.
+struct RetryPolicy {
+	size_t MaxRetries = 0;
+	bool RetryNonIdempotent = false;
+	// Full jitter: the n-th retry sleeps a random time in [0, min (BackoffMax, BackoffBase * 2^n))
+	TimeSpan BackoffBase = std::chrono::milliseconds (50), BackoffMax = std::chrono::seconds (1);
+	double BudgetRatio = 0.1;
+	size_t BudgetMinPerSecond = 10;
+	// Idempotent requests sent through the session pool get a second copy on another
+	// connection once they are slower than HedgeQuantile of the recent latency to the host
+	bool Hedge = false;
+	double HedgeQuantile = 0.95;
+	TimeSpan HedgeMinDelay = std::chrono::milliseconds (10);
+};
+
+// Per server protection against slow or oversized clients; 0 disables a limit. A
+// connection that times out is closed, oversized requests get 431 or 413.
+struct ServerLimits {
+	// Further connections wait in the listen backlog until one closes
+	size_t MaxConnections = 0;
+	// Request line plus headers, and Content-Length
+	size_t MaxHeaderBytes = 64 * 1024, MaxBodyBytes = 8 * 1024 * 1024;
+	// From the first byte of a request to the end of its headers, for each 64KB of the body,
+	// and between keep-alive requests
+	TimeSpan HeaderTimeout = std::chrono::seconds (30), BodyTimeout = std::chrono::seconds (30), IdleTimeout = std::chrono::minutes (2);
+};
+
+// Token bucket per key: Rate requests per second on average, Burst at once. Requests
+// over it are answered with 429 and Retry-After before OnBefore runs.
+struct RateLimitRule {
+	RateLimitKey By = RateLimitKey::RemoteIp;
+	// Request header to key by; requests without it are not limited
+	std::string Header = "";
+	// Only paths starting with this are limited
+	std::string PathPrefix = "";
+	double Rate = 10, Burst = 20;
+	// Buckets kept at once, the coldest is evicted past it
+	size_t MaxKeys = 65536;
+};
+
+
+
+// RFC 7692 permessage-deflate. Every connection keeps its own zlib streams; with context
+// takeover a compressor costs about (1 << (MaxWindowBits + 2)) + (1 << (MemLevel + 9)) bytes.
+struct WsDeflateOptions {
+	bool Enable = false;
+	// Messages below this many bytes are sent uncompressed
+	size_t MinSize = 256;
+	int Level = 6, MemLevel = 8;
+	// Restart the compressor of that side after every message: less memory, worse ratio
+	bool ServerNoContextTakeover = false, ClientNoContextTakeover = false;
+	// LZ77 window of each side's compressor, 9 to 15
+	int ServerMaxWindowBits = 15, ClientMaxWindowBits = 15;
+};
 
 
 
@@ -23,14 +100,26 @@ struct Config {
 	inline static SslCheckCb SslVerifyFunc = [] (bool preverified, Ssl::verify_context &ctx) { return true; };
 	inline static TimeSpan ConnectTimeout = std::chrono::seconds (2);
 	inline static bool NoDelay = false;
+	// Ping after this long without a frame from the peer, close when the pong is missing for
+	// WebsocketPongTimeout; close after WebsocketIdleTimeout without a message. <= 0 disables each.
+	// Frames are only seen by Recv, so the timeouts are opt-in: a push-only server never reads.
 	inline static TimeSpan WebsocketAutoPing = std::chrono::minutes (1);
+	inline static TimeSpan WebsocketPongTimeout = TimeSpan::zero (), WebsocketIdleTimeout = TimeSpan::zero ();
+	// Larger received messages, compressed ones counted after inflating, close the connection
+	// with 1009; 0 means unlimited
+	inline static size_t WebsocketMaxMessageSize = 64 * 1024 * 1024;
+	// Offered by ConnectWS and accepted by Request::UpgradeWebsocket
+	inline static WsDeflateOptions WebsocketDeflate {};
 	inline static TimeSpan SessionPoolTimeout = std::chrono::minutes (1);
+	inline static RetryPolicy Retry {};
+	inline static size_t WriteQueueHighWatermark = 4 * 1024 * 1024, WriteQueueLowWatermark = 1024 * 1024;
+	inline static size_t UdpBatchSize = 64, UdpDatagramSize = 65536;
 	inline static Ssl::context::method SslClientVer = Ssl::context::tls, SslServerVer = Ssl::context::tls;
-	inline static std::function<Task<std::string> (std::string)> DnsResolve = [] (std::string _host) -> Task<std::string> {
-		Tcp::resolver _resolver { Tasks::GetContext () };
-		auto _it = co_await _resolver.async_resolve (_host, "", UseAwaitable);
-		co_return _it.begin ()->endpoint ().address ().to_string ();
-	};
+	// Optional, replaces the built-in DnsCache lookup
+	inline static std::function<Task<std::string> (std::string)> DnsResolve;
+	inline static TimeSpan DnsCacheTtl = std::chrono::minutes (1), DnsNegativeTtl = std::chrono::seconds (5);
+	// Delay before racing the next address of a host (RFC 8305)
+	inline static TimeSpan HappyEyeballsDelay = std::chrono::milliseconds (250);
 	inline static std::function<Task<std::string> ()> BindClientIP;
 };
 
@@ -38,6 +127,7 @@ struct Config {
 
 struct timeout { TimeSpan m_exp; timeout (TimeSpan _exp): m_exp (_exp) {} };
 struct server { std::string m_ip; server (std::string _ip): m_ip (_ip) {} };
+struct retry { RetryPolicy m_policy; retry (RetryPolicy _policy): m_policy (_policy) {} };
 struct header {
 	std::string m_key, m_value;
 	header (std::string _key, std::string _value): m_key (_key), m_value (_value) {}
@@ -75,12 +165,12 @@ struct body_raw {
 	body_raw (std::string _content_type, std::string _content): ContentType (_content_type), Content (_content) {}
 };
 template<typename T>
-concept TOption = std::is_same<T, timeout>::value || std::is_same<T, server>::value ||
+concept TOption = std::is_same<T, timeout>::value || std::is_same<T, server>::value || std::is_same<T, retry>::value ||
 std::is_same<T, header>::value || std::is_same<T, authorization>::value || std::is_same<T, connection>::value ||
 std::is_same<T, content_type>::value || std::is_same<T, referer>::value || std::is_same<T, user_agent>::value ||
 std::is_same<T, url_kv>::value;
 template<typename T>
-concept TFormOption = std::is_same<T, timeout>::value || std::is_same<T, server>::value ||
+concept TFormOption = std::is_same<T, timeout>::value || std::is_same<T, server>::value || std::is_same<T, retry>::value ||
 std::is_same<T, header>::value || std::is_same<T, authorization>::value || std::is_same<T, connection>::value ||
 std::is_same<T, content_type>::value || std::is_same<T, referer>::value || std::is_same<T, user_agent>::value ||
 std::is_same<T, url_kv>::value || std::is_same<T, body_kv>::value || std::is_same<T, body_file>::value ||
@@ -0,0 +1,186 @@
+#ifndef __FV_TIMER_WHEEL_HPP__
+#define __FV_TIMER_WHEEL_HPP__
+
+
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include "declare.hpp"
+
+
+
+namespace fv {
+// Hierarchical timer wheel, one per io_context, for timeouts that are set far more often
+// than they fire: 4 levels of 64 slots with a 20ms tick cover about 93 hours, longer
+// delays fire at that bound. Schedule and Cancel unlink from an intrusive list in O(1),
+// and the whole wheel waits on a single steady_timer that only runs while timers exist.
+//
+// Not thread safe: Get and every Timer operation must run on a thread of that context.
+class TimerWheel: public asio::execution_context::service {
+public:
+	static constexpr std::chrono::milliseconds Tick { 20 };
+	inline static asio::execution_context::id id;
+
+private:
+	struct _Link {
+		_Link *m_prev = this, *m_next = this;
+	};
+
+public:
+	class Timer: _Link {
+	public:
+		Timer (std::function<void ()> _callback): m_callback (std::move (_callback)) {}
+		bool IsPending () const { return !!m_self; }
+
+	private:
+		friend class TimerWheel;
+		std::function<void ()> m_callback;
+		uint64_t m_expire = 0;
+		// keeps the timer alive while it is linked into a slot
+		std::shared_ptr<Timer> m_self;
+	};
+
+	explicit TimerWheel (asio::execution_context &_ctx): asio::execution_context::service (_ctx) {}
+
+	static TimerWheel &Get (asio::any_io_executor _executor) {
+		auto &_wheel = asio::use_service<TimerWheel> (asio::query (_executor, asio::execution::context));
+		if (!_wheel.m_timer)
+			_wheel.m_timer.emplace (_executor);
+		return _wheel;
+	}
+
+	std::shared_ptr<Timer> Schedule (TimeSpan _delay, std::function<void ()> _callback) {
+		auto _timer = std::make_shared<Timer> (std::move (_callback));
+		Reschedule (_timer, _delay);
+		return _timer;
+	}
+
+	// Moves a pending timer, or arms one that already fired or was cancelled
+	void Reschedule (const std::shared_ptr<Timer> &_timer, TimeSpan _delay) {
+		if (_timer->m_self)
+			_unlink (_timer.get ());
+		uint64_t _ticks = (uint64_t) std::max<int64_t> (1, (std::chrono::duration_cast<std::chrono::milliseconds> (_delay) + Tick - std::chrono::milliseconds (1)) / Tick);
+		_timer->m_expire = m_now + std::min (_ticks, MaxTicks);
+		_timer->m_self = _timer;
+		_insert (_timer.get ());
+		m_count++;
+		_arm ();
+	}
+
+	void Cancel (const std::shared_ptr<Timer> &_timer) {
+		if (_timer && _timer->m_self)
+			_unlink (_timer.get ());
+	}
+
+	size_t Size () const { return m_count; }
+
+	void shutdown () override {
+		m_timer.reset ();
+		for (auto &_level : m_slots) {
+			for (auto &_slot : _level) {
+				while (_slot.m_next != &_slot)
+					_unlink (static_cast<Timer *> (_slot.m_next));
+			}
+		}
+	}
+
+private:
+	static constexpr size_t LevelBits = 6, SlotCount = 1 << LevelBits, LevelCount = 4;
+	static constexpr uint64_t MaxTicks = (1ull << (LevelBits * LevelCount)) - 1;
+
+	// A timer goes to the lowest level whose span covers its distance from now; higher
+	// levels are cascaded down whenever the level below wraps
+	void _insert (Timer *_timer) {
+		uint64_t _delta = _timer->m_expire - m_now;
+		size_t _level = 0;
+		while (_level + 1 < LevelCount && _delta >= (1ull << (LevelBits * (_level + 1))))
+			++_level;
+		_Link &_slot = m_slots [_level] [(_timer->m_expire >> (LevelBits * _level)) & (SlotCount - 1)];
+		_timer->m_prev = _slot.m_prev;
+		_timer->m_next = &_slot;
+		_slot.m_prev->m_next = _timer;
+		_slot.m_prev = _timer;
+	}
+
+	// The timer may be released here, callers must not touch it afterwards unless they own a reference
+	void _unlink (Timer *_timer) {
+		_timer->m_prev->m_next = _timer->m_next;
+		_timer->m_next->m_prev = _timer->m_prev;
+		_timer->m_prev = _timer->m_next = _timer;
+		m_count--;
+		_timer->m_self = nullptr;
+	}
+
+	void _arm () {
+		if (m_running || m_count == 0 || !m_timer)
+			return;
+		m_running = true;
+		if (m_count == 1 && !m_started) {
+			m_started = true;
+			m_origin = std::chrono::steady_clock::now () - (int64_t) m_now * Tick;
+		}
+		m_timer->expires_at (m_origin + (int64_t) (m_now + 1) * Tick);
+		m_timer->async_wait ([this] (const ErrorCode &_ec) {
+			m_running = false;
+			if (_ec)
+				return;
+			uint64_t _target = (uint64_t) ((std::chrono::steady_clock::now () - m_origin) / Tick);
+			while (m_now < _target && m_count > 0)
+				_step ();
+			if (m_count == 0) {
+				// an empty wheel stops ticking and resynchronizes on the next Schedule
+				m_started = false;
+			} else {
+				_arm ();
+			}
+		});
+	}
+
+	void _step () {
+		++m_now;
+		for (size_t _level = 1; _level < LevelCount && (m_now & ((1ull << (LevelBits * _level)) - 1)) == 0; ++_level) {
+			_Link _pending;
+			_splice (m_slots [_level] [(m_now >> (LevelBits * _level)) & (SlotCount - 1)], _pending);
+			while (_pending.m_next != &_pending) {
+				Timer *_timer = static_cast<Timer *> (_pending.m_next);
+				_timer->m_prev->m_next = _timer->m_next;
+				_timer->m_next->m_prev = _timer->m_prev;
+				_insert (_timer);
+			}
+		}
+		_Link _due;
+		_splice (m_slots [0] [m_now & (SlotCount - 1)], _due);
+		// callbacks may schedule or cancel any timer, the one being run included
+		while (_due.m_next != &_due) {
+			std::shared_ptr<Timer> _timer = static_cast<Timer *> (_due.m_next)->m_self;
+			_unlink (_timer.get ());
+			if (_timer->m_callback)
+				_timer->m_callback ();
+		}
+	}
+
+	static void _splice (_Link &_from, _Link &_to) {
+		if (_from.m_next == &_from)
+			return;
+		_to.m_next = _from.m_next;
+		_to.m_prev = _from.m_prev;
+		_to.m_next->m_prev = &_to;
+		_to.m_prev->m_next = &_to;
+		_from.m_prev = _from.m_next = &_from;
+	}
+
+	_Link m_slots [LevelCount] [SlotCount];
+	std::optional<asio::steady_timer> m_timer;
+	std::chrono::steady_clock::time_point m_origin {};
+	uint64_t m_now = 0;
+	size_t m_count = 0;
+	bool m_running = false, m_started = false;
+};
+}
+
+
+
+#endif //__FV_TIMER_WHEEL_HPP__
@@ -0,0 +1,270 @@
+#ifndef __FV_TRACING_HPP__
+#define __FV_TRACING_HPP__
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "declare.hpp"
+
+
+
+namespace fv {
+// W3C trace context, https://www.w3.org/TR/trace-context/
+struct TraceContext {
+	uint64_t TraceHi = 0, TraceLo = 0, SpanId = 0;
+	bool Sampled = false;
+
+	bool IsValid () const { return (TraceHi | TraceLo) != 0 && SpanId != 0; }
+	std::string TraceId () const { return fmt::format ("{:016x}{:016x}", TraceHi, TraceLo); }
+	std::string ToTraceparent () const { return fmt::format ("00-{:016x}{:016x}-{:016x}-{:02x}", TraceHi, TraceLo, SpanId, Sampled ? 1 : 0); }
+
+	// nullopt for a missing or malformed header
+	static std::optional<TraceContext> FromTraceparent (std::string_view _header) {
+		if (_header.size () < 55 || _header [2] != '-' || _header [35] != '-' || _header [52] != '-')
+			return std::nullopt;
+		if (_header.substr (0, 2) == "ff" || (_header.size () > 55 && (_header.substr (0, 2) == "00" || _header [55] != '-')))
+			return std::nullopt;
+		TraceContext _ctx {};
+		uint8_t _version = 0, _flags = 0;
+		if (!_parse_hex (_header.substr (0, 2), _version) || !_parse_hex (_header.substr (3, 16), _ctx.TraceHi) || !_parse_hex (_header.substr (19, 16), _ctx.TraceLo)
+			|| !_parse_hex (_header.substr (36, 16), _ctx.SpanId) || !_parse_hex (_header.substr (53, 2), _flags))
+			return std::nullopt;
+		if (!_ctx.IsValid ())
+			return std::nullopt;
+		_ctx.Sampled = (_flags & 1) != 0;
+		return _ctx;
+	}
+
+private:
+	template<typename T>
+	static bool _parse_hex (std::string_view _s, T &_val) {
+		for (char _ch : _s) {
+			if (!((_ch >= '0' && _ch <= '9') || (_ch >= 'a' && _ch <= 'f')))
+				return false;
+		}
+		return std::from_chars (_s.data (), _s.data () + _s.size (), _val, 16).ec == std::errc {};
+	}
+};
+
+
+
+// One finished span. Trivially copyable, so the ring buffer can copy it without locks;
+// Name must be a string literal and Detail is truncated.
+struct Span {
+	const char *Name = "";
+	TraceContext Context {};
+	uint64_t ParentId = 0;
+	std::chrono::system_clock::time_point Start {};
+	std::chrono::nanoseconds Duration {};
+	// http code for request spans and their last stage, otherwise 1; 0 when it failed
+	int Status = 0;
+	char Detail [64] = {};
+
+	std::string_view GetDetail () const { return std::string_view { Detail, ::strnlen (Detail, sizeof (Detail)) }; }
+};
+
+// Fixed size ring that keeps the latest spans. Writers pick a slot with one fetch_add and
+// own it while its sequence is odd (a seqlock), readers skip slots being written. A writer
+// whose slot is still held by one that lapped the ring drops its span instead of tearing it.
+class SpanRing {
+public:
+	SpanRing (size_t _capacity): m_slots (std::max<size_t> (_capacity, 1)) {}
+
+	void Push (const Span &_span) {
+		uint64_t _pos = m_head.fetch_add (1, std::memory_order_relaxed);
+		Slot &_slot = m_slots [_pos % m_slots.size ()];
+		uint64_t _seq = _slot.Seq.load (std::memory_order_relaxed);
+		if (_seq % 2 == 1 || !_slot.Seq.compare_exchange_strong (_seq, _seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+			return;
+		std::atomic_thread_fence (std::memory_order_release);
+		_slot.Item = _span;
+		_slot.Seq.store (_seq + 2, std::memory_order_release);
+	}
+
+	// Oldest first
+	std::vector<Span> Snapshot () const {
+		std::vector<Span> _ret;
+		_ret.reserve (m_slots.size ());
+		for (auto &_slot : m_slots) {
+			uint64_t _seq = _slot.Seq.load (std::memory_order_acquire);
+			if (_seq == 0 || _seq % 2 == 1)
+				continue;
+			Span _span = _slot.Item;
+			std::atomic_thread_fence (std::memory_order_acquire);
+			if (_slot.Seq.load (std::memory_order_relaxed) == _seq)
+				_ret.push_back (_span);
+		}
+		std::sort (_ret.begin (), _ret.end (), [] (const Span &_a, const Span &_b) { return _a.Start < _b.Start; });
+		return _ret;
+	}
+
+private:
+	struct Slot {
+		std::atomic_uint64_t Seq { 0 };
+		Span Item {};
+	};
+	std::vector<Slot> m_slots;
+	alignas (64) std::atomic_uint64_t m_head { 0 };
+};
+
+
+
+// Tracing is off until Enable. Finished spans go to the exporter, or to the in-memory
+// ring when none is set. The current trace context is thread local: the server sets it
+// around every handler and the library's awaitables put it back when they resume, so
+// requests made inside a handler inherit it.
+struct Tracing {
+	// `_sample_ratio` applies to new traces, an incoming traceparent keeps its own flag.
+	// The ring is sized by the first call.
+	static void Enable (double _sample_ratio = 1.0, size_t _ring_capacity = 4096) {
+		if (!m_ring)
+			m_ring = std::make_unique<SpanRing> (_ring_capacity);
+		m_sample_ratio = _sample_ratio;
+		m_enabled.store (true, std::memory_order_release);
+	}
+	static void Disable () { m_enabled.store (false, std::memory_order_release); }
+	static bool IsEnabled () { return m_enabled.load (std::memory_order_relaxed); }
+
+	// Called on the thread that ends the span, so it should hand the span off quickly.
+	// Set it before serving traffic; nullptr goes back to the ring.
+	static void SetExporter (std::function<void (const Span &)> _exporter) { m_exporter = std::move (_exporter); }
+	// Latest spans kept by the ring, oldest first
+	static std::vector<Span> Recent () { return m_ring ? m_ring->Snapshot () : std::vector<Span> {}; }
+
+	static const TraceContext &Current () { return t_current; }
+	static void SetCurrent (const TraceContext &_ctx) { t_current = _ctx; }
+
+	// Context of a new span below `_parent`, or of a new trace when `_parent` is invalid
+	static TraceContext NewSpan (const TraceContext &_parent) {
+		thread_local std::mt19937_64 s_rng { std::random_device {} () };
+		TraceContext _ctx = _parent;
+		if (!_parent.IsValid ()) {
+			_ctx.TraceHi = s_rng ();
+			_ctx.TraceLo = s_rng () | 1;
+			_ctx.Sampled = std::uniform_real_distribution<double> (0, 1) (s_rng) < m_sample_ratio;
+		}
+		_ctx.SpanId = s_rng () | 1;
+		return _ctx;
+	}
+
+	static void Record (const char *_name, const TraceContext &_ctx, uint64_t _parent_id, std::chrono::steady_clock::time_point _start, std::chrono::steady_clock::time_point _end, int _status = 0, std::string_view _detail = {}) {
+		if (!_ctx.Sampled)
+			return;
+		Span _span {};
+		_span.Name = _name;
+		_span.Context = _ctx;
+		_span.ParentId = _parent_id;
+		_span.Start = std::chrono::system_clock::now () - std::chrono::duration_cast<std::chrono::system_clock::duration> (std::chrono::steady_clock::now () - _start);
+		_span.Duration = _end - _start;
+		_span.Status = _status;
+		::memcpy (_span.Detail, _detail.data (), std::min (_detail.size (), sizeof (_span.Detail) - 1));
+		if (m_exporter) {
+			m_exporter (_span);
+		} else if (m_ring) {
+			m_ring->Push (_span);
+		}
+	}
+
+private:
+	inline static std::atomic_bool m_enabled { false };
+	inline static double m_sample_ratio = 1.0;
+	inline static std::unique_ptr<SpanRing> m_ring;
+	inline static std::function<void (const Span &)> m_exporter;
+	inline static thread_local TraceContext t_current {};
+};
+
+
+
+// A span that is being timed; End records it
+class SpanTimer {
+public:
+	void Start (const char *_name, const TraceContext &_parent, std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now ()) {
+		m_name = _name;
+		m_parent_id = _parent.IsValid () ? _parent.SpanId : 0;
+		m_ctx = Tracing::NewSpan (_parent);
+		m_start = _start;
+	}
+	void End (int _status = 1, std::string_view _detail = {}) {
+		if (m_name)
+			Tracing::Record (m_name, m_ctx, m_parent_id, m_start, std::chrono::steady_clock::now (), _status, _detail);
+		m_name = nullptr;
+	}
+	bool IsStarted () const { return m_name != nullptr; }
+	const TraceContext &Context () const { return m_ctx; }
+
+private:
+	const char *m_name = nullptr;
+	uint64_t m_parent_id = 0;
+	TraceContext m_ctx {};
+	std::chrono::steady_clock::time_point m_start {};
+};
+
+// A span split into consecutive child stages, such as parse, handler and send
+class StagedSpan {
+public:
+	void Start (const char *_name, const TraceContext &_parent, const char *_first_stage, std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now ()) {
+		m_root.Start (_name, _parent, _start);
+		m_stage.Start (_first_stage, m_root.Context (), _start);
+	}
+	// Ends the running stage and starts the next one
+	void Stage (const char *_name) {
+		if (!m_root.IsStarted ())
+			return;
+		auto _now = std::chrono::steady_clock::now ();
+		m_stage.End (1);
+		m_stage.Start (_name, m_root.Context (), _now);
+	}
+	void End (int _status, std::string_view _detail = {}) {
+		if (!m_root.IsStarted ())
+			return;
+		m_stage.End (_status);
+		m_root.End (_status, _detail);
+	}
+	bool IsStarted () const { return m_root.IsStarted (); }
+	const TraceContext &Context () const { return m_root.Context (); }
+
+private:
+	SpanTimer m_root, m_stage;
+};
+
+// Makes `_ctx` current for the lifetime of the scope, as the server does around a handler
+class TraceScope {
+public:
+	TraceScope (const TraceContext &_ctx) { Tracing::SetCurrent (_ctx); }
+	~TraceScope () { Tracing::SetCurrent (TraceContext {}); }
+	TraceScope (const TraceScope &) = delete;
+	TraceScope &operator= (const TraceScope &) = delete;
+};
+
+// Takes the caller's trace context off the thread while an awaitable is suspended, so
+// coroutines resumed meanwhile do not see it, and puts it back when the awaitable finishes,
+// which may be on another thread or after other requests ran on this one
+class TraceRestore {
+public:
+	TraceRestore (): m_ctx (Tracing::Current ()) { Tracing::SetCurrent (TraceContext {}); }
+	~TraceRestore () { Tracing::SetCurrent (m_ctx); }
+	TraceRestore (const TraceRestore &) = delete;
+	TraceRestore &operator= (const TraceRestore &) = delete;
+
+private:
+	TraceContext m_ctx;
+};
+}
+
+
+
+#endif //__FV_TRACING_HPP__
@@ -0,0 +1,315 @@
+#ifndef __FV_UDP_HPP__
+#define __FV_UDP_HPP__
+
+
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+#include "common.hpp"
+#include "common_funcs.hpp"
+#include "dns.hpp"
+#include "structs.hpp"
+
+
+
+namespace fv {
+// Fixed receive buffers reused for every batch read by one socket; on Linux the recvmmsg
+// headers pointing at them are built once as well
+struct UdpRecvBuffers {
+	UdpRecvBuffers (size_t _batch, size_t _datagram_size): m_datagram_size (_datagram_size), m_data (_batch * _datagram_size), m_froms (_batch), m_sizes (_batch) {
+#ifdef __linux__
+		m_msgs.resize (_batch);
+		m_iovs.resize (_batch);
+		for (size_t i = 0; i < _batch; ++i) {
+			m_iovs [i].iov_base = GetBuffer (i);
+			m_iovs [i].iov_len = m_datagram_size;
+			m_msgs [i].msg_hdr.msg_iov = &m_iovs [i];
+			m_msgs [i].msg_hdr.msg_iovlen = 1;
+			m_msgs [i].msg_hdr.msg_name = m_froms [i].data ();
+		}
+#endif
+	}
+	UdpRecvBuffers (const UdpRecvBuffers &) = delete;
+	UdpRecvBuffers &operator= (const UdpRecvBuffers &) = delete;
+
+	size_t GetBatchSize () const { return m_froms.size (); }
+	char *GetBuffer (size_t _i) { return &m_data [_i * m_datagram_size]; }
+	size_t GetDatagramSize () const { return m_datagram_size; }
+	Udp::endpoint &GetFrom (size_t _i) { return m_froms [_i]; }
+	std::string_view GetData (size_t _i) const { return std::string_view { &m_data [_i * m_datagram_size], m_sizes [_i] }; }
+	void SetSize (size_t _i, size_t _size) { m_sizes [_i] = _size; }
+
+#ifdef __linux__
+	// The kernel shrinks msg_namelen to the received address, so it is restored before every call
+	mmsghdr *PrepareMsgs () {
+		for (size_t i = 0; i < m_msgs.size (); ++i)
+			m_msgs [i].msg_hdr.msg_namelen = (socklen_t) m_froms [i].capacity ();
+		return m_msgs.data ();
+	}
+	const mmsghdr &GetMsg (size_t _i) const { return m_msgs [_i]; }
+#endif
+
+private:
+	size_t m_datagram_size;
+	std::vector<char> m_data;
+	std::vector<Udp::endpoint> m_froms;
+	std::vector<size_t> m_sizes;
+#ifdef __linux__
+	std::vector<mmsghdr> m_msgs;
+	std::vector<iovec> m_iovs;
+#endif
+};
+
+
+
+// Waits until the socket is readable, then drains up to a whole batch. On Linux a
+// single recvmmsg call fills every buffer, elsewhere datagrams are read one by one.
+inline Task<size_t> _udp_recv_batch (Udp::socket &_sock, UdpRecvBuffers &_bufs) {
+	co_await _sock.async_wait (Udp::socket::wait_read, UseAwaitable);
+#ifdef __linux__
+	int _n = ::recvmmsg (_sock.native_handle (), _bufs.PrepareMsgs (), (unsigned int) _bufs.GetBatchSize (), MSG_DONTWAIT, nullptr);
+	if (_n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			co_return 0;
+		throw Exception (fmt::format ("recvmmsg failed: {}", errno));
+	}
+	for (int i = 0; i < _n; ++i) {
+		_bufs.GetFrom (i).resize (_bufs.GetMsg (i).msg_hdr.msg_namelen);
+		_bufs.SetSize (i, _bufs.GetMsg (i).msg_len);
+	}
+	co_return (size_t) _n;
+#else
+	size_t _n = 0;
+	while (_n < _bufs.GetBatchSize () && _sock.available () > 0) {
+		size_t _size = _sock.receive_from (asio::buffer (_bufs.GetBuffer (_n), _bufs.GetDatagramSize ()), _bufs.GetFrom (_n));
+		_bufs.SetSize (_n++, _size);
+	}
+	co_return _n;
+#endif
+}
+
+// Sends every datagram with as few syscalls as possible. `_to` may be null for a
+// connected socket. Returns the number of datagrams handed to the kernel.
+inline size_t _udp_send_batch (Udp::socket &_sock, const Udp::endpoint *_to, const std::vector<std::string_view> &_datas) {
+	size_t _sent = 0;
+#ifdef __linux__
+	std::vector<mmsghdr> _msgs (_datas.size ());
+	std::vector<iovec> _iovs (_datas.size ());
+	for (size_t i = 0; i < _datas.size (); ++i) {
+		_iovs [i].iov_base = (void *) _datas [i].data ();
+		_iovs [i].iov_len = _datas [i].size ();
+		_msgs [i].msg_hdr = msghdr {};
+		_msgs [i].msg_hdr.msg_iov = &_iovs [i];
+		_msgs [i].msg_hdr.msg_iovlen = 1;
+		if (_to) {
+			_msgs [i].msg_hdr.msg_name = (void *) _to->data ();
+			_msgs [i].msg_hdr.msg_namelen = (socklen_t) _to->size ();
+		}
+	}
+	while (_sent < _datas.size ()) {
+		int _n = ::sendmmsg (_sock.native_handle (), &_msgs [_sent], (unsigned int) (_datas.size () - _sent), 0);
+		if (_n <= 0)
+			break;
+		_sent += (size_t) _n;
+	}
+#else
+	for (auto &_data : _datas) {
+		ErrorCode _ec;
+		if (_to) {
+			_sock.send_to (asio::buffer (_data.data (), _data.size ()), *_to, 0, _ec);
+		} else {
+			_sock.send (asio::buffer (_data.data (), _data.size ()), 0, _ec);
+		}
+		if (_ec)
+			break;
+		_sent++;
+	}
+#endif
+	return _sent;
+}
+
+
+
+struct UdpConn {
+	std::shared_ptr<Udp::socket> Socket;
+	size_t BatchSize = Config::UdpBatchSize, DatagramSize = Config::UdpDatagramSize;
+
+	virtual ~UdpConn () { Cancel (); }
+
+	Task<void> Connect (std::string _host, std::string _port) {
+		auto _addrs = co_await DnsCache::Resolve (_host);
+		Socket = std::make_shared<Udp::socket> (Tasks::GetContext ());
+		co_await Socket->async_connect (Udp::endpoint { _addrs [0], (uint16_t) std::stoi (_port) }, UseAwaitable);
+		Socket->non_blocking (true);
+	}
+	bool IsConnect () { return Socket && Socket->is_open (); }
+
+	Task<void> Send (const char *_data, size_t _size) {
+		if (!IsConnect ())
+			throw Exception ("Cannot send data to a closed connection.");
+		co_await Socket->async_send (asio::buffer (_data, _size), UseAwaitable);
+	}
+	size_t SendBatch (const std::vector<std::string_view> &_datas) {
+		if (!IsConnect ())
+			throw Exception ("Cannot send data to a closed connection.");
+		return _udp_send_batch (*Socket, nullptr, _datas);
+	}
+
+	Task<std::string> Recv () {
+		if (!IsConnect ())
+			throw Exception ("Cannot recv data from a closed connection.");
+		std::string _buf (DatagramSize, '\0');
+		size_t _size = co_await Socket->async_receive (asio::buffer (_buf), UseAwaitable);
+		_buf.resize (_size);
+		co_return _buf;
+	}
+	// Returns every datagram available after one wakeup, at most BatchSize
+	Task<std::vector<std::string>> RecvBatch () {
+		if (!IsConnect ())
+			throw Exception ("Cannot recv data from a closed connection.");
+		if (!m_bufs)
+			m_bufs = std::make_unique<UdpRecvBuffers> (BatchSize, DatagramSize);
+		std::vector<std::string> _ret;
+		size_t _n = co_await _udp_recv_batch (*Socket, *m_bufs);
+		for (size_t i = 0; i < _n; ++i)
+			_ret.emplace_back (m_bufs->GetData (i));
+		co_return _ret;
+	}
+
+	void Cancel () {
+		try {
+			if (Socket)
+				Socket->cancel ();
+		} catch (...) {
+		}
+		Socket = nullptr;
+	}
+
+private:
+	std::unique_ptr<UdpRecvBuffers> m_bufs;
+};
+
+inline Task<std::shared_ptr<UdpConn>> ConnectUdp (std::string _url) {
+	auto [_schema, _host, _port, _path] = _parse_url (_url);
+	if (_schema != "udp" || _path != "/")
+		throw Exception ("Url format error");
+	auto _conn = std::make_shared<UdpConn> ();
+	co_await _conn->Connect (_host, _port);
+	co_return _conn;
+}
+
+
+
+// Datagram server. With ReusePort (Linux) every IoCtxPool thread gets its own socket
+// bound to the same port and the kernel spreads datagrams across them; each socket
+// drains the queue in batches and calls OnRecv synchronously on its own thread.
+struct UdpServer {
+	bool ReusePort = true;
+	size_t BatchSize = Config::UdpBatchSize, DatagramSize = Config::UdpDatagramSize;
+
+	void SetOnRecv (std::function<void (const Udp::endpoint &, std::string_view)> _on_recv) { OnRecv = _on_recv; }
+
+	Task<void> Run (std::string _ip, uint16_t _port) {
+		if (IsRun.load ())
+			co_return;
+		IsRun.store (true);
+		Udp::endpoint _ep { asio::ip::address::from_string (_ip), _port };
+		size_t _count = 1;
+#ifdef SO_REUSEPORT
+		if (ReusePort)
+			_count = Tasks::GetContextCount ();
+#endif
+		std::vector<std::shared_ptr<Udp::socket>> _socks;
+		for (size_t i = 0; i < _count; ++i) {
+			auto _sock = std::make_shared<Udp::socket> (Tasks::GetContext (i), _ep.protocol ());
+			_sock->set_option (SocketBase::reuse_address (true));
+#ifdef SO_REUSEPORT
+			if (_count > 1)
+				_sock->set_option (asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> (true));
+#endif
+			_sock->bind (_ep);
+			_sock->non_blocking (true);
+			_socks.emplace_back (_sock);
+		}
+		{
+			std::unique_lock _ul { m_mtx };
+			Sockets = _socks;
+		}
+		auto _done = std::make_shared<AsyncEvent> ();
+		auto _remaining = std::make_shared<std::atomic_size_t> (_socks.size ());
+		for (auto &_sock : _socks) {
+			asio::co_spawn (_sock->get_executor (), [this, _sock, _done, _remaining] () -> Task<void> {
+				UdpRecvBuffers _bufs { BatchSize, DatagramSize };
+				try {
+					while (IsRun.load ()) {
+						size_t _n = co_await _udp_recv_batch (*_sock, _bufs);
+						for (size_t i = 0; i < _n; ++i) {
+							if (OnRecv)
+								OnRecv (_bufs.GetFrom (i), _bufs.GetData (i));
+						}
+					}
+				} catch (...) {
+				}
+				if (--*_remaining == 0)
+					_done->Set ();
+			}, asio::detached);
+		}
+		co_await _done->Wait ();
+	}
+	Task<void> Run (uint16_t _port) {
+		co_await Run ("0.0.0.0", _port);
+	}
+
+	bool SendTo (const Udp::endpoint &_to, std::string_view _data) {
+		return SendBatchTo (_to, { _data }) == 1;
+	}
+	size_t SendBatchTo (const Udp::endpoint &_to, const std::vector<std::string_view> &_datas) {
+		std::shared_ptr<Udp::socket> _sock;
+		{
+			std::unique_lock _ul { m_mtx };
+			if (Sockets.empty ())
+				return 0;
+			_sock = Sockets [m_send_index++ % Sockets.size ()];
+		}
+		return _udp_send_batch (*_sock, &_to, _datas);
+	}
+
+	// Closes the sockets on their own threads; Run returns once every receive loop ended
+	// and may be called again afterwards
+	void Stop () {
+		IsRun.store (false);
+		std::vector<std::shared_ptr<Udp::socket>> _socks;
+		{
+			std::unique_lock _ul { m_mtx };
+			_socks.swap (Sockets);
+		}
+		for (auto &_sock : _socks) {
+			asio::post (_sock->get_executor (), [_sock] () {
+				ErrorCode _ec;
+				_sock->close (_ec);
+			});
+		}
+	}
+
+private:
+	std::function<void (const Udp::endpoint &, std::string_view)> OnRecv;
+	std::mutex m_mtx;
+	std::vector<std::shared_ptr<Udp::socket>> Sockets;
+	std::atomic_bool IsRun { false };
+	std::atomic_size_t m_send_index { 0 };
+};
+}
+
+
+
+#endif //__FV_UDP_HPP__
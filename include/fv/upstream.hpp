@@ -0,0 +1,345 @@
+#ifndef __FV_UPSTREAM_HPP__
+#define __FV_UPSTREAM_HPP__
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "structs.hpp"
+#include "req_res.hpp"
+#include "session.hpp"
+
+
+
+namespace fv {
+struct UpstreamStats {
+	std::string Url = "";
+	bool Healthy = true, Ejected = false;
+	size_t Outstanding = 0;
+	uint64_t Requests = 0, Failures = 0, EjectCount = 0;
+	double LatencyMs = 0;
+};
+
+
+
+// Client for one logical service served by several replicas. Each endpoint keeps its
+// own pool of keep-alive sessions; requests go to the endpoint picked by Policy among
+// those that are healthy and not ejected. Request urls are paths, e.g. "/api/user".
+class Upstream {
+public:
+	LoadBalance Policy = LoadBalance::PowerOfTwoChoices;
+	// Outlier ejection: an endpoint is ejected after this many consecutive failures
+	// (errors or 5xx), or when its latency exceeds EjectLatencyFactor times the median of
+	// the others. Each ejection lasts EjectBaseTime times the number of ejections so far,
+	// and at most MaxEjectPercent of the endpoints are ejected at once.
+	size_t EjectConsecutiveFailures = 5;
+	double EjectLatencyFactor = 3.0;
+	size_t EjectMinSamples = 20;
+	TimeSpan EjectBaseTime = std::chrono::seconds (30);
+	double MaxEjectPercent = 0.5;
+
+	Upstream (std::vector<std::string> _urls): m_state (std::make_shared<State> ()) {
+		if (_urls.empty ())
+			throw Exception ("Upstream needs at least one endpoint");
+		for (auto &_url : _urls) {
+			auto _ep = std::make_shared<Endpoint> ();
+			_ep->Url = _url.size () > 0 && _url.back () == '/' ? _url.substr (0, _url.size () - 1) : _url;
+			m_state->Endpoints.push_back (_ep);
+		}
+	}
+	Upstream (const Upstream &) = delete;
+	Upstream &operator= (const Upstream &) = delete;
+	~Upstream () { StopHealthCheck (); }
+
+	// Probes `_path` on every endpoint each `_interval`. Any response below 400 passes;
+	// `_unhealthy_threshold` failed probes in a row take an endpoint out of rotation
+	// until a probe passes again.
+	void StartHealthCheck (std::string _path, TimeSpan _interval, TimeSpan _timeout = std::chrono::seconds (2), size_t _unhealthy_threshold = 2) {
+		StopHealthCheck ();
+		auto _stop = std::make_shared<AsyncEvent> ();
+		m_hc_stop = _stop;
+		Tasks::RunAsync ([_state = m_state, _stop, _path, _interval, _timeout, _unhealthy_threshold] () -> Task<void> {
+			while (!_stop->IsSet ()) {
+				for (auto &_ep : _state->Endpoints) {
+					bool _ok = false;
+					try {
+						Session _sess {};
+						Response _res = co_await _sess.Get (_ep->Url + _path, timeout (_timeout));
+						_ok = _res.HttpCode > 0 && _res.HttpCode < 400;
+					} catch (...) {
+					}
+					std::unique_lock _ul { _state->Mtx };
+					_ep->CheckFailures = _ok ? 0 : _ep->CheckFailures + 1;
+					if (_ok) {
+						_ep->Healthy = true;
+					} else if (_ep->CheckFailures >= _unhealthy_threshold) {
+						_ep->Healthy = false;
+					}
+				}
+				co_await _stop->Wait (_interval);
+			}
+		});
+	}
+
+	void StopHealthCheck () {
+		if (m_hc_stop) {
+			m_hc_stop->Set ();
+			m_hc_stop = nullptr;
+		}
+	}
+
+	std::vector<UpstreamStats> GetStats () {
+		std::vector<UpstreamStats> _ret;
+		auto _now = std::chrono::steady_clock::now ();
+		std::unique_lock _ul { m_state->Mtx };
+		for (auto &_ep : m_state->Endpoints) {
+			UpstreamStats _stats {};
+			_stats.Url = _ep->Url;
+			_stats.Healthy = _ep->Healthy;
+			_stats.Ejected = _ep->EjectUntil > _now;
+			_stats.Outstanding = _ep->Outstanding.load ();
+			_stats.Requests = _ep->Requests;
+			_stats.Failures = _ep->Failures;
+			_stats.EjectCount = _ep->EjectCount;
+			_stats.LatencyMs = _ep->LatencyMs;
+			_ret.push_back (_stats);
+		}
+		return _ret;
+	}
+
+	Task<Response> DoMethod (Request _r) {
+		auto _ep = _Pick ();
+		_r.Url = _ep->Url + _r.Url;
+		Session _sess = _ep->Acquire ();
+		_ep->Outstanding++;
+		auto _start = std::chrono::steady_clock::now ();
+		Response _res {};
+		std::exception_ptr _ex = nullptr;
+		try {
+			_res = co_await _sess.DoMethod (_r);
+		} catch (...) {
+			_ex = std::current_exception ();
+		}
+		_ep->Outstanding--;
+		double _ms = std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now () - _start).count ();
+		_Report (_ep, !_ex && _res.HttpCode < 500, _ms);
+		if (_ex)
+			std::rethrow_exception (_ex);
+		_ep->Release (_sess);
+		co_return _res;
+	}
+
+	Task<Response> Head (std::string _path) {
+		co_return co_await DoMethod (Request { _path, MethodType::Head });
+	}
+	template<TOption ..._Ops>
+	Task<Response> Head (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Head };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+	Task<Response> Option (std::string _path) {
+		co_return co_await DoMethod (Request { _path, MethodType::Option });
+	}
+	template<TOption ..._Ops>
+	Task<Response> Option (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Option };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+	Task<Response> Get (std::string _path) {
+		co_return co_await DoMethod (Request { _path, MethodType::Get });
+	}
+	template<TOption ..._Ops>
+	Task<Response> Get (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Get };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+	template<TFormOption ..._Ops>
+	Task<Response> Post (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Post };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+	template<TBodyOption _Body>
+	Task<Response> Post (std::string _path, _Body _body) {
+		Request _r { _path, MethodType::Post };
+		_OptionApplyBody (_r, _body);
+		co_return co_await DoMethod (_r);
+	}
+	template<TBodyOption _Body, TOption ..._Ops>
+	Task<Response> Post (std::string _path, _Body _body, _Ops ..._ops) {
+		Request _r { _path, MethodType::Post };
+		_OptionApplyBody (_r, _body);
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+	template<TFormOption ..._Ops>
+	Task<Response> Put (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Put };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+	template<TBodyOption _Body>
+	Task<Response> Put (std::string _path, _Body _body) {
+		Request _r { _path, MethodType::Put };
+		_OptionApplyBody (_r, _body);
+		co_return co_await DoMethod (_r);
+	}
+	template<TBodyOption _Body, TOption ..._Ops>
+	Task<Response> Put (std::string _path, _Body _body, _Ops ..._ops) {
+		Request _r { _path, MethodType::Put };
+		_OptionApplyBody (_r, _body);
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+	Task<Response> Delete (std::string _path) {
+		co_return co_await DoMethod (Request { _path, MethodType::Delete });
+	}
+	template<TOption ..._Ops>
+	Task<Response> Delete (std::string _path, _Ops ..._ops) {
+		Request _r { _path, MethodType::Delete };
+		_OptionApplys (_r, _ops...);
+		co_return co_await DoMethod (_r);
+	}
+
+private:
+	struct Endpoint {
+		std::string Url = "";
+		std::atomic_size_t Outstanding { 0 };
+
+		// guarded by State::Mtx
+		bool Healthy = true;
+		size_t CheckFailures = 0, ConsecutiveFailures = 0;
+		uint64_t Requests = 0, Failures = 0, Samples = 0, EjectCount = 0;
+		double LatencyMs = 0;
+		std::chrono::steady_clock::time_point EjectUntil {};
+
+		Session Acquire () {
+			std::unique_lock _ul { m_mtx };
+			if (m_idle.empty ())
+				return Session {};
+			Session _sess = m_idle.back ();
+			m_idle.pop_back ();
+			return _sess;
+		}
+		void Release (const Session &_sess) {
+			std::unique_lock _ul { m_mtx };
+			m_idle.push_back (_sess);
+		}
+
+	private:
+		std::mutex m_mtx;
+		std::vector<Session> m_idle;
+	};
+
+	struct State {
+		std::mutex Mtx;
+		std::vector<std::shared_ptr<Endpoint>> Endpoints;
+	};
+
+	std::shared_ptr<Endpoint> _Pick () {
+		auto _now = std::chrono::steady_clock::now ();
+		std::unique_lock _ul { m_state->Mtx };
+		std::vector<Endpoint *> _cands;
+		for (auto &_ep : m_state->Endpoints) {
+			if (_ep->Healthy && _ep->EjectUntil <= _now)
+				_cands.push_back (_ep.get ());
+		}
+		// nothing usable: spread the load over everything rather than fail outright
+		if (_cands.empty ()) {
+			for (auto &_ep : m_state->Endpoints)
+				_cands.push_back (_ep.get ());
+		}
+		auto _better = [] (Endpoint *_a, Endpoint *_b) {
+			size_t _oa = _a->Outstanding.load (), _ob = _b->Outstanding.load ();
+			return _oa != _ob ? _oa < _ob : _a->LatencyMs < _b->LatencyMs;
+		};
+		Endpoint *_sel = _cands [0];
+		if (Policy == LoadBalance::PowerOfTwoChoices && _cands.size () > 1) {
+			thread_local std::mt19937 s_rng { std::random_device {} () };
+			size_t _i = s_rng () % _cands.size (), _j = s_rng () % (_cands.size () - 1);
+			if (_j >= _i)
+				++_j;
+			_sel = _better (_cands [_j], _cands [_i]) ? _cands [_j] : _cands [_i];
+		} else {
+			for (auto *_ep : _cands) {
+				if (_better (_ep, _sel))
+					_sel = _ep;
+			}
+		}
+		for (auto &_ep : m_state->Endpoints) {
+			if (_ep.get () == _sel)
+				return _ep;
+		}
+		return m_state->Endpoints [0];
+	}
+
+	void _Report (std::shared_ptr<Endpoint> _ep, bool _ok, double _ms) {
+		auto _now = std::chrono::steady_clock::now ();
+		std::unique_lock _ul { m_state->Mtx };
+		_ep->Requests++;
+		_ep->LatencyMs = _ep->Samples == 0 ? _ms : _ep->LatencyMs * 0.8 + _ms * 0.2;
+		_ep->Samples++;
+		if (!_ok) {
+			_ep->Failures++;
+			if (++_ep->ConsecutiveFailures >= EjectConsecutiveFailures)
+				_TryEject (*_ep, _now);
+			return;
+		}
+		_ep->ConsecutiveFailures = 0;
+		if (_ep->EjectCount > 0 && _ep->EjectUntil + EjectBaseTime < _now)
+			_ep->EjectCount = 0;
+		if (EjectLatencyFactor > 0 && _ep->Samples >= EjectMinSamples) {
+			std::vector<double> _others;
+			for (auto &_other : m_state->Endpoints) {
+				if (_other != _ep && _other->Samples >= EjectMinSamples && _other->EjectUntil <= _now)
+					_others.push_back (_other->LatencyMs);
+			}
+			if (!_others.empty ()) {
+				std::nth_element (_others.begin (), _others.begin () + _others.size () / 2, _others.end ());
+				if (_ep->LatencyMs > _others [_others.size () / 2] * EjectLatencyFactor)
+					_TryEject (*_ep, _now);
+			}
+		}
+	}
+
+	// Caller holds State::Mtx
+	void _TryEject (Endpoint &_ep, std::chrono::steady_clock::time_point _now) {
+		if (_ep.EjectUntil > _now)
+			return;
+		size_t _ejected = 0;
+		for (auto &_other : m_state->Endpoints) {
+			if (_other->EjectUntil > _now)
+				_ejected++;
+		}
+		if ((double) (_ejected + 1) > MaxEjectPercent * m_state->Endpoints.size ())
+			return;
+		_ep.EjectCount++;
+		_ep.EjectUntil = _now + EjectBaseTime * (int64_t) std::min<uint64_t> (_ep.EjectCount, 10);
+		_ep.ConsecutiveFailures = 0;
+		_ep.Samples = 0;
+	}
+
+	std::shared_ptr<State> m_state;
+	std::shared_ptr<AsyncEvent> m_hc_stop;
+};
+}
+
+
+
+#endif //__FV_UPSTREAM_HPP__
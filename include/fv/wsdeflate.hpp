@@ -0,0 +1,223 @@
+#ifndef __FV_WSDEFLATE_HPP__
+#define __FV_WSDEFLATE_HPP__
+
+
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+#include <zlib.h>
+
+#include "common.hpp"
+#include "common_funcs.hpp"
+#include "structs.hpp"
+
+
+
+namespace fv {
+// Parameters agreed on for permessage-deflate, as named by RFC 7692
+struct WsDeflateParams {
+	bool ServerNoContextTakeover = false, ClientNoContextTakeover = false;
+	int ServerMaxWindowBits = 15, ClientMaxWindowBits = 15;
+
+	std::string ToHeader () const {
+		std::string _ret = "permessage-deflate";
+		if (ServerNoContextTakeover)
+			_ret += "; server_no_context_takeover";
+		if (ClientNoContextTakeover)
+			_ret += "; client_no_context_takeover";
+		if (ServerMaxWindowBits < 15)
+			_ret += fmt::format ("; server_max_window_bits={}", ServerMaxWindowBits);
+		if (ClientMaxWindowBits < 15)
+			_ret += fmt::format ("; client_max_window_bits={}", ClientMaxWindowBits);
+		return _ret;
+	}
+
+	// Client side: what the client offers
+	static std::string Offer (const WsDeflateOptions &_opts) {
+		WsDeflateParams _params { _opts.ServerNoContextTakeover, _opts.ClientNoContextTakeover, _clamp_bits (_opts.ServerMaxWindowBits), 15 };
+		// a bare client_max_window_bits tells the server it may limit the client window
+		return _params.ToHeader () + (_opts.ClientMaxWindowBits < 15 ? fmt::format ("; client_max_window_bits={}", _clamp_bits (_opts.ClientMaxWindowBits)) : "; client_max_window_bits");
+	}
+
+	// Server side: picks the first acceptable offer of a Sec-WebSocket-Extensions header
+	static std::optional<WsDeflateParams> Accept (std::string_view _header, const WsDeflateOptions &_opts) {
+		for (std::string_view _offer : _split_extensions (_header)) {
+			auto _ret = _parse (_offer, true);
+			if (!_ret.has_value ())
+				continue;
+			_ret->ServerNoContextTakeover |= _opts.ServerNoContextTakeover;
+			_ret->ClientNoContextTakeover |= _opts.ClientNoContextTakeover;
+			_ret->ServerMaxWindowBits = std::min (_ret->ServerMaxWindowBits, _clamp_bits (_opts.ServerMaxWindowBits));
+			// the client window can only be limited when the client offered client_max_window_bits
+			if (_offer.find ("client_max_window_bits") != std::string_view::npos)
+				_ret->ClientMaxWindowBits = std::min (_ret->ClientMaxWindowBits, _clamp_bits (_opts.ClientMaxWindowBits));
+			return _ret;
+		}
+		return std::nullopt;
+	}
+
+	// Client side: the parameters the server answered with, nullopt when it declined
+	static std::optional<WsDeflateParams> FromResponse (std::string_view _header) {
+		for (std::string_view _ext : _split_extensions (_header)) {
+			if (auto _ret = _parse (_ext, false); _ret.has_value ())
+				return _ret;
+		}
+		return std::nullopt;
+	}
+
+private:
+	static int _clamp_bits (int _bits) { return std::clamp (_bits, 9, 15); }
+
+	static std::vector<std::string_view> _split_extensions (std::string_view _header) {
+		std::vector<std::string_view> _ret;
+		while (!_header.empty ()) {
+			size_t _p = _header.find (',');
+			_ret.push_back (_header.substr (0, _p));
+			_header = _p == std::string_view::npos ? std::string_view {} : _header.substr (_p + 1);
+		}
+		return _ret;
+	}
+
+	// One extension of the header, nullopt when it is not a valid permessage-deflate
+	static std::optional<WsDeflateParams> _parse (std::string_view _ext, bool _is_offer) {
+		WsDeflateParams _ret {};
+		bool _first = true, _valid = true;
+		KvView { _ext, ';' }.ForEach ([&] (std::string_view _key, std::string_view _value) {
+			if (_first) {
+				_first = false;
+				_valid = _key == "permessage-deflate";
+				return _valid;
+			}
+			if (_value.size () >= 2 && _value.front () == '"' && _value.back () == '"')
+				_value = _value.substr (1, _value.size () - 2);
+			int _bits = _value.empty () ? 15 : std::atoi (std::string (_value).c_str ());
+			if (_key == "server_no_context_takeover") {
+				_ret.ServerNoContextTakeover = true;
+			} else if (_key == "client_no_context_takeover") {
+				_ret.ClientNoContextTakeover = true;
+			} else if (_key == "server_max_window_bits" && _bits >= 9 && _bits <= 15) {
+				_ret.ServerMaxWindowBits = _clamp_bits (_bits);
+			} else if (_key == "client_max_window_bits" && _bits >= 9 && _bits <= 15 && (_is_offer || !_value.empty ())) {
+				_ret.ClientMaxWindowBits = _clamp_bits (_bits);
+			} else {
+				_valid = false;
+			}
+			return _valid;
+		});
+		return _valid && !_first ? std::optional<WsDeflateParams> { _ret } : std::nullopt;
+	}
+};
+
+
+
+// The zlib streams of one websocket connection. Compress calls must happen in the order
+// the frames go out when context takeover is on, so they are serialized by Mutex.
+class WsDeflate {
+public:
+	std::mutex Mutex;
+
+	WsDeflate (const WsDeflateParams &_params, bool _is_client, const WsDeflateOptions &_opts): m_min_size (_opts.MinSize) {
+		int _bits = _is_client ? _params.ClientMaxWindowBits : _params.ServerMaxWindowBits;
+		m_reset_deflate = _is_client ? _params.ClientNoContextTakeover : _params.ServerNoContextTakeover;
+		if (::deflateInit2 (&m_deflate, _opts.Level, Z_DEFLATED, -_bits, _opts.MemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw Exception ("Init websocket deflate failed");
+		// a larger window decodes anything a smaller one produced
+		if (::inflateInit2 (&m_inflate, -15) != Z_OK) {
+			::deflateEnd (&m_deflate);
+			throw Exception ("Init websocket inflate failed");
+		}
+	}
+	WsDeflate (const WsDeflate &) = delete;
+	WsDeflate &operator= (const WsDeflate &) = delete;
+	~WsDeflate () {
+		::deflateEnd (&m_deflate);
+		::inflateEnd (&m_inflate);
+	}
+
+	bool ShouldCompress (size_t _size) const { return _size >= m_min_size; }
+
+	// Payload of a compressed message: the deflate stream flushed to a byte boundary,
+	// without the trailing 00 00 ff ff
+	std::string Compress (std::string_view _data) {
+		std::string _out;
+		_out.resize (::deflateBound (&m_deflate, (uLong) _data.size ()) + 16);
+		m_deflate.next_in = (Bytef *) _data.data ();
+		m_deflate.avail_in = (uInt) _data.size ();
+		size_t _used = 0;
+		do {
+			if (_used == _out.size ())
+				_out.resize (_out.size () * 2);
+			m_deflate.next_out = (Bytef *) &_out [_used];
+			m_deflate.avail_out = (uInt) (_out.size () - _used);
+			if (::deflate (&m_deflate, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+				throw Exception ("Websocket deflate failed");
+			_used = _out.size () - m_deflate.avail_out;
+		} while (m_deflate.avail_out == 0);
+		_out.resize (_used >= 4 ? _used - 4 : _used);
+		if (m_reset_deflate)
+			::deflateReset (&m_deflate);
+		return _out;
+	}
+
+	// Inflates one received message. Throws std::length_error as soon as it would exceed
+	// `_max` bytes (0 means unlimited), so a small bomb never grows the buffer past the limit.
+	std::string Decompress (std::string_view _data, size_t _max = 0) {
+		static const char s_tail [4] = { 0, 0, (char) 0xff, (char) 0xff };
+		// one byte over the limit tells a message of exactly `_max` bytes from a larger one
+		size_t _cap = _max > 0 ? _max + 1 : std::numeric_limits<size_t>::max ();
+		std::string _out;
+		_out.resize (std::min (std::max<size_t> (_data.size () * 4, 256), _cap));
+		size_t _used = 0;
+		bool _ended = false;
+		for (std::string_view _in : { _data, std::string_view { s_tail, 4 } }) {
+			if (_ended)
+				break;
+			m_inflate.next_in = (Bytef *) _in.data ();
+			m_inflate.avail_in = (uInt) _in.size ();
+			while (m_inflate.avail_in > 0) {
+				if (_used == _out.size ()) {
+					if (_used >= _cap)
+						throw std::length_error ("Websocket message too large.");
+					_out.resize (std::min (_out.size () * 2, _cap));
+				}
+				m_inflate.next_out = (Bytef *) &_out [_used];
+				m_inflate.avail_out = (uInt) (_out.size () - _used);
+				int _ret = ::inflate (&m_inflate, Z_SYNC_FLUSH);
+				if (_ret != Z_OK && _ret != Z_BUF_ERROR && _ret != Z_STREAM_END)
+					throw Exception ("Websocket inflate failed");
+				_used = _out.size () - m_inflate.avail_out;
+				// a peer may end the message with a final block: the appended tail is not part of
+				// that stream and the next message starts a new one
+				if (_ret == Z_STREAM_END) {
+					::inflateReset (&m_inflate);
+					_ended = true;
+					break;
+				}
+				if (_ret == Z_BUF_ERROR && m_inflate.avail_out > 0)
+					break;
+			}
+		}
+		if (_max > 0 && _used > _max)
+			throw std::length_error ("Websocket message too large.");
+		_out.resize (_used);
+		return _out;
+	}
+
+private:
+	size_t m_min_size;
+	bool m_reset_deflate = false;
+	z_stream m_deflate {}, m_inflate {};
+};
+}
+
+
+
+#endif //__FV_WSDEFLATE_HPP__
@@ -0,0 +1,298 @@
+#ifndef __FV_WSHUB_HPP__
+#define __FV_WSHUB_HPP__
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "structs.hpp"
+#include "conn.hpp"
+#include "metrics.hpp"
+
+
+
+namespace fv {
+// Topic based fan-out for server websockets. Subscribers of a topic are grouped by the I/O
+// context of their connection; Publish encodes the frame once and every context enqueues
+// the shared frame to its own subscribers on its own thread, without a coroutine per peer.
+// A subscriber whose write queue is above its high watermark is handled by the policy:
+//   Drop        the message is skipped for that subscriber
+//   Disconnect  the connection is cancelled and unsubscribed
+//   Coalesce    only the newest pending message of the topic is kept, and sent once the
+//               queue drained to its low watermark
+// Connections are referenced weakly, closed ones are unsubscribed by the next Publish to
+// their topics, and destroyed ones also by Subscribe once the table doubled since the last sweep.
+// Frames are never compressed, even on connections that negotiated permessage-deflate.
+class WsHub {
+public:
+	WsHub (SlowConsumer _policy = SlowConsumer::Drop): m_policy (_policy) {}
+	WsHub (const WsHub &) = delete;
+	WsHub &operator= (const WsHub &) = delete;
+
+	// Returns false for client connections, closed ones and repeated subscriptions
+	bool Subscribe (std::shared_ptr<WsConn> _conn, const std::string &_topic) {
+		auto _parent = _conn ? _conn->Parent : nullptr;
+		if (!_parent || _conn->IsClient || !_parent->IsConnect ())
+			return false;
+		auto _executor = _parent->GetExecutor ();
+		asio::execution_context *_ctx = &asio::query (_executor, asio::execution::context);
+		std::unique_lock _ul { m_mtx };
+		if (m_subs.size () >= m_reap_at)
+			_reap ();
+		auto &_subs = m_subs [_conn];
+		if (_subs.contains (_topic))
+			return false;
+		auto &_t = m_topics [_topic];
+		if (!_t)
+			_t = std::make_shared<_Topic> (_topic);
+		auto _sub = std::make_shared<_Sub> (_conn, _ctx);
+		std::unique_lock _ul2 { _t->Mutex };
+		auto &_group = _t->Groups [_ctx];
+		if (_group.Subs.empty ())
+			_group.Executor = _executor;
+		_sub->Index = _group.Subs.size ();
+		_group.Subs.emplace_back (_sub);
+		_t->Count++;
+		_subs [_topic] = _sub;
+		return true;
+	}
+
+	bool Unsubscribe (std::shared_ptr<WsConn> _conn, const std::string &_topic) {
+		std::unique_lock _ul { m_mtx };
+		return _unsubscribe (_conn, _topic);
+	}
+
+	void UnsubscribeAll (std::shared_ptr<WsConn> _conn) {
+		std::unique_lock _ul { m_mtx };
+		auto _it = m_subs.find (_conn);
+		if (_it == m_subs.end ())
+			return;
+		std::vector<std::string> _topics;
+		for (auto &[_topic, _sub] : _it->second)
+			_topics.emplace_back (_topic);
+		for (auto &_topic : _topics)
+			_unsubscribe (_conn, _topic);
+	}
+
+	size_t GetSubscriberCount (const std::string &_topic) {
+		std::unique_lock _ul { m_mtx };
+		auto _it = m_topics.find (_topic);
+		return _it != m_topics.end () ? _it->second->Count : 0;
+	}
+
+	size_t GetTopicCount () {
+		std::unique_lock _ul { m_mtx };
+		return m_topics.size ();
+	}
+
+	// The frame is encoded before returning, `_data` is not referenced afterwards
+	Task<BroadcastResult> Publish (std::string _topic, std::string_view _data, WsType _type = WsType::Text) {
+		return PublishFrame (std::move (_topic), std::make_shared<const std::string> (WsConn::EncodeFrame (_data.data (), _data.size (), _type, false)));
+	}
+
+	// `_frame` is a complete server frame, as returned by WsConn::EncodeFrame. Completes once
+	// every context has enqueued it, not when it was written.
+	Task<BroadcastResult> PublishFrame (std::string _topic, std::shared_ptr<const std::string> _frame) {
+		std::shared_ptr<_Topic> _t;
+		{
+			std::unique_lock _ul { m_mtx };
+			auto _it = m_topics.find (_topic);
+			if (_it == m_topics.end ())
+				co_return BroadcastResult {};
+			_t = _it->second;
+		}
+		std::vector<std::pair<asio::execution_context *, asio::any_io_executor>> _groups;
+		{
+			std::shared_lock _sl { _t->Mutex };
+			for (auto &[_ctx, _group] : _t->Groups)
+				_groups.emplace_back (_ctx, _group.Executor);
+		}
+		if (_groups.empty ())
+			co_return BroadcastResult {};
+		auto _state = std::make_shared<_PublishState> ();
+		_state->Remaining.store (_groups.size ());
+		for (auto &[_ctx, _executor] : _groups) {
+			asio::post (_executor, [this, _t, _ctx = _ctx, _frame, _state] () {
+				_deliver (*_t, _ctx, _frame, *_state);
+				if (--_state->Remaining == 0)
+					_state->Done.Set ();
+			});
+		}
+		co_await _state->Done.Wait ();
+		co_return BroadcastResult { _state->Delivered.load (), _state->Dropped.load (), _state->Coalesced.load () };
+	}
+
+private:
+	struct _Sub {
+		std::weak_ptr<WsConn> Conn;
+		asio::execution_context *Ctx;
+		// position in _Group::Subs, guarded by the topic lock
+		size_t Index = 0;
+		// SlowConsumer::Coalesce state
+		std::mutex Mutex;
+		std::shared_ptr<const std::string> Pending;
+		bool Flushing = false;
+
+		_Sub (std::weak_ptr<WsConn> _conn, asio::execution_context *_ctx): Conn (std::move (_conn)), Ctx (_ctx) {}
+	};
+	struct _Group {
+		asio::any_io_executor Executor;
+		std::vector<std::shared_ptr<_Sub>> Subs;
+	};
+	struct _Topic {
+		std::string Name;
+		std::shared_mutex Mutex;
+		std::unordered_map<asio::execution_context *, _Group> Groups;
+		size_t Count = 0;
+
+		_Topic (std::string _name): Name (std::move (_name)) {}
+	};
+	struct _PublishState {
+		std::atomic_size_t Delivered { 0 }, Dropped { 0 }, Coalesced { 0 }, Remaining { 0 };
+		AsyncEvent Done {};
+	};
+
+	// Runs on the context `_ctx`
+	void _deliver (_Topic &_t, asio::execution_context *_ctx, std::shared_ptr<const std::string> _frame, _PublishState &_state) {
+		size_t _delivered = 0, _dropped = 0, _coalesced = 0;
+		std::vector<std::weak_ptr<WsConn>> _dead;
+		{
+			std::shared_lock _sl { _t.Mutex };
+			auto _it = _t.Groups.find (_ctx);
+			if (_it == _t.Groups.end ())
+				return;
+			for (auto &_sub : _it->second.Subs) {
+				auto _conn = _sub->Conn.lock ();
+				auto _parent = _conn ? _conn->Parent : nullptr;
+				if (!_parent || !_parent->IsConnect ()) {
+					_dead.emplace_back (_sub->Conn);
+					continue;
+				}
+				if (m_policy == SlowConsumer::Coalesce) {
+					// a newer message must not overtake the pending one
+					std::unique_lock _ul { _sub->Mutex };
+					if (_sub->Flushing) {
+						_sub->Pending = _frame;
+						_coalesced++;
+						continue;
+					}
+				}
+				if (_parent->TryWrite (_frame)) {
+					_delivered++;
+				} else if (m_policy == SlowConsumer::Coalesce) {
+					_coalesce (_sub, _parent, _frame);
+					_coalesced++;
+				} else {
+					_dropped++;
+					if (m_policy == SlowConsumer::Disconnect) {
+						_parent->Cancel ();
+						_dead.emplace_back (_sub->Conn);
+					}
+				}
+			}
+		}
+		Metrics::WsMessagesOut.Add (_delivered);
+		_state.Delivered += _delivered;
+		_state.Dropped += _dropped;
+		_state.Coalesced += _coalesced;
+		if (!_dead.empty ()) {
+			std::unique_lock _ul { m_mtx };
+			for (auto &_conn : _dead)
+				_unsubscribe (_conn, _t.Name);
+		}
+	}
+
+	// Keeps `_frame` as the pending message and writes it once the queue drained; messages
+	// published meanwhile replace it
+	static void _coalesce (std::shared_ptr<_Sub> _sub, std::shared_ptr<IConn2> _parent, std::shared_ptr<const std::string> _frame) {
+		{
+			std::unique_lock _ul { _sub->Mutex };
+			_sub->Pending = std::move (_frame);
+			_sub->Flushing = true;
+		}
+		asio::co_spawn (_parent->GetExecutor (), [_sub, _parent] () -> Task<void> {
+			while (co_await _parent->WaitWritable ()) {
+				std::unique_lock _ul { _sub->Mutex };
+				if (!_sub->Pending) {
+					_sub->Flushing = false;
+					co_return;
+				}
+				if (_parent->ForceWrite (std::move (_sub->Pending)))
+					Metrics::WsMessagesOut.Add ();
+				_sub->Pending = nullptr;
+			}
+			std::unique_lock _ul { _sub->Mutex };
+			_sub->Pending = nullptr;
+			_sub->Flushing = false;
+		}, asio::detached);
+	}
+
+	// Caller holds m_mtx. Drops destroyed connections, which a topic nobody publishes to
+	// would otherwise keep forever; amortized over the subscriptions that grew the table.
+	void _reap () {
+		std::vector<std::pair<std::weak_ptr<WsConn>, std::string>> _dead;
+		for (auto &[_conn, _subs] : m_subs) {
+			if (_conn.expired ()) {
+				for (auto &[_topic, _sub] : _subs)
+					_dead.emplace_back (_conn, _topic);
+			}
+		}
+		for (auto &[_conn, _topic] : _dead)
+			_unsubscribe (_conn, _topic);
+		m_reap_at = std::max<size_t> (m_subs.size () * 2, MinReap);
+	}
+
+	// Caller holds m_mtx
+	bool _unsubscribe (const std::weak_ptr<WsConn> &_conn, const std::string &_topic) {
+		auto _it = m_subs.find (_conn);
+		if (_it == m_subs.end ())
+			return false;
+		auto _sub_it = _it->second.find (_topic);
+		if (_sub_it == _it->second.end ())
+			return false;
+		auto _sub = _sub_it->second;
+		_it->second.erase (_sub_it);
+		if (_it->second.empty ())
+			m_subs.erase (_it);
+		auto _t_it = m_topics.find (_topic);
+		auto &_t = *_t_it->second;
+		std::unique_lock _ul { _t.Mutex };
+		auto _group_it = _t.Groups.find (_sub->Ctx);
+		auto &_subs = _group_it->second.Subs;
+		_subs [_sub->Index] = _subs.back ();
+		_subs [_sub->Index]->Index = _sub->Index;
+		_subs.pop_back ();
+		if (_subs.empty ())
+			_t.Groups.erase (_group_it);
+		if (--_t.Count == 0) {
+			_ul.unlock ();
+			m_topics.erase (_t_it);
+		}
+		return true;
+	}
+
+	static constexpr size_t MinReap = 64;
+
+	SlowConsumer m_policy;
+	// m_mtx guards both maps; a topic's lock is only taken after it
+	std::mutex m_mtx;
+	std::unordered_map<std::string, std::shared_ptr<_Topic>> m_topics;
+	// keyed by control block, so entries of destroyed connections stay reachable for cleanup
+	std::map<std::weak_ptr<WsConn>, std::unordered_map<std::string, std::shared_ptr<_Sub>>, std::owner_less<>> m_subs;
+	size_t m_reap_at = MinReap;
+};
+}
+
+
+
+#endif //__FV_WSHUB_HPP__
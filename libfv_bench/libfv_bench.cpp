@@ -0,0 +1,682 @@
+#ifdef _MSC_VER
+#   define _WIN32_WINNT 0x0601
+#   pragma warning (disable: 4068)
+#   pragma comment (lib, "Crypt32.lib")
+#define _SILENCE_CXX23_ALIGNED_STORAGE_DEPRECATION_WARNING
+#define _SILENCE_ALL_CXX23_DEPRECATION_WARNINGS
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+// gcc pairs asio's recycled coroutine frames with the wrong allocation function and warns
+#if defined (__GNUC__) && !defined (__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+#include <fv/fv.h>
+#if defined (__GNUC__) && !defined (__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#ifdef FV_USE_BOOST_ASIO
+namespace asio = boost::asio;
+#endif
+
+
+
+// Every heap allocation of the process, coroutine frames included
+static std::atomic_uint64_t g_allocs { 0 };
+
+void *operator new (size_t _size) {
+	g_allocs.fetch_add (1, std::memory_order_relaxed);
+	if (void *_p = std::malloc (_size ? _size : 1))
+		return _p;
+	throw std::bad_alloc {};
+}
+void *operator new (size_t _size, const std::nothrow_t &) noexcept {
+	g_allocs.fetch_add (1, std::memory_order_relaxed);
+	return std::malloc (_size ? _size : 1);
+}
+// Kept out of line, once inlined into the deletes gcc pairs free with operator new and warns
+#ifdef _MSC_VER
+__declspec (noinline)
+#else
+__attribute__ ((noinline))
+#endif
+static void _release (void *_p) { std::free (_p); }
+void operator delete (void *_p) noexcept { _release (_p); }
+void operator delete (void *_p, size_t) noexcept { _release (_p); }
+void operator delete (void *_p, const std::nothrow_t &) noexcept { _release (_p); }
+
+// Over-aligned types come here, they must be released by the matching aligned delete
+static void *_alloc_aligned (size_t _size, std::align_val_t _align) {
+	g_allocs.fetch_add (1, std::memory_order_relaxed);
+	size_t _a = static_cast<size_t> (_align);
+	_size = (_size ? _size + _a - 1 : _a) / _a * _a;
+#ifdef _MSC_VER
+	return ::_aligned_malloc (_size, _a);
+#else
+	return std::aligned_alloc (_a, _size);
+#endif
+}
+static void _free_aligned (void *_p) {
+#ifdef _MSC_VER
+	::_aligned_free (_p);
+#else
+	std::free (_p);
+#endif
+}
+void *operator new (size_t _size, std::align_val_t _align) {
+	if (void *_p = _alloc_aligned (_size, _align))
+		return _p;
+	throw std::bad_alloc {};
+}
+void *operator new (size_t _size, std::align_val_t _align, const std::nothrow_t &) noexcept {
+	return _alloc_aligned (_size, _align);
+}
+void operator delete (void *_p, std::align_val_t) noexcept { _free_aligned (_p); }
+void operator delete (void *_p, size_t, std::align_val_t) noexcept { _free_aligned (_p); }
+void operator delete (void *_p, std::align_val_t, const std::nothrow_t &) noexcept { _free_aligned (_p); }
+
+
+
+static constexpr uint16_t BenchPort = 28080;
+
+// Feeds prepared bytes to the parsers and swallows everything written
+struct MemConn: public fv::IConn2 {
+	std::string Input = "";
+	size_t Pos = 0, Written = 0;
+	fv::IoContext &Ctx;
+
+	MemConn (fv::IoContext &_ctx): Ctx (_ctx) {}
+	void Reset (std::string_view _input) { Input = _input; Pos = 0; _ClearRecv (); }
+	bool IsConnect () override { return true; }
+	Task<void> Send (char *_data, size_t _size) override { Written += _size; co_return; }
+	void Cancel () override {}
+	asio::any_io_executor GetExecutor () override { return Ctx.get_executor (); }
+	asio::ip::address GetRemoteAddress () override { return asio::ip::address_v4::loopback (); }
+
+protected:
+	Task<size_t> RecvImpl (char *_data, size_t _size) override {
+		size_t _n = std::min (_size, Input.size () - Pos);
+		::memcpy (_data, Input.data () + Pos, _n);
+		Pos += _n;
+		co_return _n;
+	}
+	Task<void> SendBuffers (const std::vector<asio::const_buffer> &_bufs) override {
+		for (auto &_buf : _bufs)
+			Written += _buf.size ();
+		co_return;
+	}
+};
+
+// Answers what was fed, then parks in the read like an idle keep-alive peer until Closed is set
+struct IdleConn: public MemConn {
+	fv::AsyncEvent Closed {};
+	size_t &Parked;
+
+	IdleConn (fv::IoContext &_ctx, size_t &_parked): MemConn (_ctx), Parked (_parked) {}
+
+protected:
+	Task<size_t> RecvImpl (char *_data, size_t _size) override {
+		if (Pos < Input.size ())
+			co_return co_await MemConn::RecvImpl (_data, _size);
+		Parked++;
+		co_await Closed.Wait ();
+		co_return 0;
+	}
+};
+
+// Resident set size of the process, 0 where it is not available
+static size_t _rss_bytes () {
+#ifdef __linux__
+	std::ifstream _statm { "/proc/self/statm" };
+	size_t _pages = 0, _resident = 0;
+	_statm >> _pages >> _resident;
+	return _resident * (size_t) ::sysconf (_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+// Runs a coroutine to completion on a private io_context of the calling thread
+template<typename F>
+static void _run_local (F &&_f) {
+	fv::IoContext _ctx;
+	asio::co_spawn (_ctx, [&_f, &_ctx] () -> Task<void> { co_await _f (_ctx); }, asio::detached);
+	_ctx.run ();
+}
+
+// Runs a coroutine on the fv::Tasks pool and blocks until it returns
+template<typename F>
+static void _run_pool (F &&_f) {
+	std::promise<void> _done;
+	fv::Tasks::RunAsync ([&_f, &_done] () -> Task<void> {
+		try {
+			co_await _f ();
+		} catch (std::exception &_e) {
+			std::cerr << "benchmark failed: " << _e.what () << '\n';
+		}
+		_done.set_value ();
+	});
+	_done.get_future ().wait ();
+}
+
+static void _set_latency_counters (benchmark::State &_state, std::vector<int64_t> &_ns) {
+	if (_ns.empty ())
+		return;
+	std::sort (_ns.begin (), _ns.end ());
+	auto _at = [&_ns] (double _q) { return (double) _ns [std::min ((size_t) (_q * _ns.size ()), _ns.size () - 1)] / 1000.0; };
+	_state.counters ["p50_us"] = _at (0.5);
+	_state.counters ["p90_us"] = _at (0.9);
+	_state.counters ["p99_us"] = _at (0.99);
+	_state.counters ["p999_us"] = _at (0.999);
+}
+
+static const std::string s_request_text = "GET /api/v1/items/42?fields=name,price&lang=en HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nAccept: */*\r\nAccept-Encoding: gzip\r\nUser-Agent: libfv_bench\r\nCookie: sid=0123456789abcdef\r\nConnection: keep-alive\r\n\r\n";
+
+
+
+// Micro benchmarks
+
+static void BM_RequestGetFromConn (benchmark::State &_state) {
+	_run_local ([&_state] (fv::IoContext &_ctx) -> Task<void> {
+		auto _conn = std::make_shared<MemConn> (_ctx);
+		std::shared_ptr<fv::IConn2> _iconn = _conn;
+		for (auto _ : _state) {
+			_conn->Reset (s_request_text);
+			fv::Request _req = co_await fv::Request::GetFromConn (_iconn, 8080);
+			benchmark::DoNotOptimize (_req.UrlPath);
+		}
+	});
+	_state.SetBytesProcessed (_state.iterations () * s_request_text.size ());
+}
+BENCHMARK (BM_RequestGetFromConn);
+
+static void BM_ResponseSerilize (benchmark::State &_state) {
+	fv::Response _res = fv::Response::FromText (std::string (_state.range (0), 'x'));
+	_res.Headers ["Content-Type"] = "text/plain";
+	std::string _out;
+	for (auto _ : _state) {
+		_out.clear ();
+		_res.SerilizeTo (_out);
+		benchmark::DoNotOptimize (_out.data ());
+	}
+	_state.SetBytesProcessed (_state.iterations () * _out.size ());
+}
+BENCHMARK (BM_ResponseSerilize)->Arg (64)->Arg (4096);
+
+static void BM_ParseUrl (benchmark::State &_state) {
+	std::string _url = "https://www.example.com:8443/api/v1/items?id=42&lang=en";
+	for (auto _ : _state)
+		benchmark::DoNotOptimize (fv::_parse_url (_url));
+}
+BENCHMARK (BM_ParseUrl);
+
+static void BM_Base64Encode (benchmark::State &_state) {
+	std::string _data (_state.range (0), '\0');
+	for (size_t i = 0; i < _data.size (); ++i)
+		_data [i] = (char) (i * 131);
+	for (auto _ : _state)
+		benchmark::DoNotOptimize (fv::base64_encode (_data));
+	_state.SetBytesProcessed (_state.iterations () * _data.size ());
+}
+BENCHMARK (BM_Base64Encode)->Arg (16)->Arg (4096);
+
+static void BM_PercentEncode (benchmark::State &_state) {
+	std::string _data = "name=hello world&path=/usr/local/bin&q=\xe4\xbd\xa0\xe5\xa5\xbd&x=a+b=c;d";
+	for (auto _ : _state)
+		benchmark::DoNotOptimize (fv::percent_encode (_data));
+	_state.SetBytesProcessed (_state.iterations () * _data.size ());
+}
+BENCHMARK (BM_PercentEncode);
+
+// Client frames are masked, server frames are not
+static void BM_WsEncodeFrame (benchmark::State &_state) {
+	std::string _data (_state.range (0), 'x');
+	bool _is_client = _state.range (1) != 0;
+	for (auto _ : _state)
+		benchmark::DoNotOptimize (fv::WsConn::EncodeFrame (_data.data (), _data.size (), fv::WsType::Binary, _is_client));
+	_state.SetBytesProcessed (_state.iterations () * _data.size ());
+}
+BENCHMARK (BM_WsEncodeFrame)->ArgsProduct ({ { 125, 65536 }, { 0, 1 } });
+
+// Repetitive JSON, the kind of payload permessage-deflate is meant for
+static std::string _json_payload (size_t _size) {
+	std::string _ret = "[";
+	for (int i = 0; _ret.size () < _size; ++i)
+		_ret += fmt::format ("{{\"id\":{},\"symbol\":\"SYM{}\",\"price\":{}.{:02},\"side\":\"{}\"}},", i, i % 50, 100 + i % 37, i % 100, i % 2 ? "buy" : "sell");
+	_ret.resize (_size - 1);
+	return _ret + "]";
+}
+
+// Deflate cost per message; "ratio" is wire bytes over payload bytes. Arg 1 keeps the
+// compressor context between messages (0 = server_no_context_takeover).
+static void BM_WsDeflate (benchmark::State &_state) {
+	std::string _data = _json_payload (_state.range (0));
+	fv::WsDeflateParams _params {};
+	_params.ServerNoContextTakeover = _state.range (1) == 0;
+	fv::WsDeflate _deflate { _params, false, fv::WsDeflateOptions {} };
+	size_t _out = 0;
+	for (auto _ : _state) {
+		std::string _payload = _deflate.Compress (_data);
+		_out += _payload.size ();
+		benchmark::DoNotOptimize (_payload.data ());
+	}
+	_state.SetBytesProcessed (_state.iterations () * _data.size ());
+	_state.counters ["ratio"] = (double) _out / (_state.iterations () * _data.size ());
+}
+BENCHMARK (BM_WsDeflate)->ArgsProduct ({ { 512, 16384 }, { 0, 1 } });
+
+// Route lookup over 1000 routes, radix tree against the exact-match map HttpServerBase used before
+static std::vector<std::string> _route_paths () {
+	std::vector<std::string> _paths;
+	for (int i = 0; i < 1000; ++i)
+		_paths.push_back (fmt::format ("/api/v{}/resource{}/items", i % 3, i));
+	return _paths;
+}
+
+static void BM_RouterFind (benchmark::State &_state) {
+	fv::Router<int> _router;
+	auto _paths = _route_paths ();
+	for (size_t i = 0; i < _paths.size (); ++i)
+		_router.Add (std::nullopt, _paths [i], (int) i);
+	_router.Add (fv::MethodType::Get, "/users/:id/posts/:post", 1000);
+	std::string _static = _paths [637], _param = "/users/42/posts/7";
+	fv::RouteParams _params;
+	for (auto _ : _state) {
+		benchmark::DoNotOptimize (_router.Find (fv::MethodType::Get, _static, _params));
+		benchmark::DoNotOptimize (_router.Find (fv::MethodType::Get, _param, _params));
+	}
+}
+BENCHMARK (BM_RouterFind);
+
+static void BM_MapFind (benchmark::State &_state) {
+	std::unordered_map<std::string, int> _map;
+	auto _paths = _route_paths ();
+	for (size_t i = 0; i < _paths.size (); ++i)
+		_map [_paths [i]] = (int) i;
+	fv::Request _req;
+	_req.UrlPath = _paths [637];
+	// the parameterized path misses the map, a prebuilt key keeps its construction out of the loop
+	std::string _miss = "/users/42/posts/7";
+	for (auto _ : _state) {
+		if (_map.contains (_req.UrlPath))
+			benchmark::DoNotOptimize (_map [_req.UrlPath]);
+		benchmark::DoNotOptimize (_map.contains (_miss));
+	}
+}
+BENCHMARK (BM_MapFind);
+
+// WsHub fan-out of one 128 byte message to N in-memory subscribers, write queues included
+static void BM_WsHubPublish (benchmark::State &_state) {
+	size_t _dropped = 0;
+	_run_local ([&] (fv::IoContext &_ctx) -> Task<void> {
+		fv::WsHub _hub;
+		std::vector<std::shared_ptr<fv::WsConn>> _subs;
+		for (int64_t i = 0; i < _state.range (0); ++i) {
+			_subs.emplace_back (std::make_shared<fv::WsConn> (std::make_shared<MemConn> (_ctx), false));
+			_hub.Subscribe (_subs.back (), "ticker");
+		}
+		std::string _msg (128, 'x');
+		for (auto _ : _state) {
+			fv::BroadcastResult _ret = co_await _hub.Publish ("ticker", _msg);
+			_dropped += _ret.Dropped;
+		}
+	});
+	_state.SetItemsProcessed (_state.iterations () * _state.range (0));
+	_state.counters ["dropped"] = (double) _dropped;
+}
+BENCHMARK (BM_WsHubPublish)->Arg (1000)->Arg (100000);
+
+// Re-arming one timeout among 100k resident ones: a steady_timer per connection (0)
+// against the shared timer wheel (1)
+static void BM_TimerRearm (benchmark::State &_state) {
+	constexpr size_t _resident = 100000;
+	fv::IoContext _ctx;
+	if (_state.range (0) == 0) {
+		std::vector<std::unique_ptr<asio::steady_timer>> _timers;
+		for (size_t i = 0; i < _resident; ++i) {
+			_timers.emplace_back (std::make_unique<asio::steady_timer> (_ctx, std::chrono::seconds (60 + i % 60)));
+			_timers.back ()->async_wait ([] (const fv::ErrorCode &) {});
+		}
+		size_t i = 0;
+		for (auto _ : _state) {
+			auto &_timer = *_timers [i++ % _resident];
+			_timer.expires_after (std::chrono::seconds (60));
+			_timer.async_wait ([] (const fv::ErrorCode &) {});
+		}
+	} else {
+		auto &_wheel = fv::TimerWheel::Get (_ctx.get_executor ());
+		std::vector<std::shared_ptr<fv::TimerWheel::Timer>> _timers;
+		for (size_t i = 0; i < _resident; ++i)
+			_timers.emplace_back (_wheel.Schedule (std::chrono::seconds (60 + i % 60), [] () {}));
+		size_t i = 0;
+		for (auto _ : _state)
+			_wheel.Reschedule (_timers [i++ % _resident], std::chrono::seconds (60));
+	}
+	_state.SetItemsProcessed (_state.iterations ());
+}
+BENCHMARK (BM_TimerRearm)->Arg (0)->Arg (1);
+
+// Whole server request cycle on an in-memory connection: parse, route, handle, serialize.
+// allocs_per_req counts every heap allocation, coroutine frames included.
+static void BM_ServerRequestCycle (benchmark::State &_state) {
+	constexpr size_t _pipelined = 64;
+	std::string _input;
+	for (size_t i = 0; i < _pipelined; ++i)
+		_input += s_request_text;
+	fv::HttpServer _server;
+	_server.SetHttpHandler (fv::MethodType::Get, "/api/v1/items/:id", [] (fv::Request &_req) -> Task<fv::Response> {
+		co_return fv::Response::FromText ("hello world");
+	});
+	uint64_t _allocs = 0;
+	_run_local ([&] (fv::IoContext &_ctx) -> Task<void> {
+		auto _conn = std::make_shared<MemConn> (_ctx);
+		for (auto _ : _state) {
+			_conn->Reset (_input);
+			uint64_t _before = g_allocs.load ();
+			try {
+				// returns by throwing once the input is exhausted
+				co_await _server.ProcessRequests (_conn, 8080);
+			} catch (...) {
+			}
+			_allocs += g_allocs.load () - _before;
+		}
+	});
+	_state.SetItemsProcessed (_state.iterations () * _pipelined);
+	_state.counters ["allocs_per_req"] = (double) _allocs / (_state.iterations () * _pipelined);
+}
+BENCHMARK (BM_ServerRequestCycle);
+
+// Server memory held by `range (0)` idle keep-alive connections, each parked between
+// requests after answering one. The peers are in-memory, so the growth is server state
+// only: coroutine frames, read buffers and the idle-timeout watchdog.
+static void BM_ServerIdleConnections (benchmark::State &_state) {
+	size_t _count = (size_t) _state.range (0);
+	fv::HttpServer _server;
+	_server.SetHttpHandler (fv::MethodType::Get, "/api/v1/items/:id", [] (fv::Request &_req) -> Task<fv::Response> {
+		co_return fv::Response::FromText ("hello world");
+	});
+	size_t _rss = 0;
+	uint64_t _allocs = 0;
+	for (auto _ : _state) {
+		_run_local ([&] (fv::IoContext &_ctx) -> Task<void> {
+			auto _executor = co_await asio::this_coro::executor;
+			size_t _parked = 0, _finished = 0, _rss_before = _rss_bytes ();
+			uint64_t _allocs_before = g_allocs.load ();
+			std::vector<std::shared_ptr<IdleConn>> _conns;
+			_conns.reserve (_count);
+			for (size_t i = 0; i < _count; ++i) {
+				auto _conn = std::make_shared<IdleConn> (_ctx, _parked);
+				_conn->Reset (s_request_text);
+				_conns.push_back (_conn);
+				asio::co_spawn (_ctx, [&_server, &_finished, _conn] () -> Task<void> {
+					try {
+						co_await _server.ProcessRequests (_conn, 8080);
+					} catch (...) {
+					}
+					_finished++;
+				}, asio::detached);
+			}
+			while (_parked < _count)
+				co_await asio::post (_executor, fv::UseAwaitable);
+			_rss = _rss_bytes () - _rss_before;
+			_allocs = g_allocs.load () - _allocs_before;
+			for (auto &_conn : _conns)
+				_conn->Closed.Set ();
+			while (_finished < _count)
+				co_await asio::post (_executor, fv::UseAwaitable);
+		});
+	}
+	_state.counters ["rss_mb"] = (double) _rss / (1024 * 1024);
+	_state.counters ["rss_per_conn_kb"] = (double) _rss / 1024 / _count;
+	_state.counters ["allocs_per_conn"] = (double) _allocs / _count;
+}
+BENCHMARK (BM_ServerIdleConnections)->Arg (50000)->Iterations (1)->Unit (benchmark::kMillisecond);
+
+
+
+// Loopback macro benchmarks against an HttpServer on the fv::Tasks pool
+
+static fv::HttpServer s_server;
+// Upstream rig: four replicas of one service; replica 2 answers 20ms late, replica 3 fails
+static constexpr size_t UpstreamReplicas = 4;
+static fv::HttpServer s_replicas [UpstreamReplicas];
+static std::atomic_uint64_t s_replica_hits [UpstreamReplicas];
+
+static void _start_server () {
+	s_server.SetHttpHandler ("/hello", [] (fv::Request &_req) -> Task<fv::Response> {
+		co_return fv::Response::FromText ("hello world");
+	});
+	s_server.SetHttpHandler ("/ws", [] (fv::Request &_req) -> Task<fv::Response> {
+		if (!_req.IsWebsocket ())
+			co_return fv::Response::FromText ("please use websocket");
+		auto _conn = co_await _req.UpgradeWebsocket ();
+		try {
+			while (true) {
+				auto [_data, _type] = co_await _conn->Recv ();
+				if (_type == fv::WsType::Text)
+					co_await _conn->SendText (_data.data (), _data.size ());
+				else if (_type == fv::WsType::Binary)
+					co_await _conn->SendBinary (_data.data (), _data.size ());
+			}
+		} catch (...) {
+		}
+		co_return fv::Response::Empty ();
+	});
+	fv::Tasks::RunAsync ([] () -> Task<void> { co_await s_server.Run (BenchPort); });
+	for (size_t i = 0; i < UpstreamReplicas; ++i) {
+		s_replicas [i].SetHttpHandler ("/item", [i] (fv::Request &_req) -> Task<fv::Response> {
+			s_replica_hits [i]++;
+			if (i == 2)
+				co_await fv::Tasks::Delay (std::chrono::milliseconds (20));
+			fv::Response _res = fv::Response::FromText (i == 3 ? "error" : "item");
+			if (i == 3)
+				_res.HttpCode = 500;
+			co_return _res;
+		});
+		fv::Tasks::RunAsync ([i] () -> Task<void> { co_await s_replicas [i].Run ((uint16_t) (BenchPort + 1 + i)); });
+	}
+	std::this_thread::sleep_for (std::chrono::milliseconds (200));
+}
+
+// One keep-alive connection, requests in sequence
+static void BM_HttpKeepAlive (benchmark::State &_state) {
+	std::vector<int64_t> _ns;
+	uint64_t _allocs = 0;
+	_run_pool ([&] () -> Task<void> {
+		std::string _url = fmt::format ("http://127.0.0.1:{}/hello", BenchPort);
+		fv::Session _sess;
+		co_await _sess.Get (_url);
+		uint64_t _before = g_allocs.load ();
+		for (auto _ : _state) {
+			auto _start = std::chrono::steady_clock::now ();
+			fv::Response _res = co_await _sess.Get (_url);
+			_ns.push_back (std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - _start).count ());
+			if (_res.HttpCode != 200)
+				_state.SkipWithError ("unexpected status");
+		}
+		_allocs = g_allocs.load () - _before;
+	});
+	_state.SetItemsProcessed (_state.iterations ());
+	_set_latency_counters (_state, _ns);
+	// client and server together
+	_state.counters ["allocs_per_req"] = _state.iterations () ? (double) _allocs / _state.iterations () : 0;
+}
+BENCHMARK (BM_HttpKeepAlive)->UseRealTime ();
+
+// `range (0)` concurrent fv::Get calls per iteration over the session pool
+static void BM_SessionPoolThroughput (benchmark::State &_state) {
+	size_t _concurrency = (size_t) _state.range (0);
+	_run_pool ([&] () -> Task<void> {
+		std::string _url = fmt::format ("http://127.0.0.1:{}/hello", BenchPort);
+		for (auto _ : _state) {
+			auto _remaining = std::make_shared<std::atomic_size_t> (_concurrency);
+			auto _done = std::make_shared<fv::AsyncEvent> ();
+			for (size_t i = 0; i < _concurrency; ++i) {
+				fv::Tasks::RunAsync ([_url, _remaining, _done] () -> Task<void> {
+					try {
+						co_await fv::Get (_url);
+					} catch (...) {
+					}
+					if (--*_remaining == 0)
+						_done->Set ();
+				});
+			}
+			co_await _done->Wait ();
+		}
+	});
+	_state.SetItemsProcessed (_state.iterations () * _concurrency);
+}
+BENCHMARK (BM_SessionPoolThroughput)->Arg (1)->Arg (16)->Arg (64)->UseRealTime ();
+
+// fv::WhenAll of 256 requests, `range (0)` at a time
+static void BM_BatchWhenAll (benchmark::State &_state) {
+	constexpr size_t _count = 256;
+	_run_pool ([&] () -> Task<void> {
+		std::vector<fv::Request> _reqs;
+		for (size_t i = 0; i < _count; ++i)
+			_reqs.push_back (fv::Request { fmt::format ("http://127.0.0.1:{}/hello", BenchPort), fv::MethodType::Get });
+		for (auto _ : _state) {
+			auto _results = co_await fv::WhenAll (_reqs, (size_t) _state.range (0), (size_t) _state.range (0));
+			benchmark::DoNotOptimize (_results.data ());
+		}
+	});
+	_state.SetItemsProcessed (_state.iterations () * _count);
+}
+BENCHMARK (BM_BatchWhenAll)->Arg (8)->Arg (64)->UseRealTime ();
+
+// fv::Upstream over the replica rig, 16 requests in flight, power of two choices (0) or
+// least outstanding (1). "slow_share" and "failing_share" are the fractions of requests
+// that reached the misbehaving replicas; outlier ejection should keep both low.
+static void BM_UpstreamBalance (benchmark::State &_state) {
+	constexpr size_t _concurrency = 16;
+	std::vector<std::string> _urls;
+	for (size_t i = 0; i < UpstreamReplicas; ++i)
+		_urls.push_back (fmt::format ("http://127.0.0.1:{}", BenchPort + 1 + i));
+	fv::Upstream _upstream { _urls };
+	_upstream.Policy = _state.range (0) == 0 ? fv::LoadBalance::PowerOfTwoChoices : fv::LoadBalance::LeastOutstanding;
+	uint64_t _hits_before [UpstreamReplicas];
+	for (size_t i = 0; i < UpstreamReplicas; ++i)
+		_hits_before [i] = s_replica_hits [i].load ();
+	_run_pool ([&] () -> Task<void> {
+		for (auto _ : _state) {
+			auto _remaining = std::make_shared<std::atomic_size_t> (_concurrency);
+			auto _done = std::make_shared<fv::AsyncEvent> ();
+			for (size_t i = 0; i < _concurrency; ++i) {
+				fv::Tasks::RunAsync ([&_upstream, _remaining, _done] () -> Task<void> {
+					try {
+						co_await _upstream.Get ("/item");
+					} catch (...) {
+					}
+					if (--*_remaining == 0)
+						_done->Set ();
+				});
+			}
+			co_await _done->Wait ();
+		}
+	});
+	uint64_t _hits [UpstreamReplicas], _total = 0, _ejections = 0;
+	for (size_t i = 0; i < UpstreamReplicas; ++i)
+		_total += _hits [i] = s_replica_hits [i].load () - _hits_before [i];
+	for (auto &_stats : _upstream.GetStats ())
+		_ejections += _stats.EjectCount;
+	_state.SetItemsProcessed (_state.iterations () * _concurrency);
+	_state.counters ["slow_share"] = _total ? (double) _hits [2] / _total : 0;
+	_state.counters ["failing_share"] = _total ? (double) _hits [3] / _total : 0;
+	_state.counters ["ejections"] = (double) _ejections;
+}
+BENCHMARK (BM_UpstreamBalance)->Arg (0)->Arg (1)->UseRealTime ();
+
+// Text message round trips on one websocket connection
+static void BM_WsEcho (benchmark::State &_state) {
+	std::vector<int64_t> _ns;
+	_run_pool ([&] () -> Task<void> {
+		auto _conn = co_await fv::ConnectWS (fmt::format ("ws://127.0.0.1:{}/ws", BenchPort));
+		std::string _msg (_state.range (0), 'x');
+		for (auto _ : _state) {
+			auto _start = std::chrono::steady_clock::now ();
+			co_await _conn->SendText (_msg.data (), _msg.size ());
+			auto [_data, _type] = co_await _conn->Recv ();
+			_ns.push_back (std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - _start).count ());
+			benchmark::DoNotOptimize (_data.data ());
+		}
+		co_await _conn->Close ();
+	});
+	_state.SetItemsProcessed (_state.iterations ());
+	_state.SetBytesProcessed (_state.iterations () * _state.range (0));
+	_set_latency_counters (_state, _ns);
+}
+BENCHMARK (BM_WsEcho)->Arg (32)->Arg (4096)->UseRealTime ();
+
+// JSON round trips with permessage-deflate off (0) and on (1); "wire_bytes" counts both
+// directions as sent on the socket
+static void BM_WsEchoDeflate (benchmark::State &_state) {
+	std::vector<int64_t> _ns;
+	fv::Config::WebsocketDeflate.Enable = _state.range (1) != 0;
+	uint64_t _bytes_out = fv::Metrics::BytesOut.Get ();
+	_run_pool ([&] () -> Task<void> {
+		auto _conn = co_await fv::ConnectWS (fmt::format ("ws://127.0.0.1:{}/ws", BenchPort));
+		std::string _msg = _json_payload (_state.range (0));
+		for (auto _ : _state) {
+			auto _start = std::chrono::steady_clock::now ();
+			co_await _conn->SendText (_msg.data (), _msg.size ());
+			auto [_data, _type] = co_await _conn->Recv ();
+			_ns.push_back (std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - _start).count ());
+			benchmark::DoNotOptimize (_data.data ());
+		}
+		co_await _conn->Close ();
+	});
+	fv::Config::WebsocketDeflate.Enable = false;
+	_state.SetItemsProcessed (_state.iterations ());
+	_state.SetBytesProcessed (_state.iterations () * _state.range (0));
+	_state.counters ["wire_bytes"] = benchmark::Counter ((double) (fv::Metrics::BytesOut.Get () - _bytes_out), benchmark::Counter::kAvgIterations);
+	_set_latency_counters (_state, _ns);
+}
+BENCHMARK (BM_WsEchoDeflate)->ArgsProduct ({ { 4096 }, { 0, 1 } })->UseRealTime ();
+
+
+
+// Results go to libfv_bench.json unless --benchmark_out is given
+int main (int argc, char **argv) {
+	std::vector<char *> _args (argv, argv + argc);
+	std::string _out = "--benchmark_out=libfv_bench.json", _format = "--benchmark_out_format=json";
+	if (std::none_of (_args.begin (), _args.end (), [] (char *_arg) { return std::string_view { _arg }.starts_with ("--benchmark_out="); })) {
+		_args.push_back (_out.data ());
+		_args.push_back (_format.data ());
+	}
+	int _argc = (int) _args.size ();
+	benchmark::Initialize (&_argc, _args.data ());
+	if (benchmark::ReportUnrecognizedArguments (_argc, _args.data ()))
+		return 1;
+
+	fv::Tasks::Init ();
+	std::thread _pool { [] () { fv::Tasks::Run (); } };
+	_start_server ();
+	benchmark::RunSpecifiedBenchmarks ();
+	s_server.Stop ();
+	for (auto &_replica : s_replicas)
+		_replica.Stop ();
+	fv::Tasks::Stop ();
+	_pool.join ();
+	benchmark::Shutdown ();
+	return 0;
+}